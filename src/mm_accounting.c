@@ -16,29 +16,53 @@
 #include <string.h>
 
 #include "mm_manager.h"
+#include "mm_trace.h"
 
 #define TELCO_ID_REGION_CODE "\"%c%c\",\"%c%c%c\""
 
-#ifdef MYSQL_DB
-#define AUTO_INCREMENT  "AUTO_INCREMENT"
-#define SQL_IGNORE      "IGNORE "
-#else
-#define AUTO_INCREMENT "AUTOINCREMENT"
-#define SQL_IGNORE      ""
-#endif /* MYSQL */
+/* Fire the acct_save_return probe for a mm_acct_save_ function returning rc. */
+static inline int acct_trace_return(const char* func, int rc) {
+    MM_TRACE2(acct_save_return, func, rc);
+    return rc;
+}
+
+/*
+ * Insert an accounting record, emitting it to the event feed, in wire
+ * byte order, if it was added.  With the event feed enabled, the INSERT
+ * is not batched, so that duplicates ignored by the database are not
+ * emitted.
+ */
+static int acct_insert(void* db, const char* sql, const char* terminal_id, time_t received_time, const uint8_t* wire, int wire_len) {
+    int rc;
+
+    if (!mm_events_enabled()) {
+        return mm_sql_exec_batch(db, sql);
+    }
+
+    if ((rc = mm_sql_insert(db, sql)) < 0) {
+        return rc;
+    }
 
+    if ((rc > 0) && (wire_len > 0)) {
+        mm_events_emit(terminal_id, received_time, wire, (size_t)wire_len);
+    }
+
+    return 0;
+}
 
 int mm_acct_save_TALARM(void *db, mm_telco_t *telco, char *terminal_id, dlog_mt_alarm_t *alarm) {
     char sql[512] = { 0 };
     char timestamp_str[20] = { 0 };
     char received_time_str[16] = { 0 };
 
+    MM_TRACE2(acct_save_entry, __func__, terminal_id);
+
     printf("\t\tAlarm: %s: Type: %d (0x%02x) - %s\n",
             timestamp_to_string(alarm->timestamp, timestamp_str, sizeof(timestamp_str)),
             alarm->alarm_id, alarm->alarm_id,
             alarm_id_to_string(alarm->alarm_id));
 
-    snprintf(sql, sizeof(sql), "INSERT " SQL_IGNORE "INTO TALARM ( TERMINAL_ID, RECEIVED_DATE, RECEIVED_TIME, START_DATE, START_TIME, ALARM_ID, TELCO_ID, REGION_CODE,ALARM ) VALUES ( " \
+    snprintf(sql, sizeof(sql), "INSERT INTO TALARM ( TERMINAL_ID, RECEIVED_DATE, RECEIVED_TIME, START_DATE, START_TIME, ALARM_ID, TELCO_ID, REGION_CODE,ALARM ) VALUES ( " \
                                " \"%s\",%s,%s,%d," TELCO_ID_REGION_CODE ",\"%s\");",
         terminal_id,
         received_time_to_db_string(received_time_str, sizeof(received_time_str)),
@@ -48,7 +72,78 @@ int mm_acct_save_TALARM(void *db, mm_telco_t *telco, char *terminal_id, dlog_mt_
         telco->region_code[0], telco->region_code[1], telco->region_code[2],
         alarm_id_to_string(alarm->alarm_id));
 
-    return mm_sql_exec(db, sql);
+    uint8_t wire[sizeof(*alarm)];
+    int wire_len = mm_encode_alarm(alarm, wire, sizeof(wire));
+
+    return acct_trace_return(__func__, acct_insert(db, sql, terminal_id, time(NULL), wire, wire_len));
+}
+
+/*
+ * Key identifying a record in the duplicate filter: the record type,
+ * followed by the columns of the table's UNIQUE constraint.
+ */
+static size_t acct_dedup_key(uint8_t* key, uint8_t table_id, const char* terminal_id, uint16_t seq, const uint8_t* date) {
+    key[0] = table_id;
+    memset(&key[1], 0, 10);
+    memcpy(&key[1], terminal_id, strnlen(terminal_id, 10));
+    key[11] = seq & 0xFF;
+    key[12] = (seq >> 8) & 0xFF;
+    memcpy(&key[13], date, 6);
+
+    return 19;
+}
+
+/*
+ * Returns 1 if the CDR, in host byte order, is already in TCDR, or in
+ * cdr_log waiting to be inserted.  Only CDRs the duplicate filter may
+ * have seen are looked up.  The log is searched first, so a CDR inserted
+ * meanwhile is found in TCDR.
+ */
+int mm_acct_is_duplicate_TCDR(void *db, mm_cdrlog_t* cdr_log, const char* terminal_id, dlog_mt_call_details_t *cdr) {
+    char sql[256];
+    uint8_t key[32];
+    uint8_t* ts = cdr->start_timestamp;
+
+    if (!mm_dedup_test_and_add(key, acct_dedup_key(key, DLOG_MT_CALL_DETAILS, terminal_id, cdr->seq, ts))) {
+        return 0;
+    }
+
+    if (mm_cdrlog_find(cdr_log, terminal_id, cdr)) {
+        return 1;
+    }
+
+    snprintf(sql, sizeof(sql), "SELECT COUNT(*) FROM TCDR WHERE TERMINAL_ID=\"%s\" AND START_DATE=%04d%02d%02d AND START_TIME=%02d%02d%02d AND SEQ=%d;",
+        terminal_id, ts[0] + 1900, ts[1], ts[2], ts[3], ts[4], ts[5], cdr->seq);
+
+    return mm_sql_read_uint64(db, sql) == 1;
+}
+
+/*
+ * Returns 1 if the authorization request, in host byte order, received
+ * today is already in TAUTH.
+ */
+int mm_acct_is_duplicate_TAUTH(void *db, const char* terminal_id, dlog_mt_funf_card_auth_t* auth_request) {
+    char sql[256];
+    char received_date_str[9];
+    uint8_t key[32];
+    uint8_t date[6] = { 0 };
+    time_t rawtime = time(NULL);
+    struct tm ptm = { 0 };
+
+    mm_localtime(rawtime, &ptm);
+    date[0] = (uint8_t)ptm.tm_year;
+    date[1] = (uint8_t)(ptm.tm_mon + 1);
+    date[2] = (uint8_t)ptm.tm_mday;
+
+    if (!mm_dedup_test_and_add(key, acct_dedup_key(key, DLOG_MT_FUNF_CARD_AUTH, terminal_id, auth_request->seq, date))) {
+        return 0;
+    }
+
+    strftime(received_date_str, sizeof(received_date_str), "%Y%m%d", &ptm);
+    snprintf(sql, sizeof(sql), "SELECT COUNT(*) FROM TAUTH WHERE TERMINAL_ID=\"%s\" AND RECEIVED_DATE=%s AND SEQUENCE_NO=%d;",
+        terminal_id, received_date_str, auth_request->seq);
+
+    return mm_sql_read_uint64(db, sql) == 1;
 }
 
 int mm_acct_save_TAUTH(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt_funf_card_auth_t* auth_request) {
@@ -59,6 +154,8 @@ int mm_acct_save_TAUTH(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt_f
     char received_time_str[16] = { 0 };
     int exp_year;
 
+    MM_TRACE2(acct_save_entry, __func__, terminal_id);
+
     phone_num_to_string(phone_number_string, sizeof(phone_number_string), auth_request->phone_number,
         sizeof(auth_request->phone_number));
     phone_num_to_string(card_number_string, sizeof(card_number_string), auth_request->card_number,
@@ -97,7 +194,7 @@ int mm_acct_save_TAUTH(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt_f
         auth_request->unknown2);
 
 
-    snprintf(sql, sizeof(sql), "INSERT " SQL_IGNORE "INTO TAUTH ( TERMINAL_ID, RECEIVED_DATE, RECEIVED_TIME,"
+    snprintf(sql, sizeof(sql), "INSERT INTO TAUTH ( TERMINAL_ID, RECEIVED_DATE, RECEIVED_TIME,"
         "INTERNATIONAL_CALL_IND,"
         "CALLED_TELEPHONE_NO,"
         "CARRIER_XREF_NUMBER,"
@@ -138,7 +235,10 @@ int mm_acct_save_TAUTH(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt_f
         telco->id[0], telco->id[1],
         telco->region_code[0], telco->region_code[1], telco->region_code[2]);
 
-    return mm_sql_exec(db, sql);
+    uint8_t wire[sizeof(*auth_request)];
+    int wire_len = mm_encode_funf_card_auth(auth_request, wire, sizeof(wire));
+
+    return acct_trace_return(__func__, acct_insert(db, sql, terminal_id, time(NULL), wire, wire_len));
 }
 
 const char* str_tcdr_flags[] = {
@@ -164,9 +264,15 @@ const char* str_tcdr_rate_flags[] = {
 };
 
 int mm_acct_save_TCDR(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt_call_details_t *cdr) {
-    char sql[512] = { 0 };
+    MM_TRACE2(acct_save_entry, __func__, terminal_id);
+
+    mm_acct_print_TCDR(cdr);
+
+    return acct_trace_return(__func__, mm_acct_insert_TCDR(db, telco, terminal_id, cdr, time(NULL)));
+}
+
+void mm_acct_print_TCDR(dlog_mt_call_details_t *cdr) {
     char timestamp_str[20] = { 0 };
-    char received_time_str[16] = { 0 };
     char phone_number_string[21];
     char card_number_string[21];
     char call_type_str[38];
@@ -198,11 +304,21 @@ int mm_acct_save_TCDR(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt_ca
     print_bits(cdr->flags, (char**)str_tcdr_flags);
     printf("\n\t\t\tDLOG_MT_CALL_DETAILS Auth code: %" PRIu64 "\n", cdr->auth_code);
 #endif /* CDR_DEBUG */
+}
 
-    snprintf(sql, sizeof(sql), "INSERT " SQL_IGNORE "INTO TCDR ( TERMINAL_ID,RECEIVED_DATE,RECEIVED_TIME,SEQ,START_DATE,START_TIME,CALL_DURATION,CD_CALL_TYPE,CD_CALL_TYPE_STR,DIALED_NUM,CARD,REQUESTED,COLLECTED,CARRIER,RATE,TELCO_ID,REGION_CODE) VALUES ( " \
+/* Insert a CDR, in host byte order, received at received_time. */
+int mm_acct_insert_TCDR(void *db, mm_telco_t *telco, const char* terminal_id, dlog_mt_call_details_t *cdr, time_t received_time) {
+    char sql[512] = { 0 };
+    char timestamp_str[20] = { 0 };
+    char received_time_str[16] = { 0 };
+    char phone_number_string[21];
+    char card_number_string[21];
+    char call_type_str[38];
+
+    snprintf(sql, sizeof(sql), "INSERT INTO TCDR ( TERMINAL_ID,RECEIVED_DATE,RECEIVED_TIME,SEQ,START_DATE,START_TIME,CALL_DURATION,CD_CALL_TYPE,CD_CALL_TYPE_STR,DIALED_NUM,CARD,REQUESTED,COLLECTED,CARRIER,RATE,TELCO_ID,REGION_CODE) VALUES ( " \
                                " \"%s\",%s,%d,%s,%d,%d,\"%s\",\"%s\",\"%s\",\"%6.2f\",\"%6.2f\",%d,%d," TELCO_ID_REGION_CODE ");",
         terminal_id,
-        received_time_to_db_string(received_time_str, sizeof(received_time_str)),
+        time_to_db_string(received_time, received_time_str, sizeof(received_time_str)),
         cdr->seq,
         timestamp_to_db_string(cdr->start_timestamp, timestamp_str, sizeof(timestamp_str)),
         cdr->call_duration[0] * 3600 +
@@ -221,7 +337,10 @@ int mm_acct_save_TCDR(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt_ca
         telco->id[0], telco->id[1],
         telco->region_code[0], telco->region_code[1], telco->region_code[2]);
 
-    return mm_sql_exec(db, sql);
+    uint8_t wire[sizeof(*cdr)];
+    int wire_len = mm_encode_call_details(cdr, wire, sizeof(wire));
+
+    return acct_insert(db, sql, terminal_id, received_time, wire, wire_len);
 }
 
 int mm_acct_save_TCALLST(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt_summary_call_stats_t* summary_call_stats) {
@@ -232,6 +351,8 @@ int mm_acct_save_TCALLST(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt
     char timestamp3_str[20] = { 0 };
     char timestamp4_str[20] = { 0 };
 
+    MM_TRACE2(acct_save_entry, __func__, terminal_id);
+
     printf("\t\t\tSummary Call Statistics: From: %s, to: %s:\n",
         timestamp_to_string(summary_call_stats->start_timestamp, timestamp_str, sizeof(timestamp_str)),
         timestamp_to_string(summary_call_stats->end_timestamp, timestamp2_str, sizeof(timestamp2_str)));
@@ -260,7 +381,7 @@ int mm_acct_save_TCALLST(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt
     printf("\t\t\t\tDatajack calls attempted: %d\n", summary_call_stats->datajack_calls_attempt_count);
     printf("\t\t\t\tDatajack calls completed: %d\n", summary_call_stats->datajack_calls_complete_count);
 
-    snprintf(sql, sizeof(sql), "INSERT " SQL_IGNORE "INTO TCALLST("
+    snprintf(sql, sizeof(sql), "INSERT INTO TCALLST("
         "TERMINAL_ID,"
         "RECEIVED_DATE, RECEIVED_TIME,"
         "SUMMARY_PERIOD_START_DATE,SUMMARY_PERIOD_START_TIME,"
@@ -319,14 +440,28 @@ int mm_acct_save_TCALLST(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt
         telco->id[0], telco->id[1],
         telco->region_code[0], telco->region_code[1], telco->region_code[2]);
 
-    return mm_sql_exec(db, sql);
+    uint8_t wire[sizeof(*summary_call_stats)];
+    int wire_len = mm_encode_summary_call_stats(summary_call_stats, wire, sizeof(wire));
+
+    acct_insert(db, sql, terminal_id, time(NULL), wire, wire_len);
+
+    return acct_trace_return(__func__, mm_counters_save_TCALLST(db, terminal_id, summary_call_stats));
 }
 
-int mm_acct_load_TCASHST(void *db, char* terminal_id, cashbox_status_univ_t* cashbox_status) {
+int mm_acct_load_TCASHST(void *db, char* terminal_id, cashbox_status_univ_t* cashbox_status, mm_terminal_state_t* term_state) {
     char timestamp_str[20] = { 0 };
 
-    /* Retrieve cash box status for the current terminal. */
-    mm_sql_load_TCASHST(db, terminal_id, cashbox_status);
+    /* Retrieve cash box status for the current terminal, from the cache if possible. */
+    if ((term_state != NULL) && (term_state->valid & TERM_STATE_CASHBOX_VALID)) {
+        memcpy(cashbox_status, &term_state->cashbox_status, sizeof(cashbox_status_univ_t));
+    } else {
+        mm_sql_load_TCASHST(db, terminal_id, cashbox_status);
+
+        if (term_state != NULL) {
+            memcpy(&term_state->cashbox_status, cashbox_status, sizeof(cashbox_status_univ_t));
+            term_state->valid |= TERM_STATE_CASHBOX_VALID;
+        }
+    }
 
     printf("Load Cashbox status: %s Total: $%6.2f (%3d%% full): CA N:%d D:%d Q:%d $:%d - US N:%d D:%d Q:%d $:%d\n",
         timestamp_to_string(cashbox_status->timestamp, timestamp_str, sizeof(timestamp_str)),
@@ -344,10 +479,13 @@ int mm_acct_load_TCASHST(void *db, char* terminal_id, cashbox_status_univ_t* cas
     return 0;
 }
 
-int mm_acct_save_TCASHST(void *db, mm_telco_t *telco, char* terminal_id, cashbox_status_univ_t* cashbox_status) {
+int mm_acct_save_TCASHST(void *db, mm_telco_t *telco, char* terminal_id, cashbox_status_univ_t* cashbox_status, mm_terminal_state_t* term_state) {
     char sql[512] = { 0 };
     char received_time_str[16] = { 0 };
     char timestamp_str[20];
+    int rc;
+
+    MM_TRACE2(acct_save_entry, __func__, terminal_id);
 
     printf("\t\tCashbox status: %s: Total: $%6.2f (%3d%% full): CA N:%d D:%d Q:%d $:%d - US N:%d D:%d Q:%d $:%d\n",
         timestamp_to_string(cashbox_status->timestamp, timestamp_str, sizeof(timestamp_str)),
@@ -387,7 +525,28 @@ int mm_acct_save_TCASHST(void *db, mm_telco_t *telco, char* terminal_id, cashbox
         telco->id[0], telco->id[1],
         telco->region_code[0], telco->region_code[1], telco->region_code[2]);
 
-    return mm_sql_exec(db, sql);
+    rc = mm_sql_exec(db, sql);
+
+    /* The row is always replaced. */
+    if ((rc == 0) && mm_events_enabled()) {
+        uint8_t wire[sizeof(*cashbox_status)];
+
+        if (mm_encode_cashbox_status(cashbox_status, wire, sizeof(wire)) > 0) {
+            mm_events_emit(terminal_id, time(NULL), wire, sizeof(wire));
+        }
+    }
+
+    /* Write-through to the terminal state cache, or invalidate it if the database was not updated. */
+    if (term_state != NULL) {
+        if (rc == 0) {
+            memcpy(&term_state->cashbox_status, cashbox_status, sizeof(cashbox_status_univ_t));
+            term_state->valid |= TERM_STATE_CASHBOX_VALID;
+        } else {
+            term_state->valid &= ~TERM_STATE_CASHBOX_VALID;
+        }
+    }
+
+    return acct_trace_return(__func__, rc);
 }
 
 int mm_acct_save_TCOLLST(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt_cash_box_collection_t* cash_box_collection) {
@@ -395,6 +554,8 @@ int mm_acct_save_TCOLLST(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt
     char received_time_str[16] = { 0 };
     char timestamp_str[20];
 
+    MM_TRACE2(acct_save_entry, __func__, terminal_id);
+
     printf("\t\tCashbox Collection: %s: Total: $%6.2f (%3d%% full): CA N:%d D:%d Q:%d $:%d - US N:%d D:%d Q:%d $:%d\n",
         timestamp_to_string(cash_box_collection->timestamp, timestamp_str, sizeof(timestamp_str)),
         (float)cash_box_collection->currency_value / 100,
@@ -419,7 +580,7 @@ int mm_acct_save_TCOLLST(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt
     dump_hex(cash_box_collection->spare, sizeof(cash_box_collection->spare));
 #endif /* CASHBOX_DEBUG */
 
-    snprintf(sql, sizeof(sql), "INSERT " SQL_IGNORE "INTO TCOLLST ( "
+    snprintf(sql, sizeof(sql), "INSERT INTO TCOLLST ( "
         "TERMINAL_ID,RECEIVED_DATE,RECEIVED_TIME,COLLECTION_DATE,COLLECTION_TIME,"
         "CASH_BOX_STATUS, PERCENT_FULL, CURRENCY_VALUE,"
         "NUMBER_OF_CDN_NICKELS, NUMBER_OF_CDN_DIMES, NUMBER_OF_CDN_QUARTERS, NUMBER_OF_CDN_DOLLARS,"
@@ -444,13 +605,18 @@ int mm_acct_save_TCOLLST(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt
         telco->id[0], telco->id[1],
         telco->region_code[0], telco->region_code[1], telco->region_code[2]);
 
-    return mm_sql_exec(db, sql);
+    uint8_t wire[sizeof(*cash_box_collection)];
+    int wire_len = mm_encode_cash_box_collection(cash_box_collection, wire, sizeof(wire));
+
+    return acct_trace_return(__func__, acct_insert(db, sql, terminal_id, time(NULL), wire, wire_len));
 }
 
 int mm_acct_save_TOPCODE(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt_maint_req_t *maint) {
     char sql[256] = { 0 };
     char received_time_str[16] = { 0 };
 
+    MM_TRACE2(acct_save_entry, __func__, terminal_id);
+
     printf("\t\tMaintenance Type: %d (0x%03x) Access PIN: %02x%02x%01x\n",
         maint->type, maint->type,
         maint->access_pin[0], maint->access_pin[1], (maint->access_pin[2] & 0xF0) >> 4);
@@ -464,7 +630,10 @@ int mm_acct_save_TOPCODE(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt
         telco->id[0], telco->id[1],
         telco->region_code[0], telco->region_code[1], telco->region_code[2]);
 
-    return mm_sql_exec(db, sql);
+    uint8_t wire[sizeof(*maint)];
+    int wire_len = mm_encode_maint_req(maint, wire, sizeof(wire));
+
+    return acct_trace_return(__func__, acct_insert(db, sql, terminal_id, time(NULL), wire, wire_len));
 }
 
 int mm_acct_save_TPERFST(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt_perf_stats_record_t* perf_stats) {
@@ -473,7 +642,9 @@ int mm_acct_save_TPERFST(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt
     char timestamp_str[20];
     char timestamp2_str[20];
 
-    snprintf(sql, sizeof(sql), "INSERT " SQL_IGNORE "INTO TPERFST("
+    MM_TRACE2(acct_save_entry, __func__, terminal_id);
+
+    snprintf(sql, sizeof(sql), "INSERT INTO TPERFST("
         "TERMINAL_ID,"
         "RECEIVED_DATE, RECEIVED_TIME,"
         "SUMMARY_PERIOD_START_DATE,"
@@ -551,7 +722,11 @@ int mm_acct_save_TPERFST(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt
         telco->id[0], telco->id[1],
         telco->region_code[0], telco->region_code[1], telco->region_code[2]);
 
-    mm_sql_exec(db, sql);
+    uint8_t wire[sizeof(*perf_stats)];
+    int wire_len = mm_encode_perf_stats(perf_stats, wire, sizeof(wire));
+
+    acct_insert(db, sql, terminal_id, time(NULL), wire, wire_len);
+    mm_counters_save_TPERFST(db, terminal_id, perf_stats);
 
     printf("\t\tPerformance Statistics Record: From: %s, to: %s:\n",
         timestamp_to_string(perf_stats->timestamp, timestamp_str, sizeof(timestamp_str)),
@@ -561,22 +736,19 @@ int mm_acct_save_TPERFST(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt
         if (perf_stats->stats[i] > 0) printf("[%2zu] %27s: %5d\n", i, TPERFST_stats_to_str((uint8_t)i), perf_stats->stats[i]);
     }
 
-    return 0;
+    return acct_trace_return(__func__, 0);
 }
 
-int mm_acct_save_TSTATUS(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt_term_status_t* dlog_mt_term_status) {
+int mm_acct_save_TSTATUS(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt_term_status_t* dlog_mt_term_status, mm_terminal_state_t* term_state) {
     char sql[1536] = { 0 };
     uint8_t  serial_number[11] = { 0 };
     uint64_t term_status_word;
     uint64_t last_status_word = 0LL;
     int i;
 
-    for (i = 0; i < 5; i++) {
-        serial_number[i * 2] = ((dlog_mt_term_status->serialnum[i] & 0xf0) >> 4) + '0';
-        serial_number[i * 2 + 1] = (dlog_mt_term_status->serialnum[i] & 0x0f) + '0';
-    }
+    MM_TRACE2(acct_save_entry, __func__, terminal_id);
 
-    serial_number[10] = '\0';
+    mm_bcd_unpack((char *)serial_number, sizeof(serial_number), dlog_mt_term_status->serialnum, sizeof(dlog_mt_term_status->serialnum));
 
     term_status_word  = dlog_mt_term_status->status[0];
     term_status_word |= (uint64_t)(dlog_mt_term_status->status[1]) << 8;
@@ -588,10 +760,19 @@ int mm_acct_save_TSTATUS(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt
         serial_number, term_status_word);
 
     /* Retrieve the most recent terminal status, and update only if changed. */
-    snprintf(sql, sizeof(sql), "SELECT STATUS_WORD from TSTATUS where(TERMINAL_ID = %s) ORDER BY ID DESC LIMIT 1",
-        terminal_id);
+    if ((term_state != NULL) && (term_state->valid & TERM_STATE_STATUS_VALID)) {
+        last_status_word = term_state->status_word;
+    } else {
+        snprintf(sql, sizeof(sql), "SELECT STATUS_WORD from TSTATUS where(TERMINAL_ID = %s) ORDER BY ID DESC LIMIT 1",
+            terminal_id);
 
-    last_status_word = mm_sql_read_uint64(db, sql);
+        last_status_word = mm_sql_read_uint64(db, sql);
+
+        if (term_state != NULL) {
+            term_state->status_word = last_status_word;
+            term_state->valid |= TERM_STATE_STATUS_VALID;
+        }
+    }
 
     if (term_status_word != last_status_word) {
         char received_time_str[16] = { 0 };
@@ -699,7 +880,14 @@ int mm_acct_save_TSTATUS(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt
 
         if (mm_sql_exec(db, sql) != 0) {
             fprintf(stderr, "%s: Failed to save TSTATUS.", __func__);
-            return 1;
+            if (term_state != NULL) {
+                term_state->valid &= ~TERM_STATE_STATUS_VALID;
+            }
+            return acct_trace_return(__func__, 1);
+        }
+
+        if (term_state != NULL) {
+            term_state->status_word = term_status_word;
         }
     }
     /* Iterate over all the terminal status bits and display a message for any flags set. */
@@ -710,12 +898,16 @@ int mm_acct_save_TSTATUS(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt
         term_status_word >>= 1;
     }
 
-    return 0;
+    return acct_trace_return(__func__, 0);
 }
 
-int mm_acct_save_TSWVERS(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt_sw_version_t* dlog_mt_sw_version, uint8_t *terminal_type) {
+int mm_acct_save_TSWVERS(void *db, void *db_ro, mm_telco_t *telco, char* terminal_id, dlog_mt_sw_version_t* dlog_mt_sw_version, uint8_t *terminal_type, mm_terminal_state_t* term_state) {
     char sql[512] = { 0 };
     char received_time_str[16] = { 0 };
+    int  unchanged = 0;
+    int  rc;
+
+    MM_TRACE2(acct_save_entry, __func__, terminal_id);
 
     char control_rom_edition[sizeof(dlog_mt_sw_version->control_rom_edition) + 1] = { 0 };
     char control_version[sizeof(dlog_mt_sw_version->control_version) + 1] = { 0 };
@@ -736,7 +928,14 @@ int mm_acct_save_TSWVERS(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt
     validator_hw_ver[0] = dlog_mt_sw_version->validator_hw_ver[0] & 0x7F;
     validator_hw_ver[1] = dlog_mt_sw_version->validator_hw_ver[1] & 0x7F;
 
-    *terminal_type = mm_config_get_term_type_from_control_rom_edition(db, control_rom_edition);
+    /* If the software version has not changed since it was last seen, the terminal type is already known. */
+    if ((term_state != NULL) && (term_state->valid & TERM_STATE_SWVERS_VALID) &&
+        (memcmp(&term_state->sw_version, dlog_mt_sw_version, sizeof(dlog_mt_sw_version_t)) == 0)) {
+        *terminal_type = term_state->terminal_type;
+        unchanged = 1;
+    } else {
+        *terminal_type = mm_config_get_term_type_from_control_rom_edition(db_ro, control_rom_edition);
+    }
 
     if (*terminal_type == MTR_UNKNOWN) {
         printf("Error: Unknown control ROM edition %s\n", control_rom_edition);
@@ -756,7 +955,12 @@ int mm_acct_save_TSWVERS(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt
     printf("\t\t\tValidator Hardware Version: %s\n", validator_hw_ver);
     printf("\t\t\tValidator Software Version: %s\n", validator_sw_ver);
 
-    snprintf(sql, sizeof(sql), "INSERT " SQL_IGNORE "INTO TSWVERS ( "
+    /* Software version already recorded, nothing to insert. */
+    if (unchanged) {
+        return acct_trace_return(__func__, 0);
+    }
+
+    snprintf(sql, sizeof(sql), "INSERT INTO TSWVERS ( "
         "TERMINAL_ID,EFFECTIVE_DATE,EFFECTIVE_TIME,"
         "CONTROL_ROM_EDITION,CONTROL_VERSION_NO,TELEPHONY_ROM_EDITION,TELEPHONY_VERSION_NO,"
         "FEATURE_TERMINAL_TYPE,TERMINAL_TYPE,VALIDATOR_SOFTWARE_VERS,VALIDATOR_HARDWARE_VERS,"
@@ -776,14 +980,22 @@ int mm_acct_save_TSWVERS(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt
         telco->id[0], telco->id[1],
         telco->region_code[0], telco->region_code[1], telco->region_code[2]);
 
-    return mm_sql_exec(db, sql);
+    rc = mm_sql_exec(db, sql);
+
+    if ((rc == 0) && (term_state != NULL)) {
+        memcpy(&term_state->sw_version, dlog_mt_sw_version, sizeof(dlog_mt_sw_version_t));
+        term_state->terminal_type = *terminal_type;
+        term_state->valid |= TERM_STATE_SWVERS_VALID;
+    }
+
+    return acct_trace_return(__func__, rc);
 }
 
 int mm_acct_create_tables(void *db) {
     int rc;
 
     rc = mm_sql_exec(db, "CREATE TABLE IF NOT EXISTS TALARM ( "
-        "ID INTEGER NOT NULL PRIMARY KEY " AUTO_INCREMENT ","
+        "ID INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,"
         "TERMINAL_ID VARCHAR(10) NOT NULL,"
         "RECEIVED_DATE VARCHAR(8) NOT NULL,"
         "RECEIVED_TIME VARCHAR(6) NOT NULL,"
@@ -800,7 +1012,7 @@ int mm_acct_create_tables(void *db) {
     }
 
     rc = mm_sql_exec(db, "CREATE TABLE IF NOT EXISTS TAUTH ( "
-        "ID INTEGER NOT NULL PRIMARY KEY " AUTO_INCREMENT ","
+        "ID INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,"
         "TERMINAL_ID VARCHAR(10) NOT NULL,"
         "RECEIVED_DATE VARCHAR(8) NOT NULL,"
         "RECEIVED_TIME VARCHAR(6) NOT NULL,"
@@ -829,7 +1041,7 @@ int mm_acct_create_tables(void *db) {
     }
 
     rc = mm_sql_exec(db, "CREATE TABLE IF NOT EXISTS TCDR ( "
-        "ID INTEGER NOT NULL PRIMARY KEY " AUTO_INCREMENT ","
+        "ID INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,"
         "TERMINAL_ID VARCHAR(10) NOT NULL,"
         "RECEIVED_DATE VARCHAR(8) NOT NULL,"
         "RECEIVED_TIME VARCHAR(6) NOT NULL,"
@@ -855,7 +1067,7 @@ int mm_acct_create_tables(void *db) {
     }
 
     rc = mm_sql_exec(db, "CREATE TABLE IF NOT EXISTS TCALLST ( "
-        "ID INTEGER NOT NULL PRIMARY KEY " AUTO_INCREMENT ","
+        "ID INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,"
         "TERMINAL_ID VARCHAR(10) NOT NULL,"
         "RECEIVED_DATE VARCHAR(8) NOT NULL,"
         "RECEIVED_TIME VARCHAR(6) NOT NULL,"
@@ -903,7 +1115,7 @@ int mm_acct_create_tables(void *db) {
     }
 
     rc = mm_sql_exec(db, "CREATE TABLE IF NOT EXISTS TCASHST ( "
-        "ID INTEGER NOT NULL PRIMARY KEY " AUTO_INCREMENT ","
+        "ID INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,"
         "TERMINAL_ID VARCHAR(10) UNIQUE NOT NULL,"
         "RECEIVED_DATE VARCHAR(8) NOT NULL,"
         "RECEIVED_TIME VARCHAR(6) NOT NULL,"
@@ -930,7 +1142,7 @@ int mm_acct_create_tables(void *db) {
     }
 
     rc = mm_sql_exec(db, "CREATE TABLE IF NOT EXISTS TCOLLST ( "
-        "ID INTEGER NOT NULL PRIMARY KEY " AUTO_INCREMENT ","
+        "ID INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,"
         "TERMINAL_ID VARCHAR(10) NOT NULL, "
         "RECEIVED_DATE VARCHAR(8) NOT NULL,"
         "RECEIVED_TIME VARCHAR(6) NOT NULL,"
@@ -958,7 +1170,7 @@ int mm_acct_create_tables(void *db) {
     }
 
    rc = mm_sql_exec(db, "CREATE TABLE IF NOT EXISTS TOPCODE ( "
-        "ID INTEGER NOT NULL PRIMARY KEY " AUTO_INCREMENT ","
+        "ID INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,"
         "TERMINAL_ID VARCHAR(10) NOT NULL, "
         "RECEIVED_DATE VARCHAR(8) NOT NULL,"
         "RECEIVED_TIME VARCHAR(6) NOT NULL,"
@@ -973,7 +1185,7 @@ int mm_acct_create_tables(void *db) {
     }
 
     rc = mm_sql_exec(db, "CREATE TABLE IF NOT EXISTS TPERFST ( "
-        "ID INTEGER NOT NULL PRIMARY KEY " AUTO_INCREMENT ","
+        "ID INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,"
         "TERMINAL_ID VARCHAR(10) NOT NULL, "
         "RECEIVED_DATE VARCHAR(8) NOT NULL,"
         "RECEIVED_TIME VARCHAR(6) NOT NULL,"
@@ -1034,7 +1246,7 @@ int mm_acct_create_tables(void *db) {
     }
 
     rc = mm_sql_exec(db, "CREATE TABLE IF NOT EXISTS TSTATUS ( "
-        "ID INTEGER NOT NULL PRIMARY KEY " AUTO_INCREMENT ","
+        "ID INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,"
         "TERMINAL_ID VARCHAR(10) NOT NULL, "
         "RECEIVED_DATE VARCHAR(8) NOT NULL,"
         "RECEIVED_TIME VARCHAR(6) NOT NULL,"
@@ -1089,7 +1301,7 @@ int mm_acct_create_tables(void *db) {
     }
 
     rc = mm_sql_exec(db, "CREATE TABLE IF NOT EXISTS TSWVERS ( "
-        "ID INTEGER NOT NULL PRIMARY KEY " AUTO_INCREMENT ","
+        "ID INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,"
         "TERMINAL_ID VARCHAR(10) NOT NULL, "
         "EFFECTIVE_DATE VARCHAR(8) NOT NULL,"
         "EFFECTIVE_TIME VARCHAR(6) NOT NULL,"
@@ -0,0 +1,461 @@
+/*
+ * Alarm correlation for mm_manager.
+ *
+ * A terminal re-reports an alarm for as long as the condition persists,
+ * and a failing part may raise and clear the same alarm many times a
+ * day.  Rather than storing every report, the state of each alarm on
+ * each terminal is tracked in TALARM_STATE, and an alarm is stored in
+ * TALARM only when it opens.  The mm_manager processes serving other
+ * lines see the same state: each decision reads it afresh in a BEGIN
+ * IMMEDIATE transaction, so an alarm raised through one line may be
+ * cleared through another.  A repeat is recognised with a read alone;
+ * TALARM_STATE is only written when an alarm opens, clears or settles.
+ *
+ * Alarms 0-39 correspond to the bits of the terminal status word, and
+ * an open alarm clears when the terminal reports its status with the
+ * bit clear.  An alarm opening more than ALARM_FLAP_OPENS times in
+ * ALARM_FLAP_SECS is flapping; it is held in that state, with no
+ * further changes stored, until it has not changed for ALARM_FLAP_SECS.
+ *
+ * When ALARM_STORM_TERMINALS or more terminals open the same alarm
+ * within ALARM_STORM_SECS, as when a collection system goes down, a
+ * storm is stored in TALARM_STORM, and further opens of that alarm are
+ * only marked in TALARM_STATE rather than stored individually.  The
+ * terminals are counted from the last opens in TALARM_STATE, so the
+ * threshold holds however many lines they call in on.  The storm ends
+ * when fewer than half that many have opened it within ALARM_STORM_SECS;
+ * the terminals marked are then counted, each once however often it
+ * opened the alarm, and the alarms opened during the storm that are
+ * still open are stored in TALARM.
+ *
+ * www.github.com/hharte/mm_manager
+ *
+ * Copyright (c) 2022-2023, Howard M. Harte
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mm_manager.h"
+
+/* When this process last ran mm_alarm_step(); the alarms themselves are in the database. */
+static time_t alarm_step_time;
+
+static const char* alarm_state_str[] = { "cleared", "open", "flapping" };
+
+int mm_alarm_create_tables(void* db) {
+    int rc;
+
+    rc = mm_sql_exec(db, "CREATE TABLE IF NOT EXISTS TALARM_STATE ( "
+        "ID INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,"
+        "TERMINAL_ID VARCHAR(10) NOT NULL,"
+        "ALARM_ID INTEGER NOT NULL,"
+        "STATE TINYINT UNSIGNED NOT NULL,"
+        "SINCE_DATE VARCHAR(8) NOT NULL,"
+        "SINCE_TIME VARCHAR(6) NOT NULL,"
+        "OCCURRENCES INTEGER DEFAULT 0,"
+        "RAISED TINYINT UNSIGNED DEFAULT 0,"
+        "IN_STORM TINYINT UNSIGNED DEFAULT 0,"
+        "LAST_CHANGE BIGINT DEFAULT 0,"
+        "LAST_OPEN BIGINT DEFAULT 0,"
+        "FLAP_START BIGINT DEFAULT 0,"
+        "FLAP_OPENS INTEGER DEFAULT 0,"
+        "ALARM TEXT,"
+        "UNIQUE(TERMINAL_ID,ALARM_ID) "
+        ");");
+
+    if (rc != 0) {
+        fprintf(stderr, "%s: Failed to create table TALARM_STATE.\n", __func__);
+        return -1;
+    }
+
+    rc = mm_sql_exec(db, "CREATE TABLE IF NOT EXISTS TALARM_STORM ( "
+        "ID INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,"
+        "ALARM_ID INTEGER NOT NULL,"
+        "START_DATE VARCHAR(8) NOT NULL,"
+        "START_TIME VARCHAR(6) NOT NULL,"
+        "END_DATE VARCHAR(8),"
+        "END_TIME VARCHAR(6),"
+        "TERMINALS INTEGER DEFAULT 0,"
+        "ALARM TEXT,"
+        "UNIQUE(ALARM_ID,START_DATE,START_TIME) "
+        ");");
+
+    if (rc != 0) {
+        fprintf(stderr, "%s: Failed to create table TALARM_STORM.\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Store the alarm, with the time it entered its state if that changed. */
+static int alarm_save(void* db, const char* terminal_id, uint8_t alarm_id, const mm_alarm_state_t* alarm, time_t now) {
+    char sql[512] = { 0 };
+    char since_str[16] = { 0 };
+
+    if (alarm->changed || !alarm->stored) {
+        snprintf(sql, sizeof(sql), "REPLACE INTO TALARM_STATE ( TERMINAL_ID,ALARM_ID,STATE,SINCE_DATE,SINCE_TIME,OCCURRENCES,"
+            "RAISED,IN_STORM,LAST_CHANGE,LAST_OPEN,FLAP_START,FLAP_OPENS,ALARM ) "
+            "VALUES ( \"%s\",%d,%d,%s,%u,%d,%d,%" PRId64 ",%" PRId64 ",%" PRId64 ",%u,\"%s\");",
+            terminal_id, alarm_id, alarm->state,
+            time_to_db_string(now, since_str, sizeof(since_str)),
+            alarm->occurrences, alarm->raised, alarm->in_storm,
+            alarm->last_change, alarm->last_open, alarm->flap_start, alarm->flap_opens,
+            alarm_id_to_string(alarm_id));
+    } else {
+        snprintf(sql, sizeof(sql), "UPDATE TALARM_STATE SET OCCURRENCES = %u, RAISED = %d, IN_STORM = %d, "
+            "LAST_CHANGE = %" PRId64 ", LAST_OPEN = %" PRId64 ", FLAP_START = %" PRId64 ", FLAP_OPENS = %u "
+            "WHERE ( TERMINAL_ID = \"%s\" AND ALARM_ID = %d );",
+            alarm->occurrences, alarm->raised, alarm->in_storm,
+            alarm->last_change, alarm->last_open, alarm->flap_start, alarm->flap_opens,
+            terminal_id, alarm_id);
+    }
+
+    return mm_sql_exec(db, sql);
+}
+
+static void alarm_print(const char* terminal_id, uint8_t alarm_id, uint8_t state) {
+    printf("\t\tAlarm %s: Terminal %s: Type: %d (0x%02x) - %s\n", alarm_state_str[state], terminal_id,
+           alarm_id, alarm_id, alarm_id_to_string(alarm_id));
+}
+
+/* Change the alarm's state, and report the change. */
+static void alarm_set_state(const char* terminal_id, uint8_t alarm_id, mm_alarm_state_t* alarm, uint8_t state) {
+    alarm->state = state;
+    alarm->changed = 1;
+    alarm->occurrences = 0;
+
+    alarm_print(terminal_id, alarm_id, state);
+}
+
+/* Terminals that have opened alarm_id within ALARM_STORM_SECS, other than terminal_id if given. */
+static uint64_t alarm_storm_opens(void* db, uint8_t alarm_id, const char* terminal_id, time_t now) {
+    char sql[192] = { 0 };
+
+    snprintf(sql, sizeof(sql), "SELECT COUNT(*) from TALARM_STATE where (ALARM_ID = %d AND LAST_OPEN > %" PRId64
+        " AND TERMINAL_ID <> \"%s\")",
+        alarm_id, (int64_t)(now - ALARM_STORM_SECS), (terminal_id != NULL) ? terminal_id : "");
+
+    return mm_sql_read_uint64(db, sql);
+}
+
+/*
+ * Check for a storm of alarm_id as the terminal opens it.  Returns 1 if
+ * the alarm is in a storm, 2 if this open starts one, otherwise 0.
+ */
+static int alarm_storm_open(void* db, const char* terminal_id, uint8_t alarm_id, time_t now) {
+    char sql[256] = { 0 };
+    char start_str[16] = { 0 };
+    uint64_t opens;
+
+    snprintf(sql, sizeof(sql), "SELECT COUNT(*) from TALARM_STORM where (ALARM_ID = %d AND END_DATE IS NULL)", alarm_id);
+
+    if (mm_sql_read_uint64(db, sql) > 0) return 1;
+
+    /* This terminal's open is not stored yet. */
+    if ((opens = alarm_storm_opens(db, alarm_id, terminal_id, now) + 1) < ALARM_STORM_TERMINALS) return 0;
+
+    printf("\t\tAlarm storm started: Type: %d (0x%02x) - %s\n", alarm_id, alarm_id, alarm_id_to_string(alarm_id));
+
+    snprintf(sql, sizeof(sql), "INSERT INTO TALARM_STORM ( ALARM_ID,START_DATE,START_TIME,TERMINALS,ALARM ) "
+        "VALUES ( %d,%s,%" PRIu64 ",\"%s\");",
+        alarm_id, time_to_db_string(now, start_str, sizeof(start_str)), opens, alarm_id_to_string(alarm_id));
+    mm_sql_exec(db, sql);
+
+    /* The terminals that started it are counted in it, and their alarms are already stored. */
+    snprintf(sql, sizeof(sql), "UPDATE TALARM_STATE SET IN_STORM = %d "
+        "WHERE ( ALARM_ID = %d AND LAST_OPEN > %" PRId64 " AND TERMINAL_ID <> \"%s\" );",
+        ALARM_STORM_COUNTED, alarm_id, (int64_t)(now - ALARM_STORM_SECS), terminal_id);
+    mm_sql_exec(db, sql);
+
+    return 2;
+}
+
+/* Terminals whose alarms are stored at the end of a storm. */
+typedef struct alarm_storm_list {
+    char (*terminal_id)[11];
+    size_t count;
+    size_t size;
+} alarm_storm_list_t;
+
+static void alarm_storm_collect(const char* terminal_id, uint8_t alarm_id, uint8_t raised, void* arg) {
+    alarm_storm_list_t* list = (alarm_storm_list_t*)arg;
+    char (*grown)[11];
+
+    (void)alarm_id;
+    (void)raised;
+
+    if (list->count == list->size) {
+        if ((grown = realloc(list->terminal_id, (list->size + 64) * sizeof(*grown))) == NULL) return;
+        list->terminal_id = grown;
+        list->size += 64;
+    }
+
+    snprintf(list->terminal_id[list->count++], sizeof(list->terminal_id[0]), "%s", terminal_id);
+}
+
+/* Store the terminal's alarm in TALARM, as opened when the terminal last opened it. */
+static int alarm_storm_save(void* db, mm_telco_t* telco, char* terminal_id, uint8_t alarm_id) {
+    mm_alarm_state_t state;
+    dlog_mt_alarm_t alarm = { DLOG_MT_ALARM, { 0 }, alarm_id };
+    struct tm ptm = { 0 };
+
+    if (mm_sql_load_TALARM_STATE(db, terminal_id, alarm_id, &state) != 0) return -EIO;
+
+    mm_localtime((time_t)state.last_open, &ptm);
+    alarm.timestamp[0] = (uint8_t)ptm.tm_year;
+    alarm.timestamp[1] = (uint8_t)(ptm.tm_mon + 1);
+    alarm.timestamp[2] = (uint8_t)ptm.tm_mday;
+    alarm.timestamp[3] = (uint8_t)ptm.tm_hour;
+    alarm.timestamp[4] = (uint8_t)ptm.tm_min;
+    alarm.timestamp[5] = (uint8_t)ptm.tm_sec;
+
+    alarm_print(terminal_id, alarm_id, ALARM_STATE_OPEN);
+
+    return (mm_acct_save_TALARM(db, telco, terminal_id, &alarm) != 0) ? -EIO : 0;
+}
+
+static void alarm_print_settled(const char* terminal_id, uint8_t alarm_id, uint8_t raised, void* arg) {
+    (void)arg;
+
+    alarm_print(terminal_id, alarm_id, raised ? ALARM_STATE_OPEN : ALARM_STATE_CLEARED);
+}
+
+/* End the storm of alarm_id if it has subsided, and store the alarms left open by it. */
+static int alarm_storm_step(void* db, mm_telco_t* telco, uint8_t alarm_id, time_t now) {
+    alarm_storm_list_t list = { NULL, 0, 0 };
+    char sql[320] = { 0 };
+    char where[128] = { 0 };
+    char now_str[16] = { 0 };
+    uint64_t terminals;
+    size_t i;
+    int rc = 0;
+
+    if (alarm_storm_opens(db, alarm_id, NULL, now) >= ALARM_STORM_TERMINALS / 2) return 0;
+
+    snprintf(sql, sizeof(sql), "SELECT COUNT(*) from TALARM_STATE where (ALARM_ID = %d AND IN_STORM > 0)", alarm_id);
+    terminals = mm_sql_read_uint64(db, sql);
+
+    printf("Alarm storm ended: Type: %d (0x%02x) - %s, %" PRIu64 " terminals.\n",
+           alarm_id, alarm_id, alarm_id_to_string(alarm_id), terminals);
+
+    time_to_db_string(now, now_str, sizeof(now_str));
+
+    snprintf(sql, sizeof(sql), "UPDATE TALARM_STORM SET END_DATE = %.8s, END_TIME = %s, TERMINALS = %" PRIu64 " "
+        "WHERE ( ALARM_ID = %d AND END_DATE IS NULL );",
+        now_str, &now_str[9], terminals, alarm_id);
+
+    if (mm_sql_exec(db, sql) != 0) return -EIO;
+
+    /* Opened during the storm, and still open. */
+    snprintf(where, sizeof(where), "ALARM_ID = %d AND IN_STORM > 0 AND RAISED = 1 AND STATE = %d",
+             alarm_id, ALARM_STATE_CLEARED);
+    mm_sql_select_TALARM_STATE(db, where, alarm_storm_collect, &list);
+
+    for (i = 0; (i < list.count) && (rc == 0); i++) {
+        rc = alarm_storm_save(db, telco, list.terminal_id[i], alarm_id);
+    }
+    free(list.terminal_id);
+
+    if (rc != 0) return rc;
+
+    snprintf(sql, sizeof(sql), "UPDATE TALARM_STATE SET STATE = %d, SINCE_DATE = %.8s, SINCE_TIME = %s, "
+        "OCCURRENCES = 0 WHERE ( %s );",
+        ALARM_STATE_OPEN, now_str, &now_str[9], where);
+
+    if (mm_sql_exec(db, sql) != 0) return -EIO;
+
+    snprintf(sql, sizeof(sql), "UPDATE TALARM_STATE SET IN_STORM = 0 WHERE ( ALARM_ID = %d AND IN_STORM > 0 );", alarm_id);
+
+    return (mm_sql_exec(db, sql) != 0) ? -EIO : 0;
+}
+
+/* Settle the alarms that have not changed for ALARM_FLAP_SECS since they started flapping. */
+static int alarm_flap_step(void* db, time_t now) {
+    char sql[320] = { 0 };
+    char where[96] = { 0 };
+    char now_str[16] = { 0 };
+
+    snprintf(where, sizeof(where), "STATE = %d AND LAST_CHANGE <= %" PRId64,
+             ALARM_STATE_FLAPPING, (int64_t)(now - ALARM_FLAP_SECS));
+    mm_sql_select_TALARM_STATE(db, where, alarm_print_settled, NULL);
+
+    time_to_db_string(now, now_str, sizeof(now_str));
+
+    snprintf(sql, sizeof(sql), "UPDATE TALARM_STATE SET STATE = (CASE WHEN RAISED = 1 THEN %d ELSE %d END), "
+        "SINCE_DATE = %.8s, SINCE_TIME = %s, OCCURRENCES = 0, FLAP_OPENS = 0 WHERE ( %s );",
+        ALARM_STATE_OPEN, ALARM_STATE_CLEARED, now_str, &now_str[9], where);
+
+    return (mm_sql_exec(db, sql) != 0) ? -EIO : 0;
+}
+
+/* Commit the transaction begun by the caller, or roll it back if rc is an error. */
+static int alarm_commit(void* db, int rc) {
+    if ((rc >= 0) && (mm_sql_exec(db, "COMMIT;") == 0)) return rc;
+
+    fprintf(stderr, "%s: Alarm state not stored.\n", __func__);
+    mm_sql_exec(db, "ROLLBACK;");
+
+    return -EIO;
+}
+
+/* Open an alarm that was not raised.  Returns 1 if it should be stored in TALARM. */
+static int alarm_open(void* db, const char* terminal_id, uint8_t alarm_id, mm_alarm_state_t* alarm, time_t now) {
+    alarm->raised = 1;
+    alarm->last_change = now;
+    alarm->last_open = now;
+
+    if (now - alarm->flap_start >= ALARM_FLAP_SECS) {
+        alarm->flap_start = now;
+        alarm->flap_opens = 0;
+    }
+    alarm->flap_opens++;
+
+    switch (alarm_storm_open(db, terminal_id, alarm_id, now)) {
+        case 1:
+            /* Counted once however often it opens, and stored when the storm ends. */
+            if (alarm->in_storm == 0) alarm->in_storm = ALARM_STORM_HELD;
+            return 0;
+        case 2:
+            alarm->in_storm = ALARM_STORM_COUNTED;
+            break;
+        default:
+            break;
+    }
+
+    if (alarm->state == ALARM_STATE_FLAPPING) return 0;
+
+    if (alarm->flap_opens > ALARM_FLAP_OPENS) {
+        alarm_set_state(terminal_id, alarm_id, alarm, ALARM_STATE_FLAPPING);
+        return 0;
+    }
+
+    /* Reported by the caller, as it is stored in TALARM. */
+    alarm->state = ALARM_STATE_OPEN;
+    alarm->changed = 1;
+    alarm->occurrences = 0;
+
+    return 1;
+}
+
+/*
+ * Correlate an alarm reported by a terminal.  Returns 1 if the alarm
+ * has opened and should be stored in TALARM, or 0 if it is a repeat,
+ * flapping, or part of a storm.
+ */
+int mm_alarm_raise(void* db, const char* terminal_id, uint8_t alarm_id, time_t now) {
+    mm_alarm_state_t alarm;
+    char sql[192] = { 0 };
+    int rc = 0;
+
+    /* Not a status condition that can clear, so not correlated. */
+    if (alarm_id >= ALARM_ID_MAX) return 1;
+
+    /* A repeat changes nothing, whichever line the alarm was raised through. */
+    snprintf(sql, sizeof(sql), "SELECT COUNT(*) from TALARM_STATE where "
+        "(TERMINAL_ID = \"%s\" AND ALARM_ID = %d AND RAISED = 1)", terminal_id, alarm_id);
+
+    if (mm_sql_read_uint64(db, sql) > 0) return 0;
+
+    if (mm_sql_exec(db, "BEGIN IMMEDIATE;") != 0) return 1;
+
+    if (mm_sql_load_TALARM_STATE(db, terminal_id, alarm_id, &alarm) != 0) {
+        rc = -EIO;
+    } else if (!alarm.raised) {     /* Otherwise raised through another line since the repeat was checked. */
+        rc = alarm_open(db, terminal_id, alarm_id, &alarm, now);
+
+        alarm.occurrences++;
+
+        if (alarm_save(db, terminal_id, alarm_id, &alarm, now) != 0) rc = -EIO;
+    }
+
+    /* Stored in TALARM if its state could not be. */
+    return (alarm_commit(db, rc) < 0) ? 1 : rc;
+}
+
+static void alarm_mark_raised(const char* terminal_id, uint8_t alarm_id, uint8_t raised, void* arg) {
+    (void)terminal_id;
+    (void)raised;
+
+    if (alarm_id < ALARM_ID_MAX) *(uint64_t*)arg |= (uint64_t)1 << alarm_id;
+}
+
+/* Clear the terminal's raised alarms whose bits are clear in its 40-bit status word. */
+void mm_alarm_status(void* db, const char* terminal_id, const uint8_t* status, time_t now) {
+    mm_alarm_state_t alarm;
+    char where[64] = { 0 };
+    uint64_t raised = 0;
+    uint8_t alarm_id;
+    int rc = 0;
+
+    snprintf(where, sizeof(where), "TERMINAL_ID = \"%s\" AND RAISED = 1", terminal_id);
+    mm_sql_select_TALARM_STATE(db, where, alarm_mark_raised, &raised);
+
+    for (alarm_id = 0; alarm_id < ALARM_ID_MAX; alarm_id++) {
+        if (status[alarm_id >> 3] & (1 << (alarm_id & 7))) raised &= ~((uint64_t)1 << alarm_id);
+    }
+
+    if (raised == 0) return;
+
+    if (mm_sql_exec(db, "BEGIN IMMEDIATE;") != 0) return;
+
+    for (alarm_id = 0; (alarm_id < ALARM_ID_MAX) && (rc == 0); alarm_id++) {
+        if (!(raised & ((uint64_t)1 << alarm_id))) continue;
+
+        if (mm_sql_load_TALARM_STATE(db, terminal_id, alarm_id, &alarm) != 0) {
+            rc = -EIO;
+            break;
+        }
+
+        /* Cleared through another line since it was selected. */
+        if (!alarm.raised) continue;
+
+        alarm.raised = 0;
+        alarm.last_change = now;
+
+        /* An alarm opened during a storm stays marked, to be counted in it once. */
+        if (alarm.state == ALARM_STATE_OPEN) {
+            alarm_set_state(terminal_id, alarm_id, &alarm, ALARM_STATE_CLEARED);
+        }
+
+        if (alarm_save(db, terminal_id, alarm_id, &alarm, now) != 0) rc = -EIO;
+    }
+
+    alarm_commit(db, rc);
+}
+
+/*
+ * Every ALARM_STEP_SECS, end storms that have subsided, store alarms
+ * left open by them, and settle alarms that have stopped flapping.
+ */
+void mm_alarm_step(void* db, mm_telco_t* telco, time_t now) {
+    uint8_t storms[32] = { 0 };
+    int rc = 0;
+    int i;
+
+    if (now - alarm_step_time < ALARM_STEP_SECS) return;
+
+    alarm_step_time = now;
+
+    if (mm_sql_exec(db, "BEGIN IMMEDIATE;") != 0) return;
+
+    if (mm_sql_load_table_bitmap(db, "SELECT ALARM_ID from TALARM_STORM where (END_DATE IS NULL)", storms) != 0) {
+        rc = -EIO;
+    }
+
+    for (i = 0; (i < ALARM_ID_MAX) && (rc == 0); i++) {
+        if (TABLE_BITMAP_TEST(storms, i)) rc = alarm_storm_step(db, telco, (uint8_t)i, now);
+    }
+
+    if (rc == 0) rc = alarm_flap_step(db, now);
+
+    /* The alarms stored in TALARM may have been batched. */
+    if ((rc == 0) && (mm_sql_flush(db) != 0)) rc = -EIO;
+
+    alarm_commit(db, rc);
+}
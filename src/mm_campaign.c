@@ -0,0 +1,302 @@
+/*
+ * Fleet rollout campaigns for mm_manager.
+ *
+ * A campaign attaches a table image (stored in TERMDAT) to a set of
+ * terminals selected from the TTERMINAL registry by model, MTR and
+ * terminal ID pattern.  Campaign tables are sent with the next table
+ * download the terminal requests.  With -P they are also downloaded
+ * whenever an enrolled terminal ends an upload (see
+ * mm_update_pending_tables()), and during live-call sessions the
+ * terminal is asked to call back, with callbacks spread over time slots
+ * so that no more than the campaign's line capacity is used at once.
+ *
+ * www.github.com/hharte/mm_manager
+ *
+ * Copyright (c) 2022-2023, Howard M. Harte
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mm_manager.h"
+
+/* TCAMPTRM STATE */
+#define CAMPAIGN_TERM_PENDING   0   /* Table not yet sent */
+#define CAMPAIGN_TERM_CALLBACK  1   /* Callback requested at CALLBACK_TIME */
+#define CAMPAIGN_TERM_DONE      2   /* Table confirmed by the terminal */
+#define CAMPAIGN_TERM_FAILED    3   /* Gave up after CAMPAIGN_MAX_ATTEMPTS callbacks */
+
+#define CAMPAIGN_SLOT_SECS      (15 * 60)           /* Callback slot length */
+#define CAMPAIGN_MAX_SLOTS      (7 * 24 * 4)        /* Schedule callbacks up to a week ahead */
+#define CAMPAIGN_CALLBACK_DELAY (5 * 60)            /* Earliest callback after the current call */
+#define CAMPAIGN_RETRY_SECS     (60 * 60)           /* Missed callback is retried after this */
+#define CAMPAIGN_MAX_ATTEMPTS   5
+
+/*
+ * Create a campaign for the table image in buffer (including the
+ * table ID) and enroll the matching terminals.  model, mtr of 0 and
+ * a terminal_pattern of "%" match all terminals.
+ *
+ * Returns the campaign ID, or a negative error.
+ */
+int mm_campaign_create(mm_context_t* context, const char* name, uint8_t* buffer, size_t buflen,
+                       uint8_t model, uint16_t mtr, const char* terminal_pattern, uint16_t lines) {
+    char sql[512] = { 0 };
+    char received_time_str[16] = { 0 };
+    char db_name[41];
+    char db_pattern[11];
+    uint64_t version_timestamp = (uint64_t)time(NULL);
+    uint8_t table_id = buffer[0];
+    int campaign_id;
+
+    snprintf(db_name, sizeof(db_name), "%s", name);
+    snprintf(db_pattern, sizeof(db_pattern), "%s", terminal_pattern);
+
+    if (mm_table_save(context, table_id, version_timestamp, buffer, buflen) != 0) {
+        return -EIO;
+    }
+
+    snprintf(sql, sizeof(sql), "INSERT INTO TCAMPGN ( "
+        "NAME,TABLE_ID,VERSION_TIMESTAMP,MODEL,MTR,TERMINAL_PATTERN,MAX_LINES,ACTIVE,CREATED_DATE,CREATED_TIME"
+        " ) VALUES ( "
+        "\"%s\",%d,%" PRIu64 ",%d,%d,\"%s\",%d,1,%s);",
+        db_name, table_id, version_timestamp, model, mtr, db_pattern, lines,
+        received_time_to_db_string(received_time_str, sizeof(received_time_str)));
+
+    if (mm_sql_exec(context->database, sql) != 0) {
+        return -EIO;
+    }
+
+    campaign_id = (int)mm_sql_last_insert_id(context->database);
+
+    snprintf(sql, sizeof(sql), "INSERT INTO TCAMPTRM (CAMPAIGN_ID,TERMINAL_ID,STATE,ATTEMPTS,CALLBACK_TIME) "
+        "SELECT %d,TERMINAL_ID,%d,0,0 from TTERMINAL where "
+        "((%d = 0) OR (MODEL = %d)) AND ((%d = 0) OR (MTR = %d)) AND (TERMINAL_ID LIKE \"%s\");",
+        campaign_id, CAMPAIGN_TERM_PENDING, model, model, mtr, mtr, db_pattern);
+
+    if (mm_sql_exec(context->database, sql) != 0) {
+        return -EIO;
+    }
+
+    return campaign_id;
+}
+
+int mm_campaign_cancel(void* db, int campaign_id) {
+    char sql[128] = { 0 };
+
+    snprintf(sql, sizeof(sql), "UPDATE TCAMPGN SET ACTIVE = 0 WHERE (ID = %d);", campaign_id);
+
+    return mm_sql_exec(db, sql);
+}
+
+/* Print the progress of each campaign. */
+int mm_campaign_print_status(void* db, FILE* stream) {
+    char sql[768] = { 0 };
+
+    snprintf(sql, sizeof(sql), "SELECT C.ID, C.NAME, C.TABLE_ID, C.ACTIVE, C.MAX_LINES, COUNT(T.TERMINAL_ID),"
+        "SUM(T.STATE = %d), SUM(T.STATE = %d), SUM(T.STATE = %d), SUM(T.STATE = %d) "
+        "from TCAMPGN C LEFT JOIN TCAMPTRM T ON (T.CAMPAIGN_ID = C.ID) GROUP BY C.ID ORDER BY C.ID;",
+        CAMPAIGN_TERM_PENDING, CAMPAIGN_TERM_CALLBACK, CAMPAIGN_TERM_DONE, CAMPAIGN_TERM_FAILED);
+
+    fprintf(stream, "ID\tName\tTable\tActive\tLines\tTerminals\tPending\tCallback\tDone\tFailed\n");
+
+    return mm_sql_print_query(db, sql, stream);
+}
+
+/*
+ * Load the image of the most recent active campaign for this terminal
+ * and table, unless the terminal has already confirmed it.  Returns 0
+ * and allocates *buffer if there is one.
+ */
+int mm_campaign_load_table(void* db, const char* terminal_id, uint8_t table_id, uint8_t** buffer, size_t* len) {
+    char sql[512] = { 0 };
+    char where[256] = { 0 };
+    uint64_t data_length;
+    int blob_len;
+
+    snprintf(where, sizeof(where), "from TERMDAT D JOIN TCAMPGN C ON (D.TABLE_ID = C.TABLE_ID AND D.VERSION_TIMESTAMP = C.VERSION_TIMESTAMP) "
+        "JOIN TCAMPTRM T ON (T.CAMPAIGN_ID = C.ID) "
+        "where (T.TERMINAL_ID = \"%s\" AND C.TABLE_ID = %d AND C.ACTIVE = 1 AND T.STATE < %d) ORDER BY C.ID DESC LIMIT 1",
+        terminal_id, table_id, CAMPAIGN_TERM_DONE);
+
+    snprintf(sql, sizeof(sql), "SELECT D.DATA_LENGTH %s;", where);
+    data_length = mm_sql_read_uint64(db, sql);
+
+    if ((data_length == 0) || (data_length > UINT16_MAX)) return -ENOENT;
+
+    *buffer = (uint8_t*)calloc(data_length, sizeof(uint8_t));
+
+    if (*buffer == NULL) {
+        fprintf(stderr, "%s: Error: failed to allocate %" PRIu64 " bytes for table %d\n", __func__, data_length, table_id);
+        return -ENOMEM;
+    }
+
+    snprintf(sql, sizeof(sql), "SELECT D.TABLE_DATA %s;", where);
+    blob_len = mm_sql_read_blob(db, sql, *buffer, (size_t)data_length);
+
+    if (blob_len <= 0) {
+        free(*buffer);
+        *buffer = NULL;
+        return -EIO;
+    }
+
+    printf("Loaded table ID %d (0x%02x) from campaign image (%d bytes).\n", table_id, table_id, blob_len);
+    *len = blob_len;
+
+    return 0;
+}
+
+/* Mark the campaign tables this terminal has not confirmed yet as pending. */
+int mm_campaign_mark_pending(void* db, mm_terminal_state_t* term_state) {
+    char sql[256] = { 0 };
+
+    if (term_state == NULL) return -EINVAL;
+
+    snprintf(sql, sizeof(sql), "SELECT C.TABLE_ID from TCAMPTRM T JOIN TCAMPGN C ON (T.CAMPAIGN_ID = C.ID) "
+        "where (T.TERMINAL_ID = \"%s\" AND T.STATE < %d AND C.ACTIVE = 1);",
+        term_state->terminal_id, CAMPAIGN_TERM_DONE);
+
+    return mm_sql_load_table_bitmap(db, sql, term_state->pending_tables);
+}
+
+/* Set the bit for each table an active campaign rolls out to this terminal, in any state. */
+int mm_campaign_tables(void* db, const char* terminal_id, uint8_t* tables) {
+    char sql[256] = { 0 };
+
+    snprintf(sql, sizeof(sql), "SELECT C.TABLE_ID from TCAMPTRM T JOIN TCAMPGN C ON (T.CAMPAIGN_ID = C.ID) "
+        "where (T.TERMINAL_ID = \"%s\" AND C.ACTIVE = 1);",
+        terminal_id);
+
+    return mm_sql_load_table_bitmap(db, sql, tables);
+}
+
+int mm_campaign_table_confirmed(void* db, const char* terminal_id, uint8_t table_id) {
+    char sql[256] = { 0 };
+
+    snprintf(sql, sizeof(sql), "UPDATE TCAMPTRM SET STATE = %d WHERE (TERMINAL_ID = \"%s\" AND "
+        "CAMPAIGN_ID IN (SELECT ID from TCAMPGN where (TABLE_ID = %d AND ACTIVE = 1)));",
+        CAMPAIGN_TERM_DONE, terminal_id, table_id);
+
+    return mm_sql_exec(db, sql);
+}
+
+/*
+ * If the terminal still needs campaign tables, pick the first callback
+ * slot after now that has spare line capacity, and record the callback.
+ *
+ * Returns 0 and sets *callback_time if a callback should be requested.
+ */
+int mm_campaign_schedule_callback(void* db, const char* terminal_id, time_t now, time_t* callback_time) {
+    char sql[768] = { 0 };
+    char eligible[384] = { 0 };
+    uint64_t enrolled;
+    uint64_t lines;
+    uint64_t booked = 0;
+    uint64_t slots[CAMPAIGN_MAX_SLOTS];
+    time_t slot;
+    int i;
+
+    /* Most terminals are not in an active campaign. */
+    snprintf(sql, sizeof(sql), "SELECT COUNT(*) from TCAMPTRM T JOIN TCAMPGN C ON (T.CAMPAIGN_ID = C.ID) "
+        "where (T.TERMINAL_ID = \"%s\" AND T.STATE < %d AND C.ACTIVE = 1);",
+        terminal_id, CAMPAIGN_TERM_DONE);
+
+    enrolled = mm_sql_read_uint64(db, sql);
+
+    if ((enrolled == 0) || (enrolled > UINT32_MAX)) return -ENOENT;
+
+    /* Give up on terminals that missed too many callbacks. */
+    snprintf(sql, sizeof(sql), "UPDATE TCAMPTRM SET STATE = %d WHERE (TERMINAL_ID = \"%s\" AND STATE < %d AND ATTEMPTS >= %d);",
+        CAMPAIGN_TERM_FAILED, terminal_id, CAMPAIGN_TERM_DONE, CAMPAIGN_MAX_ATTEMPTS);
+    mm_sql_exec(db, sql);
+
+    snprintf(eligible, sizeof(eligible), "(TERMINAL_ID = \"%s\" AND ((STATE = %d) OR (STATE = %d AND CALLBACK_TIME < %" PRId64 ")) AND "
+        "CAMPAIGN_ID IN (SELECT ID from TCAMPGN where ACTIVE = 1))",
+        terminal_id, CAMPAIGN_TERM_PENDING, CAMPAIGN_TERM_CALLBACK, (int64_t)(now - CAMPAIGN_RETRY_SECS));
+
+    snprintf(sql, sizeof(sql), "SELECT MIN(C.MAX_LINES) from TCAMPGN C JOIN TCAMPTRM T ON (T.CAMPAIGN_ID = C.ID) where %s;", eligible);
+    lines = mm_sql_read_uint64(db, sql);
+
+    if ((lines == 0) || (lines > UINT16_MAX)) return -ENOENT;
+
+    slot = ((now + CAMPAIGN_CALLBACK_DELAY + CAMPAIGN_SLOT_SECS - 1) / CAMPAIGN_SLOT_SECS) * CAMPAIGN_SLOT_SECS;
+
+    /* Callbacks booked in each slot from now on, keyed by slot start. */
+    snprintf(sql, sizeof(sql), "SELECT CALLBACK_TIME - ((CALLBACK_TIME - %" PRId64 ") %% %d), COUNT(DISTINCT TERMINAL_ID) from TCAMPTRM where "
+        "(STATE = %d AND CALLBACK_TIME >= %" PRId64 " AND CALLBACK_TIME < %" PRId64 ") "
+        "GROUP BY CALLBACK_TIME - ((CALLBACK_TIME - %" PRId64 ") %% %d);",
+        (int64_t)slot, CAMPAIGN_SLOT_SECS, CAMPAIGN_TERM_CALLBACK,
+        (int64_t)slot, (int64_t)(slot + CAMPAIGN_MAX_SLOTS * CAMPAIGN_SLOT_SECS),
+        (int64_t)slot, CAMPAIGN_SLOT_SECS);
+
+    if (mm_sql_load_histogram(db, sql, (int64_t)slot, CAMPAIGN_SLOT_SECS, slots, CAMPAIGN_MAX_SLOTS) != 0) return -EIO;
+
+    for (i = 0; i < CAMPAIGN_MAX_SLOTS; i++, slot += CAMPAIGN_SLOT_SECS) {
+        booked = slots[i];
+
+        if (booked < lines) break;
+    }
+
+    if (i == CAMPAIGN_MAX_SLOTS) {
+        printf("%s: Terminal %s: No callback slot available.\n", __func__, terminal_id);
+        return -EBUSY;
+    }
+
+    /* Spread callbacks within the slot. */
+    *callback_time = slot + (time_t)((booked * CAMPAIGN_SLOT_SECS) / lines);
+
+    snprintf(sql, sizeof(sql), "UPDATE TCAMPTRM SET STATE = %d, CALLBACK_TIME = %" PRId64 ", ATTEMPTS = ATTEMPTS + 1 WHERE %s;",
+        CAMPAIGN_TERM_CALLBACK, (int64_t)*callback_time, eligible);
+
+    return mm_sql_exec(db, sql);
+}
+
+int mm_campaign_create_tables(void* db) {
+    int rc;
+
+    rc = mm_sql_exec(db, "CREATE TABLE IF NOT EXISTS TCAMPGN ( "
+        "ID INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,"
+        "NAME VARCHAR(40),"
+        "TABLE_ID TINYINT UNSIGNED NOT NULL,"
+        "VERSION_TIMESTAMP TIMESTAMP NOT NULL,"
+        "MODEL TINYINT UNSIGNED DEFAULT 0,"
+        "MTR SMALLINT UNSIGNED DEFAULT 0,"
+        "TERMINAL_PATTERN VARCHAR(10) DEFAULT \"%\","
+        "MAX_LINES SMALLINT UNSIGNED NOT NULL,"
+        "ACTIVE BOOLEAN DEFAULT 1,"
+        "CREATED_DATE VARCHAR(8) NOT NULL,"
+        "CREATED_TIME VARCHAR(6) NOT NULL"
+        ");");
+
+    if (rc != 0) {
+        fprintf(stderr, "%s: Failed to create table TCAMPGN.\n", __func__);
+        return -1;
+    }
+
+    rc = mm_sql_exec(db, "CREATE TABLE IF NOT EXISTS TCAMPTRM ( "
+        "CAMPAIGN_ID INTEGER NOT NULL,"
+        "TERMINAL_ID VARCHAR(10) NOT NULL,"
+        "STATE TINYINT UNSIGNED DEFAULT 0,"
+        "ATTEMPTS TINYINT UNSIGNED DEFAULT 0,"
+        "CALLBACK_TIME BIGINT DEFAULT 0,"
+        "PRIMARY KEY(CAMPAIGN_ID, TERMINAL_ID)"
+        ");");
+
+    if (rc != 0) {
+        fprintf(stderr, "%s: Failed to create table TCAMPTRM.\n", __func__);
+        return -1;
+    }
+
+    /* Callback slot search. */
+    rc = mm_sql_exec(db, "CREATE INDEX IF NOT EXISTS TCAMPTRM_CALLBACK ON TCAMPTRM (STATE, CALLBACK_TIME);");
+
+    if (rc != 0) {
+        fprintf(stderr, "%s: Failed to create index on TCAMPTRM.\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,553 @@
+/*
+ * Memory-mapped CDR log for mm_manager.
+ *
+ * With -L, call detail records are appended, exactly as received from
+ * the terminal, to fixed-size segment files cdr_<seq>.log in the log
+ * directory, which are mapped into memory.  Storing a CDR costs a copy
+ * into the mapping, so the CDR ACK is not held up by the database.  The
+ * pages are handed to the kernel (MS_ASYNC) before each reply and
+ * flushed to disk (MS_SYNC) when a segment fills and while idle.
+ *
+ * Each segment begins with a small header holding the number of records
+ * appended, and the number of those that have been inserted into TCDR.
+ * mm_cdrlog_index(), run from the connection idle hook, inserts pending
+ * records in batches and then advances the indexed count, so records are
+ * indexed again after a crash rather than lost.  The UNIQUE constraint on
+ * TCDR makes inserting a record twice harmless.  If a record cannot be
+ * inserted the batch is rolled back and retried on the next idle step.
+ *
+ * The processes serving different lines may share one log directory.
+ * cdr.lock in the directory holds the number of the segment being
+ * indexed and of the segment being appended to, and its locks serialize
+ * appending, and indexing, between processes.  Once a segment is full and
+ * indexed it is removed.
+ *
+ * www.github.com/hharte/mm_manager
+ *
+ * Copyright (c) 2022-2023, Howard M. Harte
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <unistd.h>
+#endif /* _WIN32 */
+
+#include "mm_manager.h"
+
+#define CDRLOG_SEGMENT_LEN  (sizeof(mm_cdrlog_hdr_t) + CDRLOG_SEGMENT_RECORDS * sizeof(mm_cdrlog_rec_t))
+
+/* Locks in cdr.lock */
+#define CDRLOG_LOCK_APPEND  (0)
+#define CDRLOG_LOCK_INDEX   (1)
+
+/* Segment numbers in cdr.lock, little-endian. */
+#define CDRLOG_STATE_INDEX  (0)     /* Segment being indexed, written with the index lock held */
+#define CDRLOG_STATE_APPEND (4)     /* Segment being appended to, written with the append lock held */
+
+static void cdrlog_segment_name(const mm_cdrlog_t* log, uint32_t seq, char* fname, size_t len) {
+    snprintf(fname, len, "%s/cdr_%08u.log", log->dir, seq);
+}
+
+static int cdrlog_segment_exists(const mm_cdrlog_t* log, uint32_t seq) {
+    char fname[300];
+    struct stat st;
+
+    cdrlog_segment_name(log, seq, fname, sizeof(fname));
+    return stat(fname, &st) == 0;
+}
+
+static int cdrlog_state_read(mm_cdrlog_t* log, uint32_t offset, uint32_t* seq) {
+    uint32_t value;
+
+    if (mm_lockfile_read(&log->lock, offset, &value, sizeof(value)) != (int)sizeof(value)) return -EIO;
+    *seq = LE32(value);
+
+    return 0;
+}
+
+static int cdrlog_state_write(mm_cdrlog_t* log, uint32_t offset, uint32_t seq) {
+    uint32_t value = LE32(seq);
+
+    return mm_lockfile_write(&log->lock, offset, &value, sizeof(value));
+}
+
+static int cdrlog_flush(mm_cdrlog_seg_t* seg, int wait) {
+    if (seg->hdr == NULL) return 0;
+
+#ifdef _WIN32
+    if (!FlushViewOfFile(seg->hdr, 0)) return -EIO;
+    if (wait && !FlushFileBuffers((HANDLE)seg->file)) return -EIO;
+#else
+    if (msync(seg->hdr, seg->len, wait ? MS_SYNC : MS_ASYNC) != 0) return -EIO;
+#endif /* _WIN32 */
+
+    return 0;
+}
+
+static void cdrlog_unmap(mm_cdrlog_seg_t* seg) {
+    if (seg->hdr == NULL) return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(seg->hdr);
+    CloseHandle((HANDLE)seg->mapping);
+    CloseHandle((HANDLE)seg->file);
+#else
+    munmap(seg->hdr, seg->len);
+    close(seg->fd);
+#endif /* _WIN32 */
+
+    seg->hdr = NULL;
+}
+
+/* Map segment seq, creating it if it does not exist and create is set. */
+static int cdrlog_map(mm_cdrlog_t* log, mm_cdrlog_seg_t* seg, uint32_t seq, int create) {
+    char fname[300];
+    mm_cdrlog_hdr_t* hdr;
+
+    cdrlog_segment_name(log, seq, fname, sizeof(fname));
+
+#ifdef _WIN32
+    HANDLE file, mapping;
+
+    file = CreateFileA(fname, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                       NULL, create ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        if (!create && (GetLastError() == ERROR_FILE_NOT_FOUND)) return -ENOENT;
+        fprintf(stderr, "%s: Cannot open %s.\n", __func__, fname);
+        return -EIO;
+    }
+
+    /* Extends the file to the segment length. */
+    mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, 0, (DWORD)CDRLOG_SEGMENT_LEN, NULL);
+    if (mapping == NULL) {
+        fprintf(stderr, "%s: Cannot map %s.\n", __func__, fname);
+        CloseHandle(file);
+        return -EIO;
+    }
+
+    hdr = (mm_cdrlog_hdr_t*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, CDRLOG_SEGMENT_LEN);
+    if (hdr == NULL) {
+        fprintf(stderr, "%s: Cannot map %s.\n", __func__, fname);
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return -EIO;
+    }
+
+    seg->file = file;
+    seg->mapping = mapping;
+#else
+    struct stat st;
+    int fd;
+
+    if ((fd = open(fname, create ? O_RDWR | O_CREAT : O_RDWR, 0644)) < 0) {
+        if (!create && (errno == ENOENT)) return -ENOENT;
+        fprintf(stderr, "%s: Cannot open %s: %s\n", __func__, fname, strerror(errno));
+        return -EIO;
+    }
+
+    /* The segment is created sparse, at its full length. */
+    if ((fstat(fd, &st) != 0) ||
+        ((st.st_size < (off_t)CDRLOG_SEGMENT_LEN) && (ftruncate(fd, CDRLOG_SEGMENT_LEN) != 0))) {
+        fprintf(stderr, "%s: Cannot size %s: %s\n", __func__, fname, strerror(errno));
+        close(fd);
+        return -EIO;
+    }
+
+    hdr = (mm_cdrlog_hdr_t*)mmap(NULL, CDRLOG_SEGMENT_LEN, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED) {
+        fprintf(stderr, "%s: Cannot map %s: %s\n", __func__, fname, strerror(errno));
+        close(fd);
+        return -EIO;
+    }
+
+    seg->fd = fd;
+#endif /* _WIN32 */
+
+    seg->seq = seq;
+    seg->hdr = hdr;
+    seg->len = CDRLOG_SEGMENT_LEN;
+
+    if (hdr->magic[0] == '\0') {
+        memcpy(hdr->magic, CDRLOG_MAGIC, sizeof(hdr->magic));
+        hdr->version = LE32(CDRLOG_VERSION);
+        hdr->record_len = LE32((uint32_t)sizeof(mm_cdrlog_rec_t));
+        hdr->capacity = LE32(CDRLOG_SEGMENT_RECORDS);
+        hdr->count = 0;
+        hdr->indexed = 0;
+    } else if ((memcmp(hdr->magic, CDRLOG_MAGIC, sizeof(hdr->magic)) != 0) ||
+               (LE32(hdr->version) != CDRLOG_VERSION) ||
+               (LE32(hdr->record_len) != sizeof(mm_cdrlog_rec_t)) ||
+               (LE32(hdr->capacity) != CDRLOG_SEGMENT_RECORDS) ||
+               (LE32(hdr->indexed) > LE32(hdr->count)) ||
+               (LE32(hdr->count) > CDRLOG_SEGMENT_RECORDS)) {
+        fprintf(stderr, "%s: %s is not a valid CDR log segment.\n", __func__, fname);
+        cdrlog_unmap(seg);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static mm_cdrlog_rec_t* cdrlog_record(mm_cdrlog_seg_t* seg, uint32_t index) {
+    return &((mm_cdrlog_rec_t*)(seg->hdr + 1))[index];
+}
+
+/* Remove a segment that is full and indexed. */
+static void cdrlog_remove(const mm_cdrlog_t* log, uint32_t seq) {
+    char fname[300];
+
+    cdrlog_segment_name(log, seq, fname, sizeof(fname));
+    if (remove(fname) != 0) {
+        fprintf(stderr, "%s: Cannot remove %s: %s\n", __func__, fname, strerror(errno));
+    }
+}
+
+/*
+ * Find the segments of a log without cdr.lock, written before it was
+ * introduced, or a new log: appending continues in the last segment, and
+ * indexing in the first segment with records not yet inserted into TCDR.
+ * Earlier segments are removed.  Called with the append lock held.
+ */
+static int cdrlog_scan(mm_cdrlog_t* log) {
+    uint32_t last = 0;
+    uint32_t index;
+    uint32_t seq;
+    int status;
+
+    while (cdrlog_segment_exists(log, last + 1)) {
+        last++;
+    }
+    index = last;
+
+    for (seq = 0; seq < last; seq++) {
+        if (cdrlog_map(log, &log->index, seq, 0) == 0) {
+            int pending = LE32(log->index.hdr->indexed) < LE32(log->index.hdr->count);
+
+            cdrlog_unmap(&log->index);
+            if (pending) {
+                index = seq;
+                break;
+            }
+            cdrlog_remove(log, seq);
+        }
+    }
+
+    /* Create the segment before other processes can see it. */
+    if ((status = cdrlog_map(log, &log->append, last, 1)) != 0) return status;
+
+    if (((status = cdrlog_state_write(log, CDRLOG_STATE_INDEX, index)) != 0) ||
+        ((status = cdrlog_state_write(log, CDRLOG_STATE_APPEND, last)) != 0)) {
+        fprintf(stderr, "%s: Cannot write cdr.lock in %s.\n", __func__, log->dir);
+    }
+
+    return status;
+}
+
+/*
+ * Map the segment being appended to, moving on to a new segment once it
+ * is full.  Called with the append lock held.
+ */
+static int cdrlog_append_segment(mm_cdrlog_t* log) {
+    uint32_t seq;
+    int status;
+
+    if ((status = cdrlog_state_read(log, CDRLOG_STATE_APPEND, &seq)) != 0) return status;
+
+    /* Another process has moved on to a new segment. */
+    if ((log->append.hdr != NULL) && (log->append.seq != seq)) {
+        cdrlog_unmap(&log->append);
+    }
+
+    if ((log->append.hdr == NULL) && ((status = cdrlog_map(log, &log->append, seq, 1)) != 0)) {
+        return status;
+    }
+
+    if (LE32(log->append.hdr->count) < CDRLOG_SEGMENT_RECORDS) return 0;
+
+    cdrlog_unmap(&log->append);
+    if ((status = cdrlog_map(log, &log->append, seq + 1, 1)) != 0) return status;
+
+    return cdrlog_state_write(log, CDRLOG_STATE_APPEND, seq + 1);
+}
+
+/* Open the CDR log in dir, which must exist. */
+mm_cdrlog_t* mm_cdrlog_open(const char* dir) {
+    char fname[300];
+    uint32_t state[2];
+    uint32_t index = 0;
+    mm_cdrlog_t* log;
+    int status;
+
+    if ((log = (mm_cdrlog_t*)calloc(1, sizeof(mm_cdrlog_t))) == NULL) {
+        return NULL;
+    }
+
+    snprintf(log->dir, sizeof(log->dir), "%s", dir);
+    snprintf(fname, sizeof(fname), "%s/cdr.lock", dir);
+
+    if (mm_lockfile_open(&log->lock, fname) != 0) {
+        free(log);
+        return NULL;
+    }
+
+    if (mm_lockfile_lock(&log->lock, CDRLOG_LOCK_APPEND, 1) != 0) {
+        fprintf(stderr, "%s: Cannot lock %s.\n", __func__, fname);
+        mm_lockfile_close(&log->lock);
+        free(log);
+        return NULL;
+    }
+
+    if (mm_lockfile_read(&log->lock, 0, state, sizeof(state)) == (int)sizeof(state)) {
+        status = cdrlog_append_segment(log);
+    } else {
+        status = cdrlog_scan(log);
+    }
+
+    mm_lockfile_unlock(&log->lock, CDRLOG_LOCK_APPEND);
+
+    if (status != 0) {
+        cdrlog_unmap(&log->append);
+        mm_lockfile_close(&log->lock);
+        free(log);
+        return NULL;
+    }
+
+    cdrlog_state_read(log, CDRLOG_STATE_INDEX, &index);
+
+    printf("CDR log %s: appending to segment %u, indexing segment %u.\n",
+           log->dir, log->append.seq, index);
+
+    return log;
+}
+
+void mm_cdrlog_close(mm_cdrlog_t* log) {
+    if (log == NULL) return;
+
+    cdrlog_flush(&log->append, 1);
+    cdrlog_flush(&log->index, 1);
+    cdrlog_unmap(&log->append);
+    cdrlog_unmap(&log->index);
+    mm_lockfile_close(&log->lock);
+    free(log);
+}
+
+/* Append a CDR, in host byte order, to the log, where it is kept as received from the terminal. */
+int mm_cdrlog_append(mm_cdrlog_t* log, const char* terminal_id, const dlog_mt_call_details_t* cdr, time_t received_time) {
+    mm_cdrlog_hdr_t* hdr;
+    mm_cdrlog_rec_t* rec;
+    mm_cdrlog_key_t* key;
+    uint32_t count;
+    int status;
+
+    if ((status = mm_lockfile_lock(&log->lock, CDRLOG_LOCK_APPEND, 1)) != 0) {
+        return status;
+    }
+
+    if ((status = cdrlog_append_segment(log)) != 0) {
+        fprintf(stderr, "%s: No segment to append to in %s.\n", __func__, log->dir);
+        mm_lockfile_unlock(&log->lock, CDRLOG_LOCK_APPEND);
+        return status;
+    }
+
+    hdr = log->append.hdr;
+    count = LE32(hdr->count);
+
+    rec = cdrlog_record(&log->append, count);
+    memset(rec->terminal_id, 0, sizeof(rec->terminal_id));
+    memcpy(rec->terminal_id, terminal_id, strnlen(terminal_id, sizeof(rec->terminal_id)));
+    rec->received_time = LE32((uint32_t)received_time);
+    mm_encode_call_details(cdr, (uint8_t*)&rec->cdr, sizeof(rec->cdr));
+
+    key = &log->recent[log->recent_next];
+    log->recent_next = (log->recent_next + 1) % CDRLOG_RECENT_RECORDS;
+    memcpy(key->terminal_id, rec->terminal_id, sizeof(key->terminal_id));
+    key->seq = cdr->seq;
+    memcpy(key->start_timestamp, cdr->start_timestamp, sizeof(key->start_timestamp));
+
+    /* Publish the record only once it is complete. */
+    hdr->count = LE32(count + 1);
+    log->unsynced++;
+
+    /* The next append moves on to a new segment. */
+    if (count + 1 == CDRLOG_SEGMENT_RECORDS) {
+        if (cdrlog_flush(&log->append, 1) != 0) {
+            fprintf(stderr, "%s: Failed to flush segment %u.\n", __func__, log->append.seq);
+        } else {
+            log->unsynced = 0;
+        }
+    }
+
+    mm_lockfile_unlock(&log->lock, CDRLOG_LOCK_APPEND);
+
+    return 0;
+}
+
+/*
+ * Returns 1 if a CDR, in host byte order, from terminal_id with the same
+ * sequence number and start time is among the last CDRLOG_RECENT_RECORDS
+ * appended by this process, or the records of the mapped append segment
+ * not yet inserted into TCDR, or 0 otherwise.  Earlier segments are not
+ * searched: a CDR logged twice is only inserted once, as TCDR is UNIQUE.
+ */
+int mm_cdrlog_find(mm_cdrlog_t* log, const char* terminal_id, const dlog_mt_call_details_t* cdr) {
+    char id[sizeof(((mm_cdrlog_rec_t*)0)->terminal_id)] = { 0 };
+    uint32_t count;
+    uint32_t i;
+
+    if (log == NULL) return 0;
+
+    memcpy(id, terminal_id, strnlen(terminal_id, sizeof(id)));
+
+    for (i = 0; i < CDRLOG_RECENT_RECORDS; i++) {
+        const mm_cdrlog_key_t* key = &log->recent[i];
+
+        if ((key->seq == cdr->seq) &&
+            (memcmp(key->terminal_id, id, sizeof(id)) == 0) &&
+            (memcmp(key->start_timestamp, cdr->start_timestamp, sizeof(key->start_timestamp)) == 0)) {
+            return 1;
+        }
+    }
+
+    if (log->append.hdr == NULL) return 0;
+
+    count = LE32(log->append.hdr->count);
+    for (i = LE32(log->append.hdr->indexed); i < count; i++) {
+        mm_cdrlog_rec_t* rec = cdrlog_record(&log->append, i);
+        dlog_mt_call_details_t logged;
+
+        if (memcmp(rec->terminal_id, id, sizeof(id)) != 0) continue;
+
+        mm_decode_call_details((const uint8_t*)&rec->cdr, sizeof(rec->cdr), &logged);
+        if ((logged.seq == cdr->seq) &&
+            (memcmp(logged.start_timestamp, cdr->start_timestamp, sizeof(logged.start_timestamp)) == 0)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Flush appended records: schedule the write if wait is 0, or wait for
+ * it to complete otherwise.
+ */
+int mm_cdrlog_sync(mm_cdrlog_t* log, int wait) {
+    int status;
+
+    if ((log == NULL) || (log->append.hdr == NULL)) return 0;
+    if (wait && (log->unsynced == 0)) return 0;
+
+    if ((status = cdrlog_flush(&log->append, wait)) != 0) {
+        fprintf(stderr, "%s: Failed to flush segment %u.\n", __func__, log->append.seq);
+        return status;
+    }
+
+    if (wait) log->unsynced = 0;
+
+    return 0;
+}
+
+/*
+ * Insert up to max_records records from the segment being indexed into
+ * TCDR, in one transaction.  The indexed count is only advanced once all
+ * of them are committed.
+ */
+static int cdrlog_index_segment(mm_cdrlog_t* log, void* db, mm_telco_t* telco, uint32_t max_records) {
+    mm_cdrlog_hdr_t* hdr = log->index.hdr;
+    uint32_t indexed = LE32(hdr->indexed);
+    uint32_t end = LE32(hdr->count);
+    uint32_t i;
+
+    if (end - indexed > max_records) {
+        end = indexed + max_records;
+    }
+
+    if (mm_sql_exec(db, "BEGIN;") != 0) {
+        return -EIO;
+    }
+
+    for (i = indexed; i < end; i++) {
+        mm_cdrlog_rec_t* rec = cdrlog_record(&log->index, i);
+        dlog_mt_call_details_t cdr;
+        char terminal_id[sizeof(rec->terminal_id) + 1] = { 0 };
+
+        memcpy(terminal_id, rec->terminal_id, sizeof(rec->terminal_id));
+        mm_decode_call_details((const uint8_t*)&rec->cdr, sizeof(rec->cdr), &cdr);
+
+        if (mm_acct_insert_TCDR(db, telco, terminal_id, &cdr, (time_t)LE32(rec->received_time)) < 0) break;
+    }
+
+    if ((i < end) || (mm_sql_flush(db) != 0) || (mm_sql_exec(db, "COMMIT;") != 0)) {
+        fprintf(stderr, "%s: Failed to index segment %u at record %u, will retry.\n", __func__, log->index.seq, i);
+        mm_sql_exec(db, "ROLLBACK;");
+        return -EIO;
+    }
+
+    hdr->indexed = LE32(end);
+    cdrlog_flush(&log->index, 0);
+
+    return (int)(end - indexed);
+}
+
+/*
+ * Insert up to max_records logged CDRs into TCDR, one transaction per
+ * segment.  Returns the number of records inserted, or a negative errno.
+ * Does nothing while another process is indexing.
+ */
+int mm_cdrlog_index(mm_cdrlog_t* log, void* db, mm_telco_t* telco, int max_records) {
+    uint32_t seq;
+    uint32_t append_seq;
+    int total = 0;
+    int status = 0;
+
+    if (log == NULL) return 0;
+
+    if (mm_lockfile_lock(&log->lock, CDRLOG_LOCK_INDEX, 0) != 0) return 0;
+
+    while (total < max_records) {
+        mm_cdrlog_hdr_t* hdr;
+
+        if (((status = cdrlog_state_read(log, CDRLOG_STATE_INDEX, &seq)) != 0) ||
+            ((status = cdrlog_state_read(log, CDRLOG_STATE_APPEND, &append_seq)) != 0)) {
+            break;
+        }
+
+        if ((log->index.hdr != NULL) && (log->index.seq != seq)) {
+            cdrlog_unmap(&log->index);
+        }
+
+        if ((log->index.hdr == NULL) && ((status = cdrlog_map(log, &log->index, seq, 1)) != 0)) {
+            break;
+        }
+        hdr = log->index.hdr;
+
+        /* Move on to the next segment once this one is full and indexed. */
+        if ((LE32(hdr->indexed) == CDRLOG_SEGMENT_RECORDS) && (seq < append_seq)) {
+            cdrlog_unmap(&log->index);
+            if ((status = cdrlog_state_write(log, CDRLOG_STATE_INDEX, seq + 1)) != 0) break;
+            cdrlog_remove(log, seq);
+            continue;
+        }
+
+        if (LE32(hdr->indexed) == LE32(hdr->count)) break;
+
+        if ((status = cdrlog_index_segment(log, db, telco, (uint32_t)(max_records - total))) < 0) {
+            break;
+        }
+        total += status;
+        status = 0;
+    }
+
+    mm_lockfile_unlock(&log->lock, CDRLOG_LOCK_INDEX);
+
+    return (status < 0) ? status : total;
+}
@@ -17,26 +17,32 @@
 
 #include "mm_manager.h"
 
-#define TERMTYP_CSV_FNAME    "config/control_rom_versions.csv"
 #define TELCO_ID_REGION_CODE "\"%c%c\",\"%c%c%c\""
 
-#ifdef MYSQL_DB
-#define AUTO_INCREMENT  "AUTO_INCREMENT"
-#define SQL_IGNORE      "IGNORE "
-#else
-#define AUTO_INCREMENT "AUTOINCREMENT"
-#define SQL_IGNORE      ""
-#endif /* MYSQL */
-
 /* Declare function prototypes */
 int mm_config_add_TERMTYP_entry(void *db, uint8_t terminal_type, const char *control_rom_edition, const char *description);
 
+/*
+ * Look up the terminal type in the table compiled from
+ * control_rom_versions.csv, falling back to TERMTYP in the
+ * database for editions imported with -x.
+ */
 uint8_t mm_config_get_term_type_from_control_rom_edition(void* db, const char* control_rom_edition) {
     char sql[256] = { 0 };
     char db_control_rom_edition[8];
+    size_t len;
+    uint32_t slot;
 
     snprintf(db_control_rom_edition, sizeof(db_control_rom_edition), "%s", control_rom_edition);
 
+    len = strlen(db_control_rom_edition);
+    slot = mm_hash32(MM_HASH32_INIT, (const uint8_t*)db_control_rom_edition, len) & (TERMTYP_TABLE_BUCKETS - 1);
+    slot = mm_hash32(termtyp_table_disp[slot], (const uint8_t*)db_control_rom_edition, len) & (TERMTYP_TABLE_SLOTS - 1);
+
+    if ((len > 0) && (strcmp(termtyp_table[slot].control_rom_edition, db_control_rom_edition) == 0)) {
+        return termtyp_table[slot].terminal_type;
+    }
+
     snprintf(sql, sizeof(sql), "SELECT TERMINAL_TYPE from TERMTYP where (CONTROL_ROM_EDITION = \"%s\"); ",
         db_control_rom_edition);
 
@@ -51,7 +57,7 @@ int mm_config_add_TERMTYP_entry(void *db, uint8_t terminal_type, const char *con
     snprintf(db_control_rom_edition, sizeof(db_control_rom_edition), "%s", control_rom_edition);
     snprintf(db_description, sizeof(db_description), "%s", description);
 
-    snprintf(sql, sizeof(sql), "INSERT " SQL_IGNORE "INTO TERMTYP ( "
+    snprintf(sql, sizeof(sql), "INSERT INTO TERMTYP ( "
         "TERMINAL_TYPE,"
         "CONTROL_ROM_EDITION,"
         "DESCRIPTION"
@@ -66,16 +72,9 @@ int mm_config_add_TERMTYP_entry(void *db, uint8_t terminal_type, const char *con
 
 int mm_config_create_tables(void *db) {
     int rc;
-    FILE* csvstream = NULL;
-    char csvline[255] = { 0 };
-    char* control_rom_edition = NULL;
-    uint8_t terminal_type = 0;
-    char* description = NULL;
-    int line = 0;
-    const char *tokens = ",";
 
     rc = mm_sql_exec(db, "CREATE TABLE IF NOT EXISTS TERMTYP ( "
-        "ID INTEGER NOT NULL PRIMARY KEY " AUTO_INCREMENT ","
+        "ID INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,"
         "TERMINAL_TYPE TINYINT NOT NULL, "
         "CONTROL_ROM_EDITION VARCHAR(7),"
         "DESCRIPTION VARCHAR(40),"
@@ -87,17 +86,33 @@ int mm_config_create_tables(void *db) {
         return -1;
     }
 
-    if (!(csvstream = fopen(TERMTYP_CSV_FNAME, "r"))) {
-        fprintf(stderr, "Error opening csv stream: %s\n", TERMTYP_CSV_FNAME);
+    return 0;
+}
+
+/* Import a control ROM versions CSV file into TERMTYP. */
+int mm_config_import_TERMTYP(void* db, const char* csv_fname) {
+    FILE* csvstream = NULL;
+    char csvline[255] = { 0 };
+    char* control_rom_edition = NULL;
+    uint8_t terminal_type = 0;
+    char* description = NULL;
+    int line = 0;
+    int entries = 0;
+    const char *tokens = ",";
+
+    if (!(csvstream = fopen(csv_fname, "r"))) {
+        fprintf(stderr, "Error opening csv stream: %s\n", csv_fname);
         return -EPERM;
     }
 
-    while (!feof(csvstream)) {
+    if (mm_sql_exec(db, "BEGIN TRANSACTION;") != 0) {
+        fclose(csvstream);
+        return -EIO;
+    }
+
+    while (fgets(csvline, sizeof(csvline), csvstream) != NULL) {
         char* tok;
-        if (fgets(csvline, sizeof(csvline), csvstream) == NULL) {
-            fprintf(stderr, "Error reading csv stream, line=%d", line);
-            break;
-        }
+
         line++;
         if (line == 1) continue; /* Skip over CSV header */
 
@@ -107,10 +122,18 @@ int mm_config_create_tables(void *db) {
         terminal_type = atoi(tok);
         description = strtok(NULL, tokens);
 
-        mm_config_add_TERMTYP_entry(db, terminal_type, control_rom_edition, description);
+        if (mm_config_add_TERMTYP_entry(db, terminal_type, control_rom_edition, description) == 0) {
+            entries++;
+        }
     }
 
     fclose(csvstream);
 
+    if (mm_sql_exec(db, "COMMIT;") != 0) {
+        return -EIO;
+    }
+
+    printf("Imported %d control ROM editions from %s.\n", entries, csv_fname);
+
     return 0;
 }
@@ -15,10 +15,16 @@
 #include <inttypes.h>
 #include <errno.h> /* Error number definitions */
 #include <time.h>  /* time_t, struct tm, time, gmtime */
+#ifdef _WIN32
+# include <windows.h>
+#else  /* ifdef _WIN32 */
+# include <unistd.h>
+#endif /* _WIN32 */
 
 #include "mm_manager.h"
 #include "mm_serial.h"
 #include "mm_udp.h"
+#include "mm_trace.h"
 
 extern int manager_running;
 extern const char* modem_responses[];
@@ -28,6 +34,7 @@ int mm_connection_open(mm_connection_t* connection, const char *modem_dev, int b
     int   status;
 
     connection->test_mode = test_mode;
+    connection->baudrate = baudrate;
     if (test_mode) {
         if (modem_dev == NULL) {
             (void)fprintf(stderr, "mm_manager: -f <filename> must be specified.\n");
@@ -58,6 +65,12 @@ int mm_connection_open(mm_connection_t* connection, const char *modem_dev, int b
         return(-ENODEV);
     }
 
+    if ((connection->noise_spec[0] != '\0') &&
+        (serial_noise_parse(connection->proto.serial_context, connection->noise_spec) != 0)) {
+        mm_connection_close(connection);
+        return(-EINVAL);
+    }
+
     init_serial(connection->proto.serial_context, baudrate);
     status = init_modem(connection->proto.serial_context, connection->modem_reset_string, connection->modem_init_string);
 
@@ -80,15 +93,20 @@ int mm_connection_wait(mm_connection_t* connection)
     struct tm ptm = { 0 };
 
     while (manager_running) {
+        if (connection->idle != NULL) {
+            connection->idle(connection->idle_arg);
+        }
+
         modem_response = wait_for_modem_response(connection->proto.serial_context, 1);
 
         mm_time(connection->test_mode, &rawtime);
-        localtime_r(&rawtime, &ptm);
+        mm_localtime(rawtime, &ptm);
 
         switch (modem_response) {
         case MODEM_RSP_OK:
             break;
         case MODEM_RSP_RING:
+            mm_status_state(connection->status, LINE_STATE_RINGING);
             printf("%04d-%02d-%02d %2d:%02d:%02d: Ringing...\n\n",
                 ptm.tm_year + 1900, ptm.tm_mon + 1, ptm.tm_mday, ptm.tm_hour, ptm.tm_min, ptm.tm_sec);
             continue;
@@ -97,9 +115,12 @@ int mm_connection_wait(mm_connection_t* connection)
                 ptm.tm_year + 1900, ptm.tm_mon + 1, ptm.tm_mday, ptm.tm_hour, ptm.tm_min, ptm.tm_sec);
 
             proto_connect(&connection->proto);
+            mm_status_state(connection->status, LINE_STATE_CONNECTED);
+            MM_TRACE0(session_start);
             break;
         case MODEM_RSP_NO_CARRIER:
             proto_disconnect(&connection->proto);
+            mm_status_state(connection->status, LINE_STATE_IDLE);
             printf("%04d-%02d-%02d %2d:%02d:%02d: Carrier lost.\n\n",
                 ptm.tm_year + 1900, ptm.tm_mon + 1, ptm.tm_mday, ptm.tm_hour, ptm.tm_min, ptm.tm_sec);
 
@@ -123,24 +144,60 @@ int mm_connection_wait(mm_connection_t* connection)
     return (connection->proto.connected);
 }
 
+/*
+ * Busy out the line for the given number of seconds, so that calls
+ * go to other lines in the hunt group while this one is unusable.
+ */
+int mm_connection_busy_out(mm_connection_t* connection, int seconds) {
+    int status;
+
+    if ((status = modem_off_hook(connection->proto.serial_context, 1)) != MODEM_RSP_OK) {
+        fprintf(stderr, "%s: Error taking modem off hook.\n", __func__);
+        return -EIO;
+    }
+
+    mm_status_state(connection->status, LINE_STATE_BUSY_OUT);
+
+    while (manager_running && (seconds-- > 0)) {
+#ifdef _WIN32
+        Sleep(1000);
+#else  /* ifdef _WIN32 */
+        sleep(1);
+#endif /* _WIN32 */
+    }
+
+    mm_status_state(connection->status, LINE_STATE_IDLE);
+
+    if ((status = modem_off_hook(connection->proto.serial_context, 0)) != MODEM_RSP_OK) {
+        fprintf(stderr, "%s: Error putting modem on hook.\n", __func__);
+        return -EIO;
+    }
+
+    return 0;
+}
+
 int mm_connection_close(mm_connection_t* connection) {
     close_serial(connection->proto.serial_context);
     connection->proto.serial_context = NULL;
 
     if (connection->bytestream) {
         fclose(connection->bytestream);
+        connection->bytestream = NULL;
     }
 
     if (connection->logstream) {
         fclose(connection->logstream);
+        connection->logstream = NULL;
     }
 
     if (connection->proto.pcapstream) {
         mm_close_pcap(connection->proto.pcapstream);
+        connection->proto.pcapstream = NULL;
     }
 
     if (connection->proto.send_udp) {
         mm_close_udp();
+        connection->proto.send_udp = 0;
     }
 
     return (0);
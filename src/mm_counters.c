@@ -0,0 +1,336 @@
+/*
+ * Counter deltas for mm_manager.
+ *
+ * The performance statistics (TPERFST) and summary call statistics
+ * (TCALLST) reported by a terminal are counts accumulated since the
+ * start of the summary period.  In addition to storing them as
+ * received, the difference from the terminal's previous report is
+ * stored in TPERFST_DELTA and TCALLST_DELTA, covering the interval
+ * between the two reports, so that reports can sum deltas over a time
+ * range rather than differencing successive rows.
+ *
+ * When the summary period start changes, the terminal has reset its
+ * counters, and the delta is the new value counted from the start of the
+ * period.  Most counters are 16 bits wide in the terminal.  One that goes
+ * backwards from COUNTERS_WRAP_MIN or above has wrapped, and the delta is
+ * taken modulo 2^16; one that goes backwards from below it, or a 32-bit
+ * counter that goes backwards, means the terminal reset its counters.
+ *
+ * The previous counters for each terminal are kept in TCOUNTERS.  As the
+ * terminal's previous report may have been received by the process
+ * serving another line, they are read, and replaced, in one write
+ * transaction with the delta.
+ *
+ * www.github.com/hharte/mm_manager
+ *
+ * Copyright (c) 2022-2023, Howard M. Harte
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mm_manager.h"
+
+static const char* tperfst_columns[PERF_STATS_MAX] = {
+    "CALL_ATTEMPTS_CNT",
+    "BUSY_SIGNAL_CNT",
+    "CALL_CLEARED_NO_DATA",
+    "NO_CARRIER_DETECT_CNT",
+    "CO_ACCESS_TO_DIAL_CNT1",
+    "CO_ACCESS_TO_DIAL_CNT2",
+    "CO_ACCESS_TO_DIAL_CNT3",
+    "CO_ACCESS_TO_DIAL_CNT4",
+    "CO_ACCESS_TO_DIAL_CNT5",
+    "CO_ACCESS_TO_DIAL_CNT6",
+    "CO_ACCESS_TO_DIAL_CNT7",
+    "DIAL_TO_CARRIER_CNT1",
+    "DIAL_TO_CARRIER_CNT2",
+    "DIAL_TO_CARRIER_CNT3",
+    "DIAL_TO_CARRIER_CNT4",
+    "DIAL_TO_CARRIER_CNT5",
+    "DIAL_TO_CARRIER_CNT6",
+    "DIAL_TO_CARRIER_CNT7",
+    "CARRIER_TO_1ST_PACKET_CNT1",
+    "CARRIER_TO_1ST_PACKET_CNT2",
+    "CARRIER_TO_1ST_PACKET_CNT3",
+    "CARRIER_TO_1ST_PACKET_CNT4",
+    "CARRIER_TO_1ST_PACKET_CNT5",
+    "CARRIER_TO_1ST_PACKET_CNT6",
+    "CARRIER_TO_1ST_PACKET_CNT7",
+    "USER_WAIT_TO_EXPECT_INFO_CNT1",
+    "USER_WAIT_TO_EXPECT_INFO_CNT2",
+    "USER_WAIT_TO_EXPECT_INFO_CNT3",
+    "USER_WAIT_TO_EXPECT_INFO_CNT4",
+    "USER_WAIT_TO_EXPECT_INFO_CNT5",
+    "USER_WAIT_TO_EXPECT_INFO_CNT6",
+    "USER_WAIT_TO_EXPECT_INFO_CNT7",
+    "TOTAL_DIALOGS_FAILED",
+    "NO_PACKET_RCVD_ERRORS",
+    "NO_PACKET_RETRIES_RCVD",
+    "INACTIVITY_COUNT",
+    "RETRY_LIMIT_OUT_OF_SERVICE",
+    "CARD_AUTH_TIMEOUTS",
+    "RATE_REQUEST_TIMEOUTS",
+    "NO_DIAL_TONE",
+    "SPARE1",
+    "SPARE2",
+    "SPARE3"
+};
+
+static const char* tcallst_columns[TCALLST_COUNTERS] = {
+    "TOTAL_CARD_CALL_CNT",
+    "FREE_CALL_CNT",
+    "INCOMING_CALL_CNT",
+    "UNANSWERED_CALL_CNT",
+    "ABANDONED_CALL_CNT",
+    "LOCAL_CARD_CALL_CNT",
+    "TOLL_CARD_CALL_CNT",
+    "OPERATOR_CALL_CNT",
+    "ZERO_PLUS_CALL_CNT",
+    "FOLLOW_ON_CALL_CNT",
+    "TOTAL_COIN_CALL_CNT",
+    "LOCAL_COIN_CALL_CNT",
+    "TOLL_COIN_CALL_CNT",
+    "FAIL_TO_POTS_COIN_CNT",
+    "INTER_LATA_TOLL_CARD_CALL_CNT",
+    "INTER_LATA_TOLL_COIN_CALL_CNT",
+    "REP_DIALER_PEG_CNT1",
+    "REP_DIALER_PEG_CNT2",
+    "REP_DIALER_PEG_CNT3",
+    "REP_DIALER_PEG_CNT4",
+    "REP_DIALER_PEG_CNT5",
+    "REP_DIALER_PEG_CNT6",
+    "REP_DIALER_PEG_CNT7",
+    "REP_DIALER_PEG_CNT8",
+    "REP_DIALER_PEG_CNT9",
+    "REP_DIALER_PEG_CNT10",
+    "TOTAL_CALL_DURATION",          /* Seconds */
+    "TOTAL_TIME_OFF_HOOK"           /* Seconds */
+};
+
+static int counters_create_delta_table(void* db, const char* table, const char** columns, uint32_t count) {
+    char sql[2048];
+    size_t len;
+    uint32_t i;
+
+    len = (size_t)snprintf(sql, sizeof(sql), "CREATE TABLE IF NOT EXISTS %s ( "
+        "ID INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,"
+        "TERMINAL_ID VARCHAR(10) NOT NULL,"
+        "RECEIVED_DATE VARCHAR(8) NOT NULL,"
+        "RECEIVED_TIME VARCHAR(6) NOT NULL,"
+        "INTERVAL_START_DATE VARCHAR(8) NOT NULL,"
+        "INTERVAL_START_TIME VARCHAR(6) NOT NULL,"
+        "INTERVAL_STOP_DATE VARCHAR(8) NOT NULL,"
+        "INTERVAL_STOP_TIME VARCHAR(6) NOT NULL,"
+        "COUNTER_RESET BOOLEAN DEFAULT 0,",
+        table);
+
+    for (i = 0; i < count; i++) {
+        len += (size_t)snprintf(&sql[len], sizeof(sql) - len, "%s INTEGER,", columns[i]);
+    }
+
+    snprintf(&sql[len], sizeof(sql) - len,
+        "UNIQUE(TERMINAL_ID,INTERVAL_STOP_DATE,INTERVAL_STOP_TIME) "
+        ");");
+
+    if (mm_sql_exec(db, sql) != 0) {
+        fprintf(stderr, "%s: Failed to create table %s.\n", __func__, table);
+        return -1;
+    }
+
+    return 0;
+}
+
+int mm_counters_create_tables(void* db) {
+    int rc;
+
+    rc = mm_sql_exec(db, "CREATE TABLE IF NOT EXISTS TCOUNTERS ( "
+        "ID INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,"
+        "TERMINAL_ID VARCHAR(10) NOT NULL,"
+        "RECORD_TYPE TINYINT UNSIGNED NOT NULL,"
+        "PERIOD_START BIGINT NOT NULL,"
+        "PERIOD_STOP BIGINT NOT NULL,"
+        "COUNTERS TEXT NOT NULL,"
+        "UNIQUE(TERMINAL_ID,RECORD_TYPE) "
+        ");");
+
+    if (rc != 0) {
+        fprintf(stderr, "%s: Failed to create table TCOUNTERS.\n", __func__);
+        return -1;
+    }
+
+    if (counters_create_delta_table(db, "TPERFST_DELTA", tperfst_columns, PERF_STATS_MAX) != 0) {
+        return -1;
+    }
+
+    return counters_create_delta_table(db, "TCALLST_DELTA", tcallst_columns, TCALLST_COUNTERS);
+}
+
+static uint64_t counters_timestamp(const uint8_t* timestamp) {
+    return (uint64_t)(timestamp[0] + 1900) * 10000000000ULL +
+           (uint64_t)timestamp[1] * 100000000ULL +
+           (uint64_t)timestamp[2] * 1000000ULL +
+           (uint64_t)timestamp[3] * 10000ULL +
+           (uint64_t)timestamp[4] * 100ULL +
+           (uint64_t)timestamp[5];
+}
+
+/*
+ * Store the delta between value[] and the terminal's previous counters
+ * prev, and make value[] the previous counters.  The first narrow
+ * counters are 16 bits wide, the rest 32 bits.
+ */
+static int counters_save_delta(void* db, const char* terminal_id, uint8_t record_type,
+                               const char* table, const char** columns, mm_counters_t* prev,
+                               const uint8_t* start_timestamp, const uint8_t* stop_timestamp,
+                               const uint32_t* value, uint32_t count, uint32_t narrow) {
+    char sql[2048];
+    char received_time_str[16] = { 0 };
+    uint64_t start = counters_timestamp(start_timestamp);
+    uint64_t stop = counters_timestamp(stop_timestamp);
+    uint64_t interval_start = start;
+    int from_prev = 0;
+    int reset = 0;
+    size_t len;
+    uint32_t i;
+
+    if (prev->count == count) {
+        /* A repeated or older report adds nothing. */
+        if (stop <= prev->period_stop) {
+            return 0;
+        }
+
+        reset = (start != prev->period_start);
+
+        for (i = 0; (i < count) && !reset; i++) {
+            if ((value[i] < prev->value[i]) && ((i >= narrow) || (prev->value[i] < COUNTERS_WRAP_MIN))) reset = 1;
+        }
+
+        if (!reset) {
+            from_prev = 1;
+            interval_start = prev->period_stop;
+        }
+    }
+
+    len = (size_t)snprintf(sql, sizeof(sql), "INSERT INTO %s ( TERMINAL_ID,RECEIVED_DATE,RECEIVED_TIME,"
+        "INTERVAL_START_DATE,INTERVAL_START_TIME,INTERVAL_STOP_DATE,INTERVAL_STOP_TIME,COUNTER_RESET", table);
+
+    for (i = 0; i < count; i++) {
+        len += (size_t)snprintf(&sql[len], sizeof(sql) - len, ",%s", columns[i]);
+    }
+
+    len += (size_t)snprintf(&sql[len], sizeof(sql) - len, " ) VALUES ( \"%s\",%s,"
+        "%08u,%06u,%08u,%06u,%d",
+        terminal_id,
+        received_time_to_db_string(received_time_str, sizeof(received_time_str)),
+        (uint32_t)(interval_start / 1000000), (uint32_t)(interval_start % 1000000),
+        (uint32_t)(stop / 1000000), (uint32_t)(stop % 1000000),
+        reset);
+
+    for (i = 0; i < count; i++) {
+        /* Counted from the start of the period on the first report, or after a reset. */
+        uint32_t delta = value[i];
+
+        if (from_prev) {
+            delta = value[i] - prev->value[i];
+            if (i < narrow) delta &= 0xFFFF;
+        }
+
+        len += (size_t)snprintf(&sql[len], sizeof(sql) - len, ",%u", delta);
+    }
+
+    snprintf(&sql[len], sizeof(sql) - len, ");");
+    if (mm_sql_exec_batch(db, sql) != 0) {
+        return -EIO;
+    }
+
+    len = (size_t)snprintf(sql, sizeof(sql), "REPLACE INTO TCOUNTERS ( TERMINAL_ID,RECORD_TYPE,PERIOD_START,PERIOD_STOP,COUNTERS"
+        " ) VALUES ( \"%s\",%d,%llu,%llu,\"",
+        terminal_id, record_type, (unsigned long long)start, (unsigned long long)stop);
+
+    for (i = 0; i < count; i++) {
+        len += (size_t)snprintf(&sql[len], sizeof(sql) - len, i ? ",%u" : "%u", value[i]);
+    }
+
+    snprintf(&sql[len], sizeof(sql) - len, "\");");
+
+    return mm_sql_exec_batch(db, sql);
+}
+
+/*
+ * Read the terminal's previous counters for record_type from TCOUNTERS,
+ * store the delta to value[] and replace them, in one write transaction.
+ */
+static int counters_save(void* db, const char* terminal_id, uint8_t record_type, const char* table,
+                         const char** columns, const uint8_t* start_timestamp, const uint8_t* stop_timestamp,
+                         const uint32_t* value, uint32_t count, uint32_t narrow) {
+    mm_counters_t prev;
+
+    memset(&prev, 0, sizeof(prev));
+
+    if (mm_sql_exec(db, "BEGIN IMMEDIATE;") != 0) {
+        return -EIO;
+    }
+
+    if ((mm_sql_load_TCOUNTERS(db, terminal_id, record_type, &prev) != 0) ||
+        (counters_save_delta(db, terminal_id, record_type, table, columns, &prev,
+                             start_timestamp, stop_timestamp, value, count, narrow) != 0) ||
+        (mm_sql_flush(db) != 0) ||
+        (mm_sql_exec(db, "COMMIT;") != 0)) {
+        fprintf(stderr, "%s: Terminal %s: %s not stored.\n", __func__, terminal_id, table);
+        mm_sql_exec(db, "ROLLBACK;");
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/* Fill value[] with the counters of a performance statistics record.  Returns the count. */
+uint8_t mm_counters_TPERFST(const dlog_mt_perf_stats_record_t* perf_stats, uint32_t* value) {
+    int i;
+
+    for (i = 0; i < PERF_STATS_MAX; i++) {
+        value[i] = perf_stats->stats[i];
+    }
+
+    return PERF_STATS_MAX;
+}
+
+/* Fill value[] with the counters of a summary call statistics record.  Returns the count. */
+uint8_t mm_counters_TCALLST(const dlog_mt_summary_call_stats_t* summary_call_stats, uint32_t* value) {
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        value[i] = summary_call_stats->stats[i];
+    }
+
+    for (i = 0; i < 10; i++) {
+        value[16 + i] = summary_call_stats->rep_dialer_peg_count[i];
+    }
+
+    value[26] = summary_call_stats->total_call_duration;
+    value[27] = summary_call_stats->total_time_off_hook;
+
+    return TCALLST_COUNTERS;
+}
+
+int mm_counters_save_TPERFST(void* db, const char* terminal_id, dlog_mt_perf_stats_record_t* perf_stats) {
+    uint32_t value[PERF_STATS_MAX];
+
+    mm_counters_TPERFST(perf_stats, value);
+
+    return counters_save(db, terminal_id, DLOG_MT_PERF_STATS_MSG, "TPERFST_DELTA", tperfst_columns,
+                         perf_stats->timestamp, perf_stats->timestamp2, value, PERF_STATS_MAX, PERF_STATS_MAX);
+}
+
+int mm_counters_save_TCALLST(void* db, const char* terminal_id, dlog_mt_summary_call_stats_t* summary_call_stats) {
+    uint32_t value[TCALLST_COUNTERS];
+
+    mm_counters_TCALLST(summary_call_stats, value);
+
+    return counters_save(db, terminal_id, DLOG_MT_SUMMARY_CALL_STATS, "TCALLST_DELTA", tcallst_columns,
+                         summary_call_stats->start_timestamp, summary_call_stats->end_timestamp, value,
+                         TCALLST_COUNTERS, TCALLST_COUNTERS_16BIT);
+}
@@ -0,0 +1,94 @@
+/*
+ * Duplicate record filter for mm_manager.
+ *
+ * Terminals re-send CDRs and authorization requests whose ACK they
+ * missed.  A Bloom filter of the keys of records this process has stored
+ * lets mm_manager store new records without consulting the database;
+ * only keys the filter reports as possibly seen are checked against the
+ * database, which remains authoritative.
+ *
+ * The filter is a cache private to the process, as each line's process
+ * stores different records; it is not saved.  A record stored by another
+ * process, or before a restart, is not in the filter, and is caught by
+ * the UNIQUE constraints in the database when it is stored again.
+ *
+ * So that its false positive rate stays low, the filter is kept in two
+ * generations.  Once the current one has taken DEDUP_FILTER_MAX_KEYS
+ * keys it becomes the previous one, and the oldest keys are dropped.
+ *
+ * www.github.com/hharte/mm_manager
+ *
+ * Copyright (c) 2022-2023, Howard M. Harte
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mm_manager.h"
+
+static uint8_t* dedup_bits[2] = { NULL, NULL };    /* Current and previous generation */
+static uint32_t dedup_keys = 0;                     /* Keys added to the current generation */
+
+/* Open the filter.  Until this is called, every key is reported as not seen. */
+int mm_dedup_open(void) {
+    if (((dedup_bits[0] = (uint8_t*)calloc(1, DEDUP_FILTER_BITS / 8)) == NULL) ||
+        ((dedup_bits[1] = (uint8_t*)calloc(1, DEDUP_FILTER_BITS / 8)) == NULL)) {
+        mm_dedup_close();
+        return -ENOMEM;
+    }
+
+    dedup_keys = 0;
+    return 0;
+}
+
+void mm_dedup_close(void) {
+    free(dedup_bits[0]);
+    free(dedup_bits[1]);
+    dedup_bits[0] = NULL;
+    dedup_bits[1] = NULL;
+}
+
+/*
+ * Add a key to the filter.  Returns 1 if the key may have been added
+ * before, or 0 if it was not added since at least DEDUP_FILTER_MAX_KEYS
+ * other keys.
+ */
+int mm_dedup_test_and_add(const void* key, size_t len) {
+    uint32_t h1, h2;
+    int seen = 1;
+    int seen_before = 1;
+    int i;
+
+    if (dedup_bits[0] == NULL) return 0;
+
+    /* Double hashing: bit i is h1 + i * h2. */
+    h1 = mm_hash32(MM_HASH32_INIT, (const uint8_t*)key, len);
+    h2 = mm_hash32(h1, (const uint8_t*)key, len) | 1;
+
+    for (i = 0; i < DEDUP_FILTER_HASHES; i++) {
+        uint32_t bit = (h1 + (uint32_t)i * h2) & (DEDUP_FILTER_BITS - 1);
+
+        if (!(dedup_bits[1][bit >> 3] & (1 << (bit & 7)))) {
+            seen_before = 0;
+        }
+
+        if (!(dedup_bits[0][bit >> 3] & (1 << (bit & 7)))) {
+            dedup_bits[0][bit >> 3] |= (1 << (bit & 7));
+            seen = 0;
+        }
+    }
+
+    if (!seen && (++dedup_keys > DEDUP_FILTER_MAX_KEYS)) {
+        uint8_t* oldest = dedup_bits[1];
+
+        dedup_bits[1] = dedup_bits[0];
+        dedup_bits[0] = oldest;
+        memset(dedup_bits[0], 0, DEDUP_FILTER_BITS / 8);
+        dedup_keys = 0;
+        (void)mm_dedup_test_and_add(key, len);
+    }
+
+    return seen || seen_before;
+}
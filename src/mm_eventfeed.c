@@ -0,0 +1,194 @@
+/*
+ * Utility to read the mm_manager accounting event feed.
+ *
+ * Prints the records in the event feed written by mm_manager -j,
+ * starting at the given offset, followed by the offset of the next
+ * record.  A consumer saves that offset and passes it on the next run
+ * to process only new records.
+ *
+ * With -f (POSIX only), mm_eventfeed then binds <event_feed>.sock and
+ * prints records as mm_manager sends them, reading any it missed from
+ * the feed.
+ *
+ * www.github.com/hharte/mm_manager
+ *
+ * Copyright (c) 2022-2023, Howard M. Harte
+ *
+ * Example:
+ *
+ * mm_eventfeed mm_events.bin
+ * mm_eventfeed mm_events.bin 1234 -f
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#ifndef _WIN32
+# include <sys/socket.h>
+# include <sys/un.h>
+# include <unistd.h>
+#endif /* _WIN32 */
+
+#include "mm_manager.h"
+
+static void print_event(uint64_t offset, const mm_event_hdr_t* hdr, const uint8_t* record) {
+    char terminal_id[sizeof(hdr->terminal_id) + 1] = { 0 };
+    char time_str[20] = { 0 };
+    time_t received_time = (time_t)LE32(hdr->received_time);
+    struct tm ptm = { 0 };
+    uint32_t i;
+
+    memcpy(terminal_id, hdr->terminal_id, sizeof(hdr->terminal_id));
+    localtime_r(&received_time, &ptm);
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &ptm);
+
+    printf("%10" PRIu64 ": %s %s: %s (0x%02x), %u bytes:", offset, time_str, terminal_id,
+        table_to_string(record[0]), record[0], LE32(hdr->length));
+
+    for (i = 0; i < LE32(hdr->length); i++) {
+        printf(" %02x", record[i]);
+    }
+    printf("\n");
+}
+
+/* Print the records in the feed from *offset up to limit, advancing *offset. */
+static int replay_feed(const char* filename, uint64_t* offset, uint64_t limit) {
+    FILE* instream;
+    mm_event_hdr_t hdr;
+    uint8_t record[MM_EVENT_RECORD_MAX];
+
+    if ((instream = fopen(filename, "rb")) == NULL) {
+        fprintf(stderr, "Error opening %s\n", filename);
+        return -ENOENT;
+    }
+
+    if (fseek(instream, (long)*offset, SEEK_SET) != 0) {
+        fclose(instream);
+        return -EINVAL;
+    }
+
+    /* A record still being written is left for the next call. */
+    while ((*offset < limit) && (fread(&hdr, sizeof(hdr), 1, instream) == 1)) {
+        if (LE32(hdr.length) > sizeof(record)) {
+            fprintf(stderr, "%s: Bad record length %u at offset %" PRIu64 ".\n", __func__, LE32(hdr.length), *offset);
+            fclose(instream);
+            return -EIO;
+        }
+
+        if (fread(record, LE32(hdr.length), 1, instream) != 1) break;
+
+        print_event(*offset, &hdr, record);
+        *offset += sizeof(hdr) + LE32(hdr.length);
+    }
+
+    fclose(instream);
+    return 0;
+}
+
+#ifndef _WIN32
+static int follow_feed(const char* filename, uint64_t* offset) {
+    struct sockaddr_un addr = { 0 };
+    uint8_t event[MM_EVENT_OFFSET_LEN + sizeof(mm_event_hdr_t) + MM_EVENT_RECORD_MAX];
+    int sock;
+    int status;
+
+    addr.sun_family = AF_UNIX;
+    if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s.sock", filename) >= (int)sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: Socket path for %s is too long.\n", __func__, filename);
+        return -EINVAL;
+    }
+
+    if ((sock = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+        fprintf(stderr, "%s: Failed to create socket: %s\n", __func__, strerror(errno));
+        return -EIO;
+    }
+
+    unlink(addr.sun_path);
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "%s: Failed to bind %s: %s\n", __func__, addr.sun_path, strerror(errno));
+        close(sock);
+        return -EIO;
+    }
+
+    /* Catch up on records written before the socket was bound. */
+    if ((status = replay_feed(filename, offset, UINT64_MAX)) != 0) {
+        close(sock);
+        unlink(addr.sun_path);
+        return status;
+    }
+
+    printf("Next offset: %" PRIu64 "\n", *offset);
+    fflush(stdout);
+
+    for (;;) {
+        ssize_t len = recv(sock, event, sizeof(event), 0);
+        mm_event_hdr_t* hdr = (mm_event_hdr_t*)&event[MM_EVENT_OFFSET_LEN];
+        uint64_t event_offset = 0;
+        int i;
+
+        if (len < (ssize_t)(MM_EVENT_OFFSET_LEN + sizeof(mm_event_hdr_t))) continue;
+
+        for (i = MM_EVENT_OFFSET_LEN - 1; i >= 0; i--) {
+            event_offset = (event_offset << 8) | event[i];
+        }
+
+        /* Already seen while catching up. */
+        if (event_offset < *offset) continue;
+
+        /* Fill in any records whose datagrams were dropped. */
+        if (event_offset > *offset) {
+            replay_feed(filename, offset, event_offset);
+        }
+
+        print_event(event_offset, hdr, &event[MM_EVENT_OFFSET_LEN + sizeof(mm_event_hdr_t)]);
+        *offset = event_offset + sizeof(mm_event_hdr_t) + LE32(hdr->length);
+
+        printf("Next offset: %" PRIu64 "\n", *offset);
+        fflush(stdout);
+    }
+
+    return 0;
+}
+#endif /* _WIN32 */
+
+int main(int argc, char *argv[]) {
+    uint64_t offset = 0;
+    int follow = 0;
+    int status;
+
+    if ((argc < 2) || (argc > 4)) {
+        printf("Usage:\n" \
+               "\tmm_eventfeed <event_feed> [offset] [-f]\n");
+        return -EINVAL;
+    }
+
+    if ((argc > 2) && (strcmp(argv[argc - 1], "-f") == 0)) {
+        follow = 1;
+        argc--;
+    }
+
+    if (argc > 2) {
+        offset = strtoull(argv[2], NULL, 0);
+    }
+
+    if (follow) {
+#ifndef _WIN32
+        return follow_feed(argv[1], &offset);
+#else
+        fprintf(stderr, "mm_eventfeed: -f is not supported on Windows.\n");
+        return -EINVAL;
+#endif /* _WIN32 */
+    }
+
+    status = replay_feed(argv[1], &offset, UINT64_MAX);
+
+    if (status == 0) {
+        printf("Next offset: %" PRIu64 "\n", offset);
+    }
+
+    return status;
+}
@@ -0,0 +1,260 @@
+/*
+ * Accounting event feed for mm_manager.
+ *
+ * Each record saved by the mm_acct_save_*() functions is appended to
+ * the event feed, an append-only file of length-prefixed records, so
+ * that billing and other consumers do not need to poll the database.
+ * A record's offset in the feed identifies it: a consumer saves the
+ * offset following the last record it processed, and replays the feed
+ * from there when it restarts.  Records are only emitted once stored in
+ * the database: those stored in a transaction are held until it commits,
+ * and dropped if it is rolled back, see mm_sql_exec().  Each record is
+ * as sent by the terminal, with the time it was received.
+ *
+ * Several mm_manager processes may append to the same feed.  Each
+ * record is written with a single write() to a file opened O_APPEND, so
+ * records never interleave, and its offset is where that write ended
+ * less its length.  On Windows, the end of the file is found and written
+ * under a lock.
+ *
+ * On POSIX systems, each record is also sent, with its offset, as a
+ * datagram to the Unix socket <feed>.sock, if a consumer has bound it.
+ * Records are never lost if the consumer is slow or not running, since
+ * it can always catch up from the feed.
+ *
+ * www.github.com/hharte/mm_manager
+ *
+ * Copyright (c) 2022-2023, Howard M. Harte
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <fcntl.h>
+# include <sys/socket.h>
+# include <sys/un.h>
+# include <unistd.h>
+#endif /* _WIN32 */
+
+#include "mm_manager.h"
+
+#ifdef _WIN32
+static HANDLE event_feed = INVALID_HANDLE_VALUE;
+#else
+static int event_feed = -1;
+static int event_sock = -1;
+static struct sockaddr_un event_addr;
+#endif /* _WIN32 */
+
+/* Events emitted in the open transaction: headers, each followed by its record. */
+static uint8_t* event_queue;
+static size_t event_queue_len;
+static size_t event_queue_size;
+static int event_in_transaction;
+
+int mm_events_open(const char* filename) {
+#ifdef _WIN32
+    event_feed = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                             OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (event_feed == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "%s: Cannot open event feed %s.\n", __func__, filename);
+        return -EIO;
+    }
+#else
+    if ((event_feed = open(filename, O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0) {
+        fprintf(stderr, "%s: Cannot open event feed %s: %s\n", __func__, filename, strerror(errno));
+        return -EIO;
+    }
+
+    memset(&event_addr, 0, sizeof(event_addr));
+    event_addr.sun_family = AF_UNIX;
+
+    if (snprintf(event_addr.sun_path, sizeof(event_addr.sun_path), "%s.sock", filename) >= (int)sizeof(event_addr.sun_path)) {
+        fprintf(stderr, "%s: Socket path for %s is too long, live events disabled.\n", __func__, filename);
+    } else if ((event_sock = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+        fprintf(stderr, "%s: Failed to create socket: %s\n", __func__, strerror(errno));
+    }
+#endif /* _WIN32 */
+
+    return 0;
+}
+
+/* Free the queue once the feed is closed. */
+static void events_queue_free(void) {
+    free(event_queue);
+    event_queue = NULL;
+    event_queue_len = 0;
+    event_queue_size = 0;
+    event_in_transaction = 0;
+}
+
+void mm_events_close(void) {
+#ifdef _WIN32
+    if (event_feed != INVALID_HANDLE_VALUE) {
+        CloseHandle(event_feed);
+        event_feed = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (event_sock >= 0) {
+        close(event_sock);
+        event_sock = -1;
+    }
+
+    if (event_feed >= 0) {
+        close(event_feed);
+        event_feed = -1;
+    }
+#endif /* _WIN32 */
+    events_queue_free();
+}
+
+int mm_events_enabled(void) {
+#ifdef _WIN32
+    return event_feed != INVALID_HANDLE_VALUE;
+#else
+    return event_feed >= 0;
+#endif /* _WIN32 */
+}
+
+/* Append event to the feed.  Returns the offset it was written at, or -1. */
+static int64_t events_append(const void* event, size_t len) {
+#ifdef _WIN32
+    OVERLAPPED lock = { 0 };
+    LARGE_INTEGER end;
+    DWORD written = 0;
+    int64_t offset = -1;
+
+    /* The lock is on a byte past any feed, so readers are not blocked. */
+    lock.Offset = 0xFFFFFFFF;
+    lock.OffsetHigh = 0x7FFFFFFF;
+
+    if (!LockFileEx(event_feed, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &lock)) return -1;
+
+    end.QuadPart = 0;
+    if (SetFilePointerEx(event_feed, end, &end, FILE_END) &&
+        WriteFile(event_feed, event, (DWORD)len, &written, NULL) &&
+        (written == (DWORD)len)) {
+        offset = (int64_t)end.QuadPart;
+    }
+
+    UnlockFileEx(event_feed, 0, 1, 0, &lock);
+
+    return offset;
+#else
+    ssize_t written = write(event_feed, event, len);
+    off_t end;
+
+    if ((written != (ssize_t)len) || ((end = lseek(event_feed, 0, SEEK_CUR)) < 0)) return -1;
+
+    return (int64_t)end - (int64_t)len;
+#endif /* _WIN32 */
+}
+
+/* Write the event, a header followed by its record, to the feed and the socket. */
+static int events_write(const uint8_t* entry, size_t event_len) {
+    uint8_t event[MM_EVENT_OFFSET_LEN + sizeof(mm_event_hdr_t) + MM_EVENT_RECORD_MAX];
+    int64_t offset;
+
+    memcpy(&event[MM_EVENT_OFFSET_LEN], entry, event_len);
+
+    if ((offset = events_append(&event[MM_EVENT_OFFSET_LEN], event_len)) < 0) {
+        fprintf(stderr, "%s: Failed to write event feed: %s\n", __func__, strerror(errno));
+        return -EIO;
+    }
+
+#ifndef _WIN32
+    /* The datagram is prefixed by the record's offset in the feed, little-endian. */
+    for (int i = 0; i < MM_EVENT_OFFSET_LEN; i++) {
+        event[i] = (uint8_t)((uint64_t)offset >> (i * 8));
+    }
+
+    /* Fails harmlessly when no consumer is listening. */
+    if (event_sock >= 0) {
+        (void)sendto(event_sock, event, MM_EVENT_OFFSET_LEN + event_len, MSG_DONTWAIT,
+                     (struct sockaddr*)&event_addr, sizeof(event_addr));
+    }
+#endif /* _WIN32 */
+
+    return 0;
+}
+
+/*
+ * Emit a record to the event feed, or hold it until the open transaction
+ * commits.  The record begins with its DLOG_MT_* message type, and is in
+ * wire byte order, as received from the terminal at received_time.
+ */
+int mm_events_emit(const char* terminal_id, time_t received_time, const void* record, size_t record_len) {
+    uint8_t event[sizeof(mm_event_hdr_t) + MM_EVENT_RECORD_MAX];
+    mm_event_hdr_t* hdr = (mm_event_hdr_t*)event;
+    size_t event_len = sizeof(mm_event_hdr_t) + record_len;
+    uint8_t* grown;
+
+    if (!mm_events_enabled()) return 0;
+
+    if (record_len > MM_EVENT_RECORD_MAX) {
+        fprintf(stderr, "%s: Record of %zu bytes is too long.\n", __func__, record_len);
+        return -EINVAL;
+    }
+
+    hdr->length = LE32((uint32_t)record_len);
+    hdr->received_time = LE32((uint32_t)received_time);
+    memset(hdr->terminal_id, 0, sizeof(hdr->terminal_id));
+    memcpy(hdr->terminal_id, terminal_id, strnlen(terminal_id, sizeof(hdr->terminal_id)));
+    memcpy(&event[sizeof(mm_event_hdr_t)], record, record_len);
+
+    if (!event_in_transaction) return events_write(event, event_len);
+
+    if (event_queue_len + event_len > event_queue_size) {
+        size_t size = (event_queue_size > 0) ? event_queue_size * 2 : 16384;
+
+        while (size < event_queue_len + event_len) size *= 2;
+
+        if ((grown = (uint8_t*)realloc(event_queue, size)) == NULL) {
+            fprintf(stderr, "%s: Failed to queue event.\n", __func__);
+            return -ENOMEM;
+        }
+        event_queue = grown;
+        event_queue_size = size;
+    }
+
+    memcpy(&event_queue[event_queue_len], event, event_len);
+    event_queue_len += event_len;
+
+    return 0;
+}
+
+/* A transaction has begun: hold the events emitted until it ends. */
+void mm_events_begin(void) {
+    event_queue_len = 0;
+    event_in_transaction = 1;
+}
+
+/* The transaction has committed: write the events held for it. */
+int mm_events_commit(void) {
+    size_t pos = 0;
+    int rc = 0;
+
+    while (pos < event_queue_len) {
+        const mm_event_hdr_t* hdr = (const mm_event_hdr_t*)&event_queue[pos];
+        size_t event_len = sizeof(mm_event_hdr_t) + LE32(hdr->length);
+
+        if (events_write(&event_queue[pos], event_len) != 0) rc = -EIO;
+        pos += event_len;
+    }
+
+    event_queue_len = 0;
+    event_in_transaction = 0;
+
+    return rc;
+}
+
+/* The transaction was rolled back: its records were not stored. */
+void mm_events_rollback(void) {
+    event_queue_len = 0;
+    event_in_transaction = 0;
+}
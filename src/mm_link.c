@@ -0,0 +1,213 @@
+/*
+ * Link quality model for mm_manager.
+ *
+ * The protocol layer counts frames, errors, retransmits and ACK
+ * turnaround for each call.  At the end of the call, these are folded
+ * into exponentially decayed statistics for the modem line and for the
+ * terminal, which are kept in the TLINKQ table.  The worse of the two
+ * drives the inter-packet gap, the retransmit budget for the call, and
+ * the table set downloaded to the terminal.
+ *
+ * www.github.com/hharte/mm_manager
+ *
+ * Copyright (c) 2022-2023, Howard M. Harte
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mm_manager.h"
+
+#define LINK_DECAY_SHIFT        2       /* Each call contributes 1/4 of the new value */
+#define LINK_MIN_CALLS          3       /* Calls sampled before the statistics are trusted */
+
+/* Quality thresholds, errors and retransmits per 1000 frames. */
+#define LINK_FAIR_ERROR_RATE    20
+#define LINK_POOR_ERROR_RATE    100
+#define LINK_FAIR_RETX_RATE     50
+#define LINK_POOR_RETX_RATE     250
+#define LINK_FAIR_TURNAROUND_MS 1500
+#define LINK_POOR_TURNAROUND_MS 3000
+
+/* Adaptation for each link quality. */
+#define LINK_FAIR_GAP           5       /* Extra inter-packet gap, 10ms increments */
+#define LINK_POOR_GAP           10
+#define LINK_FAIR_RETRY_BUDGET  64      /* Retransmits per call */
+#define LINK_POOR_RETRY_BUDGET  24
+
+int mm_link_load(void* db, char link_type, const char* link_id, mm_link_stats_t* stats) {
+    return mm_sql_load_TLINKQ(db, link_type, link_id, stats);
+}
+
+int mm_link_save(void* db, char link_type, const char* link_id, mm_link_stats_t* stats) {
+    char sql[384] = { 0 };
+    char received_time_str[16] = { 0 };
+
+    snprintf(sql, sizeof(sql), "REPLACE INTO TLINKQ ( "
+        "LINK_TYPE,LINK_ID,CALLS,ERROR_RATE,RETRANSMIT_RATE,TURNAROUND_MS,UPDATE_DATE,UPDATE_TIME"
+        " ) VALUES ( "
+        "\"%c\",\"%s\",%u,%u,%u,%u,%s);",
+        link_type,
+        link_id,
+        stats->calls,
+        stats->error_rate,
+        stats->retransmit_rate,
+        stats->turnaround_ms,
+        received_time_to_db_string(received_time_str, sizeof(received_time_str)));
+
+    return mm_sql_exec(db, sql);
+}
+
+/* Clear the per-call counters at the start of a call. */
+void mm_link_begin_call(mm_proto_t* proto) {
+    memset(&proto->link, 0, sizeof(proto->link));
+    proto->link_gap = 0;
+    proto->retry_budget = 0;
+}
+
+static uint32_t link_decay(uint32_t average, uint32_t sample, uint32_t calls) {
+    /* The first sample seeds the average. */
+    if (calls == 0) return sample;
+
+    if (sample > average) {
+        return average + ((sample - average) >> LINK_DECAY_SHIFT);
+    }
+
+    return average - ((average - sample) >> LINK_DECAY_SHIFT);
+}
+
+/*
+ * Fold the counters for a call into the decayed statistics.
+ * Returns 0, or -ENODATA if no frames were exchanged.
+ */
+int mm_link_update(mm_link_stats_t* stats, const mm_link_counters_t* counters) {
+    uint32_t frames = counters->frames_tx + counters->frames_rx;
+    uint32_t errors;
+    uint32_t error_rate;
+    uint32_t retransmit_rate = 0;
+    uint32_t turnaround_ms = stats->turnaround_ms;
+
+    if (frames == 0) return -ENODATA;
+
+    errors = counters->crc_errors + counters->framing_errors + counters->nacks + counters->timeouts;
+    error_rate = (uint32_t)(((uint64_t)errors * 1000) / frames);
+
+    if (counters->frames_tx > 0) {
+        retransmit_rate = (uint32_t)(((uint64_t)counters->retransmits * 1000) / counters->frames_tx);
+    }
+
+    if (counters->turnaround_samples > 0) {
+        turnaround_ms = counters->turnaround_ms_total / counters->turnaround_samples;
+    }
+
+    stats->error_rate      = link_decay(stats->error_rate, error_rate, stats->calls);
+    stats->retransmit_rate = link_decay(stats->retransmit_rate, retransmit_rate, stats->calls);
+    stats->turnaround_ms   = link_decay(stats->turnaround_ms, turnaround_ms, stats->calls);
+    stats->calls++;
+
+    return 0;
+}
+
+uint8_t mm_link_quality(const mm_link_stats_t* stats) {
+    if (stats->calls < LINK_MIN_CALLS) return LINK_QUALITY_UNKNOWN;
+
+    if ((stats->error_rate >= LINK_POOR_ERROR_RATE) ||
+        (stats->retransmit_rate >= LINK_POOR_RETX_RATE) ||
+        (stats->turnaround_ms >= LINK_POOR_TURNAROUND_MS)) {
+        return LINK_QUALITY_POOR;
+    }
+
+    if ((stats->error_rate >= LINK_FAIR_ERROR_RATE) ||
+        (stats->retransmit_rate >= LINK_FAIR_RETX_RATE) ||
+        (stats->turnaround_ms >= LINK_FAIR_TURNAROUND_MS)) {
+        return LINK_QUALITY_FAIR;
+    }
+
+    return LINK_QUALITY_GOOD;
+}
+
+const char* mm_link_quality_to_str(uint8_t quality) {
+    switch (quality) {
+    case LINK_QUALITY_GOOD:
+        return "Good";
+    case LINK_QUALITY_FAIR:
+        return "Fair";
+    case LINK_QUALITY_POOR:
+        return "Poor";
+    default:
+        return "Unknown";
+    }
+}
+
+/* Set the inter-packet gap and retransmit budget for the link quality. */
+void mm_link_adapt(mm_proto_t* proto, uint8_t quality) {
+    switch (quality) {
+    case LINK_QUALITY_FAIR:
+        proto->link_gap = LINK_FAIR_GAP;
+        proto->retry_budget = LINK_FAIR_RETRY_BUDGET;
+        break;
+    case LINK_QUALITY_POOR:
+        proto->link_gap = LINK_POOR_GAP;
+        proto->retry_budget = LINK_POOR_RETRY_BUDGET;
+        break;
+    default:
+        proto->link_gap = 0;
+        proto->retry_budget = 0;
+        break;
+    }
+}
+
+void mm_link_print(const char* name, const mm_link_stats_t* stats) {
+    printf("%s: Link quality %s: %u calls, %u.%u%% errors, %u.%u%% retransmits, %ums turnaround.\n",
+        name,
+        mm_link_quality_to_str(mm_link_quality(stats)),
+        stats->calls,
+        stats->error_rate / 10, stats->error_rate % 10,
+        stats->retransmit_rate / 10, stats->retransmit_rate % 10,
+        stats->turnaround_ms);
+}
+
+/*
+ * Summarize the current call, including the line time spent on
+ * retransmits at the given baud rate (10 bits per byte.)
+ */
+void mm_link_print_call(const mm_link_counters_t* counters, int baudrate) {
+    uint32_t bytes = counters->bytes_tx + counters->bytes_rx;
+
+    printf("Call: %u frames sent, %u received, %u retransmits, %u NACKs, %u CRC errors, %u framing errors, %u timeouts.\n",
+        counters->frames_tx, counters->frames_rx, counters->retransmits, counters->nacks,
+        counters->crc_errors, counters->framing_errors, counters->timeouts);
+
+    if (baudrate > 0) {
+        printf("Call: %u bytes, %ums airtime, %ums spent on retransmits.\n",
+            bytes,
+            (uint32_t)(((uint64_t)bytes * 10000) / baudrate),
+            (uint32_t)(((uint64_t)counters->bytes_retx * 10000) / baudrate));
+    }
+}
+
+int mm_link_create_tables(void* db) {
+    int rc;
+
+    rc = mm_sql_exec(db, "CREATE TABLE IF NOT EXISTS TLINKQ ( "
+        "ID INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,"
+        "LINK_TYPE VARCHAR(1) NOT NULL,"
+        "LINK_ID VARCHAR(63) NOT NULL,"
+        "CALLS INTEGER UNSIGNED DEFAULT 0,"
+        "ERROR_RATE INTEGER UNSIGNED DEFAULT 0,"
+        "RETRANSMIT_RATE INTEGER UNSIGNED DEFAULT 0,"
+        "TURNAROUND_MS INTEGER UNSIGNED DEFAULT 0,"
+        "UPDATE_DATE VARCHAR(8) NOT NULL,"
+        "UPDATE_TIME VARCHAR(6) NOT NULL,"
+        "UNIQUE(LINK_TYPE,LINK_ID) "
+        ");");
+
+    if (rc != 0) {
+        fprintf(stderr, "%s: Failed to create table TLINKQ.\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,138 @@
+/*
+ * Lock files for state shared by the mm_manager processes serving
+ * different lines: the CDR log, time series and status board.
+ *
+ * Each lock is one byte of the lock file, far beyond any data kept in
+ * it, so that on Windows, where locks are mandatory, holding a lock does
+ * not stop other processes reading the data.  The locks are released
+ * when the process exits.
+ *
+ * www.github.com/hharte/mm_manager
+ *
+ * Copyright (c) 2022-2023, Howard M. Harte
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <fcntl.h>
+# include <unistd.h>
+#endif /* _WIN32 */
+
+#include "mm_manager.h"
+
+#define LOCKFILE_LOCK_BASE  (0x7FFFFF00UL)  /* Offset of lock 0 */
+
+int mm_lockfile_open(mm_lockfile_t* lock, const char* filename) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                              NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "%s: Cannot open %s.\n", __func__, filename);
+        return -EIO;
+    }
+
+    lock->file = file;
+#else
+    if ((lock->fd = open(filename, O_RDWR | O_CREAT, 0644)) < 0) {
+        fprintf(stderr, "%s: Cannot open %s: %s\n", __func__, filename, strerror(errno));
+        return -EIO;
+    }
+#endif /* _WIN32 */
+
+    return 0;
+}
+
+void mm_lockfile_close(mm_lockfile_t* lock) {
+#ifdef _WIN32
+    if (lock->file != NULL) CloseHandle((HANDLE)lock->file);
+    lock->file = NULL;
+#else
+    if (lock->fd >= 0) close(lock->fd);
+    lock->fd = -1;
+#endif /* _WIN32 */
+}
+
+/* Take lock number n, waiting for another process to release it if wait is set, otherwise fail with -EBUSY. */
+int mm_lockfile_lock(mm_lockfile_t* lock, uint32_t n, int wait) {
+#ifdef _WIN32
+    OVERLAPPED ov = { 0 };
+
+    ov.Offset = (DWORD)(LOCKFILE_LOCK_BASE + n);
+    if (!LockFileEx((HANDLE)lock->file, LOCKFILE_EXCLUSIVE_LOCK | (wait ? 0 : LOCKFILE_FAIL_IMMEDIATELY),
+                    0, 1, 0, &ov)) {
+        return wait ? -EIO : -EBUSY;
+    }
+#else
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = (off_t)(LOCKFILE_LOCK_BASE + n);
+    fl.l_len = 1;
+
+    while (fcntl(lock->fd, wait ? F_SETLKW : F_SETLK, &fl) != 0) {
+        if (errno == EINTR) continue;
+        return ((errno == EAGAIN) || (errno == EACCES)) ? -EBUSY : -EIO;
+    }
+#endif /* _WIN32 */
+
+    return 0;
+}
+
+void mm_lockfile_unlock(mm_lockfile_t* lock, uint32_t n) {
+#ifdef _WIN32
+    OVERLAPPED ov = { 0 };
+
+    ov.Offset = (DWORD)(LOCKFILE_LOCK_BASE + n);
+    UnlockFileEx((HANDLE)lock->file, 0, 1, 0, &ov);
+#else
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_UNLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = (off_t)(LOCKFILE_LOCK_BASE + n);
+    fl.l_len = 1;
+
+    fcntl(lock->fd, F_SETLK, &fl);
+#endif /* _WIN32 */
+}
+
+/* Read len bytes at offset.  Returns the number of bytes read, short at the end of the file, or -EIO. */
+int mm_lockfile_read(mm_lockfile_t* lock, uint32_t offset, void* buf, size_t len) {
+#ifdef _WIN32
+    OVERLAPPED ov = { 0 };
+    DWORD got = 0;
+
+    ov.Offset = offset;
+    if (!ReadFile((HANDLE)lock->file, buf, (DWORD)len, &got, &ov) && (GetLastError() != ERROR_HANDLE_EOF)) {
+        return -EIO;
+    }
+
+    return (int)got;
+#else
+    ssize_t got = pread(lock->fd, buf, len, (off_t)offset);
+
+    return (got < 0) ? -EIO : (int)got;
+#endif /* _WIN32 */
+}
+
+int mm_lockfile_write(mm_lockfile_t* lock, uint32_t offset, const void* buf, size_t len) {
+#ifdef _WIN32
+    OVERLAPPED ov = { 0 };
+    DWORD put = 0;
+
+    ov.Offset = offset;
+    if (!WriteFile((HANDLE)lock->file, buf, (DWORD)len, &put, &ov) || (put != len)) return -EIO;
+#else
+    if (pwrite(lock->fd, buf, len, (off_t)offset) != (ssize_t)len) return -EIO;
+#endif /* _WIN32 */
+
+    return 0;
+}
@@ -14,6 +14,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <time.h>
 
 #ifdef _WIN32
 #define PACKED
@@ -55,8 +56,9 @@
 #define PKT_ERROR_EOF               (1 << 7)
 #define PKT_ERROR_NO_CARRIER        (1 << 8)
 #define PKT_ERROR_FAILURE           (1 << 9)
+#define PKT_RX_IN_PROGRESS          (1 << 10)   /* Frame not complete yet, see proto_rx_byte() */
 
-#define PKT_TIMEOUT_MAX             (10)    // Maximum time to wait for modem character
+#define PKT_TIMEOUT_MAX             (10)    // Maximum time to wait for modem character, in seconds
 #define PKT_MAX_RETRIES             (5)     // Maximum number of time to retry an errored packet
 
 #define PKT_TABLE_ID_OFFSET         (0x05)
@@ -656,6 +658,9 @@ typedef struct dlog_mt_query_term_err {
     uint8_t id;
 } PACKED dlog_mt_query_term_err_t;
 
+/* DLOG_MT_TERM_ERR_REP: the layout of the report is not known, only its length, including the message type. */
+#define DLOG_MT_TERM_ERR_REP_LEN    (97)
+
 /* Constants and data structures for the RATEINT (Set Based Rating - International) pp. 2-326
  *
  * Thanks to æstrid for figuring out the data structures for the International
@@ -1273,14 +1278,132 @@ typedef struct dlog_mt_npa_nxx_table {
     uint8_t     lcd[MAX_NPA / 4];                       /* Storage for 800 2-bit NPAs */
 } PACKED dlog_mt_npa_nxx_table_t;
 
+/* Accounting event feed record, see mm_events.c.  Little-endian. */
+#define MM_EVENT_OFFSET_LEN         (8)     /* Feed offset prefixed to each live event datagram */
+#define MM_EVENT_RECORD_MAX         (512)
+
+typedef struct mm_event_hdr {
+    uint32_t length;                /* Length of the record following the header */
+    uint32_t received_time;         /* Unix time */
+    char terminal_id[10];           /* Not NUL-terminated */
+} PACKED mm_event_hdr_t;
+
+/* Memory-mapped CDR log segment, see mm_cdrlog.c.  Little-endian. */
+#define CDRLOG_MAGIC                "MMCDRLOG"
+#define CDRLOG_VERSION              (1)
+#define CDRLOG_SEGMENT_RECORDS      (16384) /* Records per segment file */
+#define CDRLOG_INDEX_BATCH          (1024)  /* Records indexed into TCDR per idle step */
+#define CDRLOG_RECENT_RECORDS       (4096)  /* Records appended by this process kept for mm_cdrlog_find() */
+
+typedef struct mm_cdrlog_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_len;            /* sizeof(mm_cdrlog_rec_t) */
+    uint32_t capacity;              /* Records in the segment */
+    uint32_t count;                 /* Records appended */
+    uint32_t indexed;               /* Records inserted into TCDR */
+    uint8_t reserved[36];
+} PACKED mm_cdrlog_hdr_t;
+
+typedef struct mm_cdrlog_rec {
+    char terminal_id[10];           /* Not NUL-terminated */
+    uint32_t received_time;         /* Unix time */
+    dlog_mt_call_details_t cdr;     /* As received from the terminal */
+} PACKED mm_cdrlog_rec_t;
+
 #pragma pack(pop)
 
 #define TABLE_PATH_MAX_LEN   283
 
+/* Link quality, see mm_link.c */
+#define LINK_QUALITY_UNKNOWN        0   /* Too few calls sampled */
+#define LINK_QUALITY_GOOD           1
+#define LINK_QUALITY_FAIR           2
+#define LINK_QUALITY_POOR           3
+
+#define LINK_TYPE_LINE              'L' /* TLINKQ LINK_TYPE */
+#define LINK_TYPE_TERMINAL          'T'
+
+/* Error and retransmit counts for the current call. */
+typedef struct mm_link_counters {
+    uint32_t frames_tx;             /* Frames sent, not counting retransmits */
+    uint32_t frames_rx;
+    uint32_t retransmits;
+    uint32_t crc_errors;
+    uint32_t framing_errors;
+    uint32_t nacks;
+    uint32_t timeouts;
+    uint32_t turnaround_ms_total;   /* Sum of time from frame sent to ACK received */
+    uint32_t turnaround_samples;
+    uint32_t bytes_tx;              /* Including retransmits */
+    uint32_t bytes_retx;
+    uint32_t bytes_rx;
+} mm_link_counters_t;
+
+/* Exponentially decayed link statistics, for a modem line or a terminal. */
+typedef struct mm_link_stats {
+    uint32_t calls;                 /* Calls sampled */
+    uint32_t error_rate;            /* Errors per 1000 frames */
+    uint32_t retransmit_rate;       /* Retransmits per 1000 frames sent */
+    uint32_t turnaround_ms;         /* Mean turnaround */
+} mm_link_stats_t;
+
+/* Previous cumulative counters of a terminal, see mm_counters.c */
+#define COUNTERS_MAX                (48)
+#define TCALLST_COUNTERS            (28)    /* 16 call counts, 10 rep dialer peg counts, 2 durations */
+#define TCALLST_COUNTERS_16BIT      (26)    /* The counts are 16 bits, the durations 32 */
+#define COUNTERS_WRAP_MIN           (0x8000) /* A 16-bit counter going backwards from here has wrapped */
+
+typedef struct mm_counters {
+    uint64_t period_start;          /* YYYYMMDDhhmmss */
+    uint64_t period_stop;
+    uint32_t count;                 /* Counters in value[], 0 if none recorded */
+    uint32_t value[COUNTERS_MAX];
+} mm_counters_t;
+
+/* Statistics time series, see mm_tsdb.c */
+#define TSDB_METRICS_MAX            COUNTERS_MAX
+#define TSDB_CHECKPOINT_INTERVAL    (64)    /* Samples between uncompressed checkpoints */
+
+typedef uint32_t pkt_status_t;  /* Packet status flags. */
+
+/* State of the frame receiver, between bytes. */
+typedef struct mm_rx_frame {
+    uint8_t l2_state;
+    pkt_status_t status;
+} mm_rx_frame_t;
+
+/* Protocol operation in progress, between frames.  See proto_poll(). */
+#define PROTO_OP_IDLE               (0)
+#define PROTO_OP_RECEIVE            (1)     /* Receive a frame from the terminal, see proto_receive() */
+#define PROTO_OP_SEND               (2)     /* Send a table or reply, see proto_send_table() */
+#define PROTO_OP_TABLE_ACK          (3)     /* Wait for DLOG_MT_TABLE_UPD_ACK, see proto_expect_table_ack() */
+#define PROTO_OP_DONE               (4)     /* Complete, result in status */
+
+#define PROTO_TX_QUEUE              (4)     /* Frames waiting for the inter-packet gap */
+
+typedef struct mm_proto_op {
+    uint8_t type;               /* PROTO_OP_ */
+    uint8_t step;               /* Frame being waited for, within the operation */
+    int status;                 /* Result, once type is PROTO_OP_DONE */
+    int rx_status;              /* Status of the frame that was NACKed */
+    mm_table_t* table;          /* PROTO_OP_RECEIVE: where the frame goes */
+    const uint8_t* buf;         /* PROTO_OP_SEND: table being sent */
+    size_t len;
+    size_t offset;              /* Start of the frame being sent */
+    size_t chunk;               /* Length of the frame being sent */
+    struct mm_reply* reply;     /* Records left to send, if sending a reply */
+    size_t rec;
+    uint8_t table_id;           /* Table being sent or acknowledged */
+    uint8_t retries;
+    uint32_t sent_ms;           /* When the frame being acknowledged was sent */
+} mm_proto_op_t;
+
 typedef struct mm_proto_ctx {
     struct mm_serial_context* serial_context;
     FILE* pcapstream;
     char terminal_id[11];   /* The terminal's phone number */
+    uint8_t terminal_id_bcd[PKT_TABLE_ID_OFFSET];   /* terminal_id, packed as sent in each packet */
     int connected;
     uint8_t rx_seq;
     uint8_t tx_seq;
@@ -1291,6 +1414,19 @@ typedef struct mm_proto_ctx {
     uint8_t error_inject_type;
     uint8_t debuglevel;
     uint8_t send_udp;
+    mm_rx_frame_t rx;
+    mm_packet_t* rx_pkt;        /* Frame being received, NULL if none is waited for */
+    mm_packet_t ack_pkt;        /* Frames received while waiting for an ACK */
+    uint32_t rx_deadline_ms;    /* Time out the frame being waited for */
+    mm_proto_op_t op;
+    mm_packet_t tx_queue[PROTO_TX_QUEUE];
+    uint8_t tx_head;
+    uint8_t tx_count;
+    uint32_t tx_ready_ms;       /* Earliest time the next frame may be written */
+    /* Link quality */
+    mm_link_counters_t link;
+    uint8_t link_gap;           /* Added to rx_packet_gap on poor links, 10ms increments */
+    uint16_t retry_budget;      /* Retransmits allowed per call, 0 for no limit */
 } mm_proto_t;
 
 typedef struct mm_telco {
@@ -1298,18 +1434,274 @@ typedef struct mm_telco {
     uint8_t region_code[3];
 } mm_telco_t;
 
+/* Lock file shared between processes, see mm_lockfile.c */
+typedef struct mm_lockfile {
+#ifdef _WIN32
+    void* file;
+#else
+    int fd;
+#endif /* _WIN32 */
+} mm_lockfile_t;
+
+/* Live status board, see mm_status.c.  Slots are in host byte order. */
+#define STATUS_MAGIC                "MMSTATUS"
+#define STATUS_VERSION              (1)
+#define STATUS_LINES                (16)
+#define STATUS_LOCK_BOARD           (0)     /* Held while claiming a slot */
+#define STATUS_LOCK_SLOT            (1)     /* Plus the slot index, held by its owner */
+
+#define LINE_STATE_IDLE             (0)
+#define LINE_STATE_RINGING          (1)
+#define LINE_STATE_CONNECTED        (2)
+#define LINE_STATE_DOWNLOADING      (3)     /* Sending tables to the terminal */
+#define LINE_STATE_UPLOADING        (4)     /* Receiving CDRs from the terminal */
+#define LINE_STATE_BUSY_OUT         (5)
+#define LINE_STATE_STOPPED          (6)     /* mm_manager has exited */
+
+typedef struct mm_status_line {
+    volatile uint32_t seq;          /* Odd while being updated */
+    uint32_t pid;                   /* 0 if the slot is free */
+    char line_id[64];
+    char terminal_id[11];
+    uint8_t state;                  /* LINE_STATE_* */
+    uint8_t table_id;               /* Table being downloaded */
+    uint8_t reserved;
+    uint16_t tables_sent;
+    uint16_t tables_total;
+    uint32_t cdrs;                  /* CDRs received this call */
+    uint32_t bytes_tx;              /* This call, including retransmits */
+    uint32_t bytes_rx;
+    uint32_t retransmits;
+    uint32_t calls;                 /* Calls answered */
+    int64_t state_since;            /* Unix time */
+    int64_t call_start;
+    int64_t updated;
+} mm_status_line_t;
+
+typedef struct mm_status_board {
+    char magic[8];
+    uint32_t version;
+    uint32_t lines;                 /* STATUS_LINES */
+    mm_status_line_t line[STATUS_LINES];
+} mm_status_board_t;
+
+typedef struct mm_status {
+    mm_status_board_t* board;
+    mm_status_line_t* slot;         /* This process's slot, NULL if reading */
+    mm_status_line_t line;          /* Current state of the line */
+    mm_lockfile_t lock;             /* <board>.lock, held on the slot while open */
+#ifdef _WIN32
+    void* file;
+    void* mapping;
+#else
+    int fd;
+#endif /* _WIN32 */
+} mm_status_t;
+
 typedef struct mm_connection {
     FILE* logstream;
     FILE* bytestream;
     char modem_reset_string[256];
     char modem_init_string[256];
+    char noise_spec[128];   /* Simulated line noise, see serial_noise_parse() */
+    int baudrate;
     int test_mode;
+    /* Called between calls while waiting for the modem. */
+    void (*idle)(void* arg);
+    void* idle_arg;
+    mm_status_t* status;    /* Live status board, NULL if not published */
     /* Terminal Communication */
     mm_proto_t proto;
 } mm_connection_t;
 
+/* Last-known state of a terminal, see mm_terminal.c */
+#define TERMINAL_CACHE_BUCKETS      (1024)  /* Must be a power of two */
+#define TERMINAL_CACHE_MAX          (4096)  /* Entries kept before those least recently used are freed */
+
+#define TERM_STATE_STATUS_VALID     (1 << 0)    /* status_word loaded */
+#define TERM_STATE_CASHBOX_VALID    (1 << 1)    /* cashbox_status loaded */
+#define TERM_STATE_SWVERS_VALID     (1 << 2)    /* sw_version loaded */
+#define TERM_STATE_REGISTRY_VALID   (1 << 3)    /* TTERMINAL registry entry loaded */
+#define TERM_STATE_LINK_VALID       (1 << 4)    /* TLINKQ link statistics loaded */
+
+#define MM_HASH32_INIT              (2166136261u)
+
+/* Bitmap indexed by table ID, as used for pending_tables and download_confirmed. */
+#define TABLE_BITMAP_TEST(bitmap, id)   ((bitmap)[(id) >> 3] & (1 << ((id) & 7)))
+#define TABLE_BITMAP_SET(bitmap, id)    ((bitmap)[(id) >> 3] |= (uint8_t)(1 << ((id) & 7)))
+#define TABLE_BITMAP_CLEAR(bitmap, id)  ((bitmap)[(id) >> 3] &= (uint8_t)~(1 << ((id) & 7)))
+
+typedef struct mm_terminal_state {
+    struct mm_terminal_state* next;
+    char terminal_id[11];
+    uint32_t call;                          /* Call the entry was last used in, see mm_terminal_cache_begin_call() */
+    uint64_t stamp;                         /* TTERMINAL STATE_STAMP last read or written, 0 if none */
+    uint8_t valid;                          /* TERM_STATE_*_VALID flags */
+    uint8_t terminal_type;                  /* 0 if unknown */
+    uint64_t status_word;
+    cashbox_status_univ_t cashbox_status;   /* Host byte order */
+    dlog_mt_sw_version_t sw_version;
+    /* TTERMINAL registry */
+    char control_rom_edition[8];
+    char control_version[5];
+    time_t last_contact;
+    uint32_t table_hash[256];               /* Hash of last table downloaded, by table ID, 0 if none */
+    uint8_t pending_tables[256 / 8];        /* Tables to push on the next opportunity, by table ID */
+    uint8_t download_in_progress;           /* Full download started but not completed */
+    uint8_t download_confirmed[256 / 8];    /* Tables confirmed during that download, by table ID */
+    mm_link_stats_t link;
+} mm_terminal_state_t;
+
+typedef struct mm_terminal_cache {
+    mm_terminal_state_t* bucket[TERMINAL_CACHE_BUCKETS];
+    uint32_t count;
+    uint32_t call;                          /* Incremented at the start of each call */
+    void* db;                               /* For the STATE_STAMP check */
+} mm_terminal_cache_t;
+
+/*
+ * Reply to the terminal, built from whole records (tables) and sent as
+ * as many frames as needed, without splitting a record across frames.
+ */
+typedef struct mm_reply {
+    uint8_t* buf;
+    size_t   len;
+    size_t   size;
+    size_t*  rec_end;   /* Offset of the end of each record in buf */
+    size_t   nrec;
+    size_t   rec_size;
+} mm_reply_t;
+
+/* Reporting snapshot of the database, see mm_snapshot_step() */
+#define SNAPSHOT_STEP_PAGES         (1024)  /* Pages copied per idle step */
+#define SNAPSHOT_RESTARTS_MAX       (3)     /* Then copy the rest in one step */
+
+typedef struct mm_snapshot {
+    char filename[256];
+    int freshness_secs;         /* Refresh when older than this, 0 to disable */
+    time_t last_complete;
+    void* dest;                 /* Temporary copy in progress */
+    void* backup;
+    int remaining;              /* Pages left after the last step, -1 before the first */
+    int restarts;               /* Copy restarted by another process writing */
+    mm_lockfile_t lock;         /* <filename>.lock, held while building the copy */
+    uint8_t lock_open;
+} mm_snapshot_t;
+
+typedef struct mm_cdrlog_seg {
+    uint32_t seq;               /* Segment number, cdr_<seq>.log */
+    mm_cdrlog_hdr_t* hdr;       /* Mapped segment, NULL if not mapped */
+    size_t len;
+#ifdef _WIN32
+    void* file;
+    void* mapping;
+#else
+    int fd;
+#endif /* _WIN32 */
+} mm_cdrlog_seg_t;
+
+typedef struct mm_cdrlog_key {
+    char terminal_id[10];       /* Not NUL-terminated */
+    uint16_t seq;
+    uint8_t start_timestamp[6];
+} mm_cdrlog_key_t;
+
+typedef struct mm_cdrlog {
+    char dir[256];
+    mm_cdrlog_seg_t append;     /* Segment being appended to */
+    mm_cdrlog_seg_t index;      /* Segment being indexed into TCDR */
+    uint32_t unsynced;          /* Records appended since the last synchronous flush */
+    mm_lockfile_t lock;         /* cdr.lock, shared by all processes logging to dir */
+    mm_cdrlog_key_t recent[CDRLOG_RECENT_RECORDS];  /* Records last appended, a ring */
+    uint32_t recent_next;       /* Next entry of recent to replace */
+} mm_cdrlog_t;
+
+typedef struct mm_tsdb_checkpoint {
+    int64_t time;
+    size_t offset;              /* Of the checkpoint sample in buf */
+} mm_tsdb_checkpoint_t;
+
+typedef struct mm_tsdb_series {
+    struct mm_tsdb_series* next;
+    char terminal_id[11];
+    uint8_t record_type;
+    uint8_t metrics;            /* Counters per sample */
+    uint8_t* buf;               /* Encoded samples, as in the file after its header */
+    size_t len;
+    size_t size;
+    size_t file_len;            /* 0 if the file has not been created */
+    uint8_t truncate;           /* The file ends in an incomplete sample, past file_len */
+    uint32_t count;             /* Samples */
+    int64_t last_time;
+    int64_t last_delta;
+    uint32_t last_value[TSDB_METRICS_MAX];
+    mm_tsdb_checkpoint_t* checkpoint;
+    uint32_t ncheckpoints;
+    uint32_t checkpoint_size;
+} mm_tsdb_series_t;
+
+typedef struct mm_tsdb {
+    char dir[256];
+    mm_tsdb_series_t* bucket[TERMINAL_CACHE_BUCKETS];
+    mm_lockfile_t lock;         /* tsdb.lock, shared by all processes keeping series in dir */
+} mm_tsdb_t;
+
+typedef void (*mm_tsdb_callback_t)(int64_t time, uint32_t value, void* arg);
+
+/* Records received from the terminal, by table ID. */
+typedef struct mm_record_counters {
+    uint32_t records[256];
+    uint32_t bytes[256];
+    uint32_t truncated;         /* Records cut short by the end of the packet */
+    uint32_t unknown;           /* Unhandled table IDs, ending their packet */
+} mm_record_counters_t;
+
+/* Hash of a table file as last loaded, reused until the file changes. */
+typedef struct mm_table_hash {
+    char path[TABLE_PATH_MAX_LEN];
+    int64_t mtime;
+    int64_t size;
+    uint8_t terminal_type;      /* Tables are adjusted for the terminal type when loaded */
+    uint32_t hash;
+} mm_table_hash_t;
+
+/* Table download in progress, see mm_download_next(). */
+typedef struct mm_download {
+    char terminal_id[11];
+    mm_terminal_state_t* term_state;
+    uint8_t pending;                        /* Only the tables in pending_tables */
+    uint8_t pending_tables[256 / 8];
+    uint8_t resume;                         /* Skip tables confirmed before an interruption */
+    uint8_t unconfirmed;                    /* A table was not confirmed */
+    uint8_t waiting_ack;                    /* Table sent, waiting for DLOG_MT_TABLE_UPD_ACK */
+    uint8_t* table_list;
+    int table_index;
+    uint8_t table_id;                       /* 0 once the table list is done */
+    uint8_t* table_buffer;
+    size_t table_len;
+    uint32_t table_hash;
+    uint16_t tables_sent;
+    uint16_t tables_total;
+} mm_download_t;
+
+/* Call in progress, advanced as each protocol operation completes.  See mm_session_step(). */
+#define SESSION_RECEIVE             (0)     /* Receiving a frame of records */
+#define SESSION_REPLY               (1)     /* Sending the reply to them */
+#define SESSION_DOWNLOAD            (2)     /* Sending tables */
+
+typedef struct mm_session {
+    uint8_t state;              /* SESSION_ */
+    uint8_t retries;            /* Frames in a row not received or not processed */
+    uint8_t send_reply;         /* Reply to send once the frame is processed */
+    uint8_t download;           /* Download to start after the reply, see mm_download_prepare() */
+    mm_table_t table;           /* Frame being received */
+    mm_download_t dl;
+} mm_session_t;
+
 typedef struct mm_context {
     void* database;
+    void* database_ro;      /* Read-only connection, for lookups */
+    mm_terminal_cache_t* terminal_cache;
     mm_connection_t connection;
     /* Configuration */
     mm_telco_t telco;
@@ -1319,83 +1711,308 @@ typedef struct mm_context {
     uint8_t access_code[4];
     uint8_t key_card_number[5];
     uint8_t minimal_table_set;
+    uint8_t push_pending_tables;    /* Answer END_DATA with TABLE_UPD when tables are pending, -P */
+    char line_id[64];           /* Modem line, for link statistics */
+    uint16_t busy_out_secs;     /* Busy out a poor line for this long, 0 to disable */
+    mm_snapshot_t snapshot;
+    mm_cdrlog_t* cdr_log;       /* Primary CDR store, NULL to insert CDRs directly */
+    mm_tsdb_t* tsdb;            /* Statistics time series, NULL if not kept */
     /* Manager-wide */
-    uint8_t cdr_ack_buffer[PKT_TABLE_DATA_LEN_MAX];
-    uint8_t cdr_ack_buffer_len;
+    mm_reply_t reply;
+    mm_reply_t cdr_ack;     /* CDR ACKs deferred until DLOG_MT_END_DATA */
     uint8_t trans_data_in_progress;
     uint8_t debuglevel;
     /* Terminal State */
     uint8_t terminal_type;
     uint8_t terminal_upd_reason;
     uint8_t complete_download;
+    uint8_t live_call;          /* Rate or card authorization requested during the call */
+    uint8_t link_quality;       /* Worse of the line and terminal link quality */
     cashbox_status_univ_t cashbox_status;
+    mm_link_stats_t line_link;
+    mm_session_t session;
+    mm_record_counters_t rx_records;    /* Records received during the call */
+    mm_table_hash_t table_hash[256];    /* By table ID, for pending table checks */
     uint8_t rating_test_mode;
     uint8_t test_mode;
 } mm_context_t;
 
-typedef uint32_t pkt_status_t;  /* Packet status flags. */
-
 /* MM Connection */
 int mm_connection_open(mm_connection_t* connection, const char* modem_dev, int baudrate, int test_mode);
 int mm_connection_wait(mm_connection_t* connection);
 int mm_connection_close(mm_connection_t* connection);
+int mm_connection_busy_out(mm_connection_t* connection, int seconds);
 
 /* MM Protocol */
 extern int proto_connect(mm_proto_t* proto);
 extern int proto_disconnect(mm_proto_t* proto);
 extern int proto_connected(mm_proto_t* proto);
-extern int receive_mm_table(mm_proto_t* proto, mm_table_t* table);
-extern int send_mm_table(mm_proto_t* proto, uint8_t* payload, size_t len);
-extern int wait_for_table_ack(mm_proto_t* proto, uint8_t table_id);
+extern void proto_receive(mm_proto_t* proto, mm_table_t* table);
+extern void proto_send_table(mm_proto_t* proto, const uint8_t* payload, size_t len);
+extern void proto_send_reply(mm_proto_t* proto, mm_reply_t* reply);
+extern void proto_expect_table_ack(mm_proto_t* proto, uint8_t table_id);
+extern int proto_rx(mm_proto_t* proto, uint8_t databyte);
+extern int proto_tick(mm_proto_t* proto);
+extern int proto_poll(mm_proto_t* proto);
+extern void proto_rx_reset(mm_proto_t* proto, mm_packet_t* pkt);
+extern pkt_status_t proto_rx_byte(mm_proto_t* proto, mm_packet_t* pkt, uint8_t databyte);
+extern int mm_reply_append(mm_reply_t* reply, const void* record, size_t len);
+extern int mm_reply_append_reply(mm_reply_t* reply, const mm_reply_t* src);
+extern void mm_reply_reset(mm_reply_t* reply);
+extern void mm_reply_free(mm_reply_t* reply);
 
 /* modem functions */
 extern int init_modem(struct mm_serial_context *pserial_context, const char *modem_reset_string, const char *modem_init_string);
 extern int wait_for_modem_response(struct mm_serial_context *pserial_context, int max_tries);
 extern int hangup_modem(struct mm_serial_context *pserial_context);
+extern int modem_off_hook(struct mm_serial_context *pserial_context, int off_hook);
 
 /* accounting functions */
 extern int mm_acct_create_tables(void *db);
 extern int mm_acct_save_TALARM(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt_alarm_t *alarm);
 extern int mm_acct_save_TAUTH(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt_funf_card_auth_t* auth_request);
 extern int mm_acct_save_TCDR(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt_call_details_t *cdr);
+extern void mm_acct_print_TCDR(dlog_mt_call_details_t *cdr);
+extern int mm_acct_is_duplicate_TCDR(void *db, mm_cdrlog_t* cdr_log, const char* terminal_id, dlog_mt_call_details_t *cdr);
+extern int mm_acct_is_duplicate_TAUTH(void *db, const char* terminal_id, dlog_mt_funf_card_auth_t* auth_request);
+extern int mm_acct_insert_TCDR(void *db, mm_telco_t *telco, const char* terminal_id, dlog_mt_call_details_t *cdr, time_t received_time);
 extern int mm_acct_save_TCALLST(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt_summary_call_stats_t* summary_call_stats);
-extern int mm_acct_load_TCASHST(void *db, char* terminal_id, cashbox_status_univ_t* cashbox_status);
-extern int mm_acct_save_TCASHST(void *db, mm_telco_t *telco, char* terminal_id, cashbox_status_univ_t* cashbox_status);
+extern int mm_acct_load_TCASHST(void *db, char* terminal_id, cashbox_status_univ_t* cashbox_status, mm_terminal_state_t* term_state);
+extern int mm_acct_save_TCASHST(void *db, mm_telco_t *telco, char* terminal_id, cashbox_status_univ_t* cashbox_status, mm_terminal_state_t* term_state);
 extern int mm_acct_save_TCOLLST(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt_cash_box_collection_t* cash_box_collection);
 extern int mm_acct_save_TOPCODE(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt_maint_req_t *maint);
 extern int mm_acct_save_TPERFST(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt_perf_stats_record_t* perf_stats);
-extern int mm_acct_save_TSTATUS(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt_term_status_t* dlog_mt_term_status);
-extern int mm_acct_save_TSWVERS(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt_sw_version_t* dlog_mt_sw_version, uint8_t* terminal_type);
+extern int mm_acct_save_TSTATUS(void *db, mm_telco_t *telco, char* terminal_id, dlog_mt_term_status_t* dlog_mt_term_status, mm_terminal_state_t* term_state);
+extern int mm_acct_save_TSWVERS(void *db, void *db_ro, mm_telco_t *telco, char* terminal_id, dlog_mt_sw_version_t* dlog_mt_sw_version, uint8_t* terminal_type, mm_terminal_state_t* term_state);
+
+/* Terminal state cache */
+mm_terminal_cache_t* mm_terminal_cache_create(void* db);
+void mm_terminal_cache_destroy(mm_terminal_cache_t* cache);
+mm_terminal_state_t* mm_terminal_cache_get(mm_terminal_cache_t* cache, const char* terminal_id);
+void mm_terminal_cache_begin_call(mm_terminal_cache_t* cache);
+int mm_terminal_create_tables(void* db);
+int mm_terminal_load(void* db, mm_terminal_state_t* term_state);
+int mm_terminal_save(void* db, mm_telco_t* telco, mm_terminal_state_t* term_state);
+int mm_terminal_save_table_hash(void* db, mm_terminal_state_t* term_state, uint8_t table_id, uint32_t table_hash);
+int mm_terminal_download_start(void* db, mm_telco_t* telco, mm_terminal_state_t* term_state);
+int mm_terminal_download_complete(void* db, mm_telco_t* telco, mm_terminal_state_t* term_state);
 
 /* Table functions */
 int    mm_table_create_tables(void* db);
 size_t mm_table_load(mm_context_t* context, uint8_t table_id, uint64_t version_timestamp, uint8_t* buffer, size_t buflen);
 int    mm_table_save(mm_context_t* context, uint8_t table_id, uint64_t version_timestamp, uint8_t* buffer, size_t buflen);
 
+/* Counter deltas */
+int mm_counters_create_tables(void* db);
+int mm_counters_save_TPERFST(void* db, const char* terminal_id, dlog_mt_perf_stats_record_t* perf_stats);
+int mm_counters_save_TCALLST(void* db, const char* terminal_id, dlog_mt_summary_call_stats_t* summary_call_stats);
+uint8_t mm_counters_TPERFST(const dlog_mt_perf_stats_record_t* perf_stats, uint32_t* value);
+uint8_t mm_counters_TCALLST(const dlog_mt_summary_call_stats_t* summary_call_stats, uint32_t* value);
+
+/* Link quality */
+int mm_link_create_tables(void* db);
+int mm_link_load(void* db, char link_type, const char* link_id, mm_link_stats_t* stats);
+int mm_link_save(void* db, char link_type, const char* link_id, mm_link_stats_t* stats);
+void mm_link_begin_call(mm_proto_t* proto);
+int mm_link_update(mm_link_stats_t* stats, const mm_link_counters_t* counters);
+uint8_t mm_link_quality(const mm_link_stats_t* stats);
+const char* mm_link_quality_to_str(uint8_t quality);
+void mm_link_adapt(mm_proto_t* proto, uint8_t quality);
+void mm_link_print(const char* name, const mm_link_stats_t* stats);
+void mm_link_print_call(const mm_link_counters_t* counters, int baudrate);
+
+/* Fleet rollout campaigns */
+int mm_campaign_create_tables(void* db);
+int mm_campaign_create(mm_context_t* context, const char* name, uint8_t* buffer, size_t buflen,
+                       uint8_t model, uint16_t mtr, const char* terminal_pattern, uint16_t lines);
+int mm_campaign_cancel(void* db, int campaign_id);
+int mm_campaign_print_status(void* db, FILE* stream);
+int mm_campaign_load_table(void* db, const char* terminal_id, uint8_t table_id, uint8_t** buffer, size_t* len);
+int mm_campaign_mark_pending(void* db, mm_terminal_state_t* term_state);
+int mm_campaign_tables(void* db, const char* terminal_id, uint8_t* tables);
+int mm_campaign_table_confirmed(void* db, const char* terminal_id, uint8_t table_id);
+int mm_campaign_schedule_callback(void* db, const char* terminal_id, time_t now, time_t* callback_time);
+
+/* Accounting event feed */
+int mm_events_open(const char* filename);
+void mm_events_close(void);
+int mm_events_enabled(void);
+int mm_events_emit(const char* terminal_id, time_t received_time, const void* record, size_t record_len);
+void mm_events_begin(void);
+int mm_events_commit(void);
+void mm_events_rollback(void);
+
+/* Duplicate record filter, see mm_dedup.c */
+#define DEDUP_FILTER_BITS           (1u << 20)  /* 128KiB, must be a power of 2 */
+#define DEDUP_FILTER_HASHES         (7)
+#define DEDUP_FILTER_MAX_KEYS       (100000)    /* Per generation, about 2% false positives */
+
+int mm_dedup_open(void);
+void mm_dedup_close(void);
+int mm_dedup_test_and_add(const void* key, size_t len);
+
+/* Live status board */
+mm_status_t* mm_status_open(const char* filename, const char* line_id);
+mm_status_t* mm_status_attach(const char* filename);
+void mm_status_close(mm_status_t* status);
+int mm_status_read(const mm_status_t* status, int index, mm_status_line_t* line);
+void mm_status_state(mm_status_t* status, uint8_t state);
+void mm_status_progress(mm_status_t* status, const char* terminal_id, const mm_link_counters_t* link);
+void mm_status_download(mm_status_t* status, uint8_t table_id, uint16_t sent, uint16_t total);
+void mm_status_cdr(mm_status_t* status);
+
+/* Alarm correlation, see mm_alarm.c */
+#define ALARM_ID_MAX                (40)    /* Alarms 0-39 are terminal status word bits */
+#define ALARM_FLAP_OPENS            (3)     /* Opens in ALARM_FLAP_SECS before flapping */
+#define ALARM_FLAP_SECS             (3600)
+#define ALARM_STORM_TERMINALS       (20)    /* Opens of one alarm in ALARM_STORM_SECS for a storm */
+#define ALARM_STORM_SECS            (600)
+#define ALARM_STEP_SECS             (60)    /* Interval between mm_alarm_step() checks */
+
+#define ALARM_STATE_CLEARED         (0)
+#define ALARM_STATE_OPEN            (1)
+#define ALARM_STATE_FLAPPING        (2)
+
+#define ALARM_STORM_HELD            (1)     /* Opened during a storm, not stored in TALARM yet */
+#define ALARM_STORM_COUNTED         (2)     /* Opened as the storm started, already stored */
+
+/* State of one alarm on one terminal, as stored in TALARM_STATE */
+typedef struct mm_alarm_state {
+    uint8_t stored;             /* Has a row in TALARM_STATE */
+    uint8_t changed;            /* State changed since loaded, so SINCE is updated */
+    uint8_t state;              /* ALARM_STATE_* */
+    uint8_t raised;             /* As last reported by the terminal */
+    uint8_t in_storm;           /* ALARM_STORM_*, or 0 if not part of a storm */
+    uint32_t occurrences;       /* Opens since the state changed */
+    uint32_t flap_opens;        /* Opens since flap_start */
+    int64_t last_change;        /* Last raised or cleared */
+    int64_t last_open;
+    int64_t flap_start;
+} mm_alarm_state_t;
+
+int mm_alarm_create_tables(void* db);
+int mm_alarm_raise(void* db, const char* terminal_id, uint8_t alarm_id, time_t now);
+void mm_alarm_status(void* db, const char* terminal_id, const uint8_t* status, time_t now);
+void mm_alarm_step(void* db, mm_telco_t* telco, time_t now);
+
+/* Memory-mapped CDR log */
+mm_cdrlog_t* mm_cdrlog_open(const char* dir);
+void mm_cdrlog_close(mm_cdrlog_t* log);
+int mm_cdrlog_append(mm_cdrlog_t* log, const char* terminal_id, const dlog_mt_call_details_t* cdr, time_t received_time);
+int mm_cdrlog_find(mm_cdrlog_t* log, const char* terminal_id, const dlog_mt_call_details_t* cdr);
+int mm_cdrlog_sync(mm_cdrlog_t* log, int wait);
+int mm_cdrlog_index(mm_cdrlog_t* log, void* db, mm_telco_t* telco, int max_records);
+
+/* Statistics time series, see mm_tsdb.c */
+mm_tsdb_t* mm_tsdb_open(const char* dir);
+void mm_tsdb_close(mm_tsdb_t* tsdb);
+int mm_tsdb_append(mm_tsdb_t* tsdb, const char* terminal_id, uint8_t record_type, const uint8_t* timestamp,
+                   const uint32_t* value, uint8_t metrics);
+int mm_tsdb_scan(mm_tsdb_t* tsdb, const char* terminal_id, uint8_t record_type, uint8_t metric,
+                 int64_t from, int64_t to, mm_tsdb_callback_t callback, void* arg);
+int64_t mm_tsdb_time(const uint8_t* timestamp);
+void mm_tsdb_timestamp(int64_t time, uint8_t* timestamp);
+
 /* Manager Configuration Database */
 int mm_config_create_tables(void* db);
+int mm_config_import_TERMTYP(void* db, const char* csv_fname);
 uint8_t mm_config_get_term_type_from_control_rom_edition(void* db, const char* control_rom_edition);
 
+/*
+ * Control ROM edition to terminal type lookup, generated at build time
+ * from config/control_rom_versions.csv by mm_termtyp_gen.  The edition
+ * hashes to a bucket, whose displacement seeds a second hash that gives
+ * the slot holding that edition.
+ */
+#define TERMTYP_TABLE_BUCKETS   (128)   /* Must be a power of two */
+#define TERMTYP_TABLE_SLOTS     (512)   /* Must be a power of two */
+
+typedef struct termtyp_table_entry {
+    char    control_rom_edition[8];
+    uint8_t terminal_type;
+} termtyp_table_entry_t;
+
+extern const uint32_t termtyp_table_disp[TERMTYP_TABLE_BUCKETS];
+extern const termtyp_table_entry_t termtyp_table[TERMTYP_TABLE_SLOTS];
+
+/*
+ * Storage backend, selected when the database is opened, see mm_db.c.
+ * Statements are written in SQLite's dialect; backends for other
+ * databases translate them as needed.
+ */
+typedef struct mm_db_ops {
+    const char* name;
+    void* (*open)(const char* db_spec, int read_only);
+    int   (*close)(void* conn);
+    int   (*exec)(void* conn, const char* sql);
+    int   (*exec_batch)(void* conn, const char* sql);  /* May be deferred until flush() */
+    int   (*flush)(void* conn);
+    int64_t (*last_insert_id)(void* conn);              /* Row ID assigned by the last INSERT */
+    int64_t (*total_changes)(void* conn);               /* Rows changed since the connection was opened */
+    const char* (*errmsg)(void* conn);
+    void* (*prepare)(void* conn, const char* sql);
+    int   (*bind_blob)(void* stmt, int index, const uint8_t* data, size_t len);
+    int   (*step)(void* stmt);                          /* 1 for a row, 0 when done, or negative errno */
+    int   (*column_count)(void* stmt);
+    int64_t (*column_int64)(void* stmt, int col);
+    double (*column_double)(void* stmt, int col);
+    const char* (*column_text)(void* stmt, int col);   /* NULL if the column is NULL */
+    const uint8_t* (*column_blob)(void* stmt, int col, size_t* len);
+    void  (*finalize)(void* stmt);
+} mm_db_ops_t;
+
+typedef struct mm_db {
+    const mm_db_ops_t* ops;
+    void* conn;
+} mm_db_t;
+
+extern const mm_db_ops_t mm_sqlite_ops;
+#ifdef HAVE_MARIADB
+extern const mm_db_ops_t mm_mariadb_ops;
+#endif /* HAVE_MARIADB */
+
 /* database functions */
-extern void *mm_open_database(const char *db_filename);
+extern void *mm_open_database(const char *db_spec);
+extern void *mm_open_database_reader(const char *db_spec);
 extern int mm_close_database(void *db);
+extern int mm_snapshot_init(mm_snapshot_t* snapshot, const char* filename, int freshness_secs);
+extern int mm_snapshot_step(void* db, mm_snapshot_t* snapshot, time_t now);
+extern void mm_snapshot_abort(mm_snapshot_t* snapshot);
+extern void mm_snapshot_close(mm_snapshot_t* snapshot);
 extern int mm_sql_exec(void *db, const char *sql);
+extern int mm_sql_exec_batch(void *db, const char *sql);
+extern int mm_sql_flush(void *db);
+extern int64_t mm_sql_last_insert_id(void *db);
+extern int mm_sql_insert(void *db, const char *sql);
 extern uint8_t mm_sql_read_uint8(void* db, const char* sql);
 extern uint64_t mm_sql_read_uint64(void* db, const char* sql);
 extern int mm_sql_read_blob(void* db, const char* sql, uint8_t* buffer, size_t buflen);
 extern int mm_sql_write_blob(void* db, const char* sql, uint8_t* buffer, size_t buflen);
 extern int mm_sql_load_TCASHST(void* db, const char* terminal_id, cashbox_status_univ_t* cashbox_status);
+extern int mm_sql_load_TTERMINAL(void* db, mm_terminal_state_t* term_state);
+extern int mm_sql_load_TLINKQ(void* db, char link_type, const char* link_id, mm_link_stats_t* stats);
+extern int mm_sql_load_TCOUNTERS(void* db, const char* terminal_id, uint8_t record_type, mm_counters_t* counters);
+extern int mm_sql_load_TALARM_STATE(void* db, const char* terminal_id, uint8_t alarm_id, mm_alarm_state_t* alarm);
+extern int mm_sql_select_TALARM_STATE(void* db, const char* where, void (*callback)(const char* terminal_id, uint8_t alarm_id, uint8_t raised, void* arg), void* arg);
+extern int mm_sql_load_table_bitmap(void* db, const char* sql, uint8_t* bitmap);
+extern int mm_sql_load_histogram(void* db, const char* sql, int64_t first, int64_t bin_width, uint64_t* bins, size_t nbins);
+extern int mm_sql_print_query(void* db, const char* sql, FILE* stream);
 
 /* mm_util */
 extern uint16_t crc16(uint16_t crc, uint8_t *buf, size_t len);
+extern uint32_t mm_hash32(uint32_t hash, const uint8_t *buf, size_t len);
 extern void dump_hex(const uint8_t *data, size_t len);
+extern size_t mm_bcd_unpack(char *string_buf, size_t string_buf_len, const uint8_t *bcd, size_t bcd_len);
+extern size_t mm_bcd_pack(uint8_t *bcd, size_t bcd_len, const char *string, size_t digits, uint8_t fill);
 extern char *phone_num_to_string(char *string_buf, size_t string_len, uint8_t* num_buf, size_t num_buf_len);
 extern uint8_t string_to_bcd_a(char* number_string, uint8_t* buffer, uint8_t buff_len);
 extern char *callscrn_num_to_string(char *string_buf, size_t string_buf_len, uint8_t* num_buf, size_t num_buf_len);
 extern char *call_type_to_string(uint8_t call_type, char *string_buf, size_t string_buf_len);
-extern char *timestamp_to_string(uint8_t *timestamp, char *string_buf, size_t string_buf_len);
-extern char *timestamp_to_db_string(uint8_t *timestamp, char *string_buf, size_t string_buf_len);
+extern char *timestamp_to_string(const uint8_t *timestamp, char *string_buf, size_t string_buf_len);
+extern char *timestamp_to_db_string(const uint8_t *timestamp, char *string_buf, size_t string_buf_len);
 extern char *received_time_to_db_string(char *string_buf, size_t string_buf_len);
+extern char *time_to_db_string(time_t rawtime, char *string_buf, size_t string_buf_len);
+extern struct tm *mm_localtime(time_t rawtime, struct tm *result);
 extern char *seconds_to_ddhhmmss_string(char* string_buf, size_t string_buf_len, uint32_t seconds);
 extern int print_mm_packet(int direction, mm_packet_t *pkt);
 extern const char* error_inject_type_to_str(uint8_t type);
@@ -1418,6 +2035,60 @@ extern void print_comm_stat_table(dlog_mt_comm_stat_params_t* comm_stat_table);
 extern void print_fconfig_table(dlog_mt_fconfig_opts_t* fconfig_table);
 extern int mm_validate_table_fsize(uint8_t table_id, FILE *stream, unsigned long expected_size);
 
+/*
+ * mm_records: records exchanged with the terminal, and their fields
+ * wider than a byte, which are little-endian on the wire.  Each entry
+ * generates mm_decode_<name>(), which copies a record out of a received
+ * buffer into its packed structure, in host byte order, and
+ * mm_encode_<name>(), which copies one into a buffer to send.  Both check the buffer length, and return the
+ * length of the record, or -EINVAL.
+ */
+#define MM_FIELDS_NONE(F)
+#define MM_FIELDS_MAINT_REQ(F)          F(U16, type)
+#define MM_FIELDS_CALL_DETAILS(F)       F(U32S, call_cost) F(U16, seq) F(U64, auth_code)
+#define MM_FIELDS_CASH_BOX(F)           F(U16, currency_value) F(U16S, coin_count)
+#define MM_FIELDS_PERF_STATS(F)         F(U16S, stats)
+#define MM_FIELDS_SUMMARY_CALL_STATS(F) F(U16S, stats) F(U16S, rep_dialer_peg_count) \
+                                        F(U32, total_call_duration) F(U32, total_time_off_hook) \
+                                        F(U16, free_featb_call_count) F(U16, datajack_calls_attempt_count) \
+                                        F(U16, completed_1800_billable_count) F(U16, datajack_calls_complete_count)
+#define MM_FIELDS_RATE_RESPONSE(F)      F(U16, rate.initial_period) F(U16, rate.initial_charge) \
+                                        F(U16, rate.additional_period) F(U16, rate.additional_charge) \
+                                        F(U16, rate2) F(U16, rate3) F(U16, rate4) F(U16, rate5) \
+                                        F(U16, rate6) F(U16, rate7) F(U16, rate8) F(U16, rate9)
+#define MM_FIELDS_FUNF_CARD_AUTH(F)     F(U16, service_code) F(U16, unknown) F(U16, unknown2) \
+                                        F(U16, pin) F(U16, seq)
+#define MM_FIELDS_AUTH_RESP_CODE(F)     F(U64, auth_code)
+
+#define MM_RECORDS(R) \
+    R(alarm,                dlog_mt_alarm_t,                MM_FIELDS_NONE)                 \
+    R(maint_req,            dlog_mt_maint_req_t,            MM_FIELDS_MAINT_REQ)            \
+    R(call_details,         dlog_mt_call_details_t,         MM_FIELDS_CALL_DETAILS)         \
+    R(cash_box_collection,  dlog_mt_cash_box_collection_t,  MM_FIELDS_CASH_BOX)             \
+    R(cashbox_status,       cashbox_status_univ_t,          MM_FIELDS_CASH_BOX)             \
+    R(perf_stats,           dlog_mt_perf_stats_record_t,    MM_FIELDS_PERF_STATS)           \
+    R(summary_call_stats,   dlog_mt_summary_call_stats_t,   MM_FIELDS_SUMMARY_CALL_STATS)   \
+    R(sw_version,           dlog_mt_sw_version_t,           MM_FIELDS_NONE)                 \
+    R(rate_request,         dlog_mt_rate_request_t,         MM_FIELDS_NONE)                 \
+    R(rate_response,        dlog_mt_rate_response_t,        MM_FIELDS_RATE_RESPONSE)        \
+    R(funf_card_auth,       dlog_mt_funf_card_auth_t,       MM_FIELDS_FUNF_CARD_AUTH)       \
+    R(auth_resp_code,       dlog_mt_auth_resp_code_t,       MM_FIELDS_AUTH_RESP_CODE)       \
+    R(term_status,          dlog_mt_term_status_t,          MM_FIELDS_NONE)
+
+#define MM_RECORD_PROTOTYPES(name, type, fields) \
+    extern int mm_decode_##name(const uint8_t *buf, size_t len, type *rec); \
+    extern int mm_encode_##name(const type *rec, uint8_t *buf, size_t len);
+MM_RECORDS(MM_RECORD_PROTOTYPES)
+extern void mm_records_print_call(const mm_record_counters_t* counters);
+
+/* mm_lockfile */
+extern int mm_lockfile_open(mm_lockfile_t* lock, const char* filename);
+extern void mm_lockfile_close(mm_lockfile_t* lock);
+extern int mm_lockfile_lock(mm_lockfile_t* lock, uint32_t n, int wait);
+extern void mm_lockfile_unlock(mm_lockfile_t* lock, uint32_t n);
+extern int mm_lockfile_read(mm_lockfile_t* lock, uint32_t offset, void* buf, size_t len);
+extern int mm_lockfile_write(mm_lockfile_t* lock, uint32_t offset, const void* buf, size_t len);
+
 /* mm_pcap */
 int mm_create_pcap(const char* capfilename, FILE** pcapstream);
 int mm_add_pcap_rec(FILE* pcapstream, int direction, mm_packet_t* pkt, uint32_t ts_sec, uint32_t ts_usec);
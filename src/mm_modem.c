@@ -142,6 +142,11 @@ int hangup_modem(mm_serial_context_t *pserial_context) {
 #endif /* USE_MODEM_DTR */
 }
 
+/* Take the modem off hook to busy out the line, or put it back on hook. */
+int modem_off_hook(mm_serial_context_t *pserial_context, int off_hook) {
+    return send_at_command(pserial_context, off_hook ? "ATH1" : "ATH0");
+}
+
 /* Send AT Command to Modem */
 static int send_at_command(mm_serial_context_t *pserial_context, const char *command) {
     char buffer[80]; /* Input buffer */
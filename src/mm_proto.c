@@ -10,6 +10,7 @@
  * Copyright (c) 2020-2023, Howard M. Harte
  */
 
+#include <errno.h>
 #include <stdio.h>  /* Standard input/output definitions */
 #include <stdlib.h>
 #include <stdint.h>
@@ -27,11 +28,15 @@
 #include "mm_manager.h"
 #include "mm_serial.h"
 #include "mm_udp.h"
+#include "mm_trace.h"
 
-static pkt_status_t receive_mm_packet(mm_proto_t* proto, mm_packet_t* pkt);
-static pkt_status_t send_mm_packet(mm_proto_t* proto, uint8_t* payload, size_t len, uint8_t flags);
-static pkt_status_t wait_for_mm_ack(mm_proto_t* proto);
-static pkt_status_t send_mm_ack(mm_proto_t* proto, uint8_t flags);
+static void proto_frame(mm_proto_t* proto, pkt_status_t status, int received);
+static void proto_send_next(mm_proto_t* proto);
+static void proto_send_ack(mm_proto_t* proto, uint8_t flags);
+static void proto_tx_build(mm_proto_t* proto, mm_packet_t* pkt, const uint8_t* payload, size_t len, uint8_t flags);
+static void proto_tx_frame(mm_proto_t* proto, const mm_packet_t* pkt);
+static void proto_tx_flush(mm_proto_t* proto);
+static uint32_t proto_gap_ms(mm_proto_t* proto);
 
 extern volatile int inject_comm_error;
 
@@ -43,17 +48,60 @@ extern volatile int inject_comm_error;
 #define L2_STATE_GET_CRC1           6
 #define L2_STATE_SEARCH_FOR_STOP    7
 
+/* Frame waited for, within an operation. */
+#define PROTO_STEP_FRAME            1   /* The frame the operation is about */
+#define PROTO_STEP_ACK              2   /* ACK or NACK for the frame sent */
+#define PROTO_STEP_NACKED           3   /* The terminal's answer to a NACK or retry request */
+
+#define PROTO_TABLE_ACK_RETRIES     2   /* Retry requests before giving up on a table ACK */
+#define PKT_TIMEOUT_MS              ((uint32_t)PKT_TIMEOUT_MAX * 1000)
+
+/* Millisecond clock, for measuring ACK turnaround. */
+static uint32_t proto_clock_ms(void) {
+    struct timespec ts = { 0 };
+
+    timespec_get(&ts, TIME_UTC);
+
+    return (uint32_t)(((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000));
+}
+
+/*
+ * Take the terminal ID from the first bytes of a received packet.  It only
+ * changes at the start of a call, so it is unpacked only when it differs
+ * from the last one, and sent packets reuse the packed form.
+ */
+static void proto_set_terminal_id(mm_proto_t* proto, const uint8_t* bcd) {
+    if ((proto->terminal_id[0] != '\0') && (memcmp(proto->terminal_id_bcd, bcd, PKT_TABLE_ID_OFFSET) == 0)) {
+        return;
+    }
+
+    memcpy(proto->terminal_id_bcd, bcd, PKT_TABLE_ID_OFFSET);
+    mm_bcd_unpack(proto->terminal_id, sizeof(proto->terminal_id), bcd, PKT_TABLE_ID_OFFSET);
+}
 
 int proto_connect(mm_proto_t* proto) {
     proto->tx_seq = 0;
+    proto->terminal_id[0] = '\0';
+    memset(proto->terminal_id_bcd, 0, sizeof(proto->terminal_id_bcd));
     proto->connected = 1;
+    proto->rx_pkt = NULL;
+    proto->tx_count = 0;
+    proto->tx_ready_ms = proto_clock_ms();
+    memset(&proto->op, 0, sizeof(proto->op));
+    serial_noise_start(proto->serial_context);
 
     return (0);
 }
 
 int proto_disconnect(mm_proto_t *proto) {
+    if (proto->connected) {
+        MM_TRACE3(session_end, proto->terminal_id, proto->link.bytes_tx, proto->link.bytes_rx);
+    }
+
+    serial_noise_stop(proto->serial_context);
     hangup_modem(proto->serial_context);
     proto->tx_seq = 0;
+    proto->tx_count = 0;    /* Frames not yet written are lost with the line. */
     proto->connected = 0;
 
     return (0);
@@ -63,23 +111,175 @@ int proto_connected(mm_proto_t* proto) {
     return (proto->connected);
 }
 
-int receive_mm_table(mm_proto_t* proto, mm_table_t* table) {
-    mm_packet_t* pkt = &table->pkt;
-    uint8_t  status;
+/* Append a record to the reply, growing the reply as needed. */
+int mm_reply_append(mm_reply_t* reply, const void* record, size_t len) {
+    if (reply->len + len > reply->size) {
+        size_t   size = reply->size ? reply->size : PKT_TABLE_DATA_LEN_MAX;
+        uint8_t* buf;
+
+        while (reply->len + len > size) size *= 2;
+
+        buf = (uint8_t*)realloc(reply->buf, size);
+        if (buf == NULL) {
+            fprintf(stderr, "%s: Error: failed to allocate %zu bytes.\n", __func__, size);
+            return -ENOMEM;
+        }
+        reply->buf = buf;
+        reply->size = size;
+    }
+
+    if (reply->nrec == reply->rec_size) {
+        size_t  rec_size = reply->rec_size ? reply->rec_size * 2 : 64;
+        size_t* rec_end;
+
+        rec_end = (size_t*)realloc(reply->rec_end, rec_size * sizeof(size_t));
+        if (rec_end == NULL) {
+            fprintf(stderr, "%s: Error: failed to allocate %zu bytes.\n", __func__, rec_size * sizeof(size_t));
+            return -ENOMEM;
+        }
+        reply->rec_end = rec_end;
+        reply->rec_size = rec_size;
+    }
+
+    memcpy(&reply->buf[reply->len], record, len);
+    reply->len += len;
+    reply->rec_end[reply->nrec++] = reply->len;
+
+    return 0;
+}
+
+/* Append all records of src to the reply. */
+int mm_reply_append_reply(mm_reply_t* reply, const mm_reply_t* src) {
+    size_t start = 0;
+    size_t i;
+    int    status;
+
+    for (i = 0; i < src->nrec; i++) {
+        status = mm_reply_append(reply, &src->buf[start], src->rec_end[i] - start);
+        if (status != 0) return status;
+
+        start = src->rec_end[i];
+    }
+
+    return 0;
+}
+
+void mm_reply_reset(mm_reply_t* reply) {
+    reply->len = 0;
+    reply->nrec = 0;
+}
+
+void mm_reply_free(mm_reply_t* reply) {
+    free(reply->buf);
+    free(reply->rec_end);
+    memset(reply, 0, sizeof(mm_reply_t));
+}
+
+/*
+ * A call is carried out as a series of operations: receive a frame from
+ * the terminal, send a table or reply, wait for the terminal to
+ * acknowledge a table.  Each operation keeps its state in proto->op and
+ * is advanced by the frames received from the terminal, proto_rx(), and
+ * by the passing of time, proto_tick(), so no operation waits for the
+ * line.  proto_poll() drives them from this process's serial port.
+ */
+static void proto_op_start(mm_proto_t* proto, uint8_t type) {
+    memset(&proto->op, 0, sizeof(proto->op));
+    proto->op.type = type;
+}
+
+static void proto_op_done(mm_proto_t* proto, int status) {
+    proto->op.type = PROTO_OP_DONE;
+    proto->op.status = status;
+    proto->rx_pkt = NULL;
+}
+
+static int proto_carrier_lost(mm_proto_t* proto) {
+    if (!proto->monitor_carrier) return 0;
+
+    if ((serial_get_modem_status(proto->serial_context) & (MS_RING_ON | MS_RLSD_ON)) != 0) return 0;
+
+    fprintf(stderr, "%s: Carrier lost, bailing.\n", __func__);
+    proto_disconnect(proto);
+
+    return 1;
+}
+
+/* Wait for the next frame from the terminal, as the given step of the operation. */
+static void proto_wait_frame(mm_proto_t* proto, mm_packet_t* pkt, uint8_t step) {
+    proto->op.step = step;
+    proto->rx_pkt = pkt;
+    proto_rx_reset(proto, pkt);
+    proto->rx_deadline_ms = proto_clock_ms() + PKT_TIMEOUT_MS;
+
+    if (proto_carrier_lost(proto)) {
+        proto_frame(proto, PKT_ERROR_NO_CARRIER, 1);
+    } else if (!proto->connected) {
+        fprintf(stderr, "%s: Attempt to receive packet while disconnected, bailing.\n", __func__);
+        proto_frame(proto, PKT_ERROR_DISCONNECT, 0);
+    }
+}
+
+static void proto_wait_ack(mm_proto_t* proto, uint8_t step) {
+    proto->waiting_for_ack = 1;
+    MM_TRACE0(ack_wait_start);
+    proto_wait_frame(proto, &proto->ack_pkt, step);
+}
+
+/*
+ * Interpret the frame received while waiting for an ACK.  A frame with
+ * data also acknowledges the frame sent.  received is 0 if the line was
+ * already down.
+ */
+static pkt_status_t proto_ack_status(mm_proto_t* proto, pkt_status_t status, int received) {
+    mm_packet_t* pkt = &proto->ack_pkt;
 
-    status = receive_mm_packet(proto, pkt);
+    proto->waiting_for_ack = 0;
+    MM_TRACE2(ack_wait_end, status, pkt->hdr.flags);
+
+    if (!received) return status;
+
+    if ((status == PKT_SUCCESS) || (status == PKT_ERROR_DISCONNECT)) {
+        if (proto->debuglevel > 2) print_mm_packet(RX, pkt);
+
+        if ((pkt->payload_len == 0) && !(pkt->hdr.flags & FLAG_ACK)) {
+            /* ACK flag is not set: NACK. */
+            return PKT_ERROR_NACK;
+        }
+        return PKT_SUCCESS;
+    }
+    fprintf(stderr, "%s: Error, did not receive an ACK packet, status=0x%02x\n", __func__, status);
+    return status;
+}
+
+/*
+ * Start receiving a frame from the terminal into table.  The frame is
+ * acknowledged, or NACKed if it is received with errors.
+ *
+ * Like the other operations, it completes as the terminal answers, with
+ * its result in proto->op.status: PKT_SUCCESS, or PKT_ERROR_ flags.
+ */
+void proto_receive(mm_proto_t* proto, mm_table_t* table) {
+    proto_op_start(proto, PROTO_OP_RECEIVE);
+    proto->op.table = table;
+    proto_wait_frame(proto, &table->pkt, PROTO_STEP_FRAME);
+}
+
+static void proto_receive_frame(mm_proto_t* proto, pkt_status_t status) {
+    mm_table_t*  table = proto->op.table;
+    mm_packet_t* pkt = &table->pkt;
 
     if ((status != PKT_SUCCESS) && (status != PKT_ERROR_RETRY)) {
         if (proto->debuglevel > 2) print_mm_packet(RX, pkt);
 
         if (proto->connected) {
-            send_mm_ack(proto, FLAG_NACK);  /* Retry unless the terminal disconnected. */
-            status = wait_for_mm_ack(proto);
-            if (status != PKT_ERROR_NACK) {
-                fprintf(stderr, "%s: Expected NACK from terminal, status=0x%02x\n", __func__, status);
-            }
+            proto_send_ack(proto, FLAG_NACK);  /* Retry unless the terminal disconnected. */
+            proto->op.rx_status = status;
+            proto_wait_ack(proto, PROTO_STEP_NACKED);
+        } else {
+            proto_op_done(proto, status);
         }
-        return status;
+        return;
     }
 
     proto->rx_seq = pkt->hdr.flags & FLAG_SEQUENCE;
@@ -88,255 +288,511 @@ int receive_mm_table(mm_proto_t* proto, mm_table_t* table) {
         table->table_id = 0;
         print_mm_packet(RX, pkt);
         fprintf(stderr, "Error: Received an ACK without expecting it!\n");
-        return 0;
+        proto_op_done(proto, PKT_SUCCESS);
+        return;
     }
 
-    phone_num_to_string(proto->terminal_id, sizeof(proto->terminal_id), pkt->payload, PKT_TABLE_ID_OFFSET);
+    proto_set_terminal_id(proto, pkt->payload);
 
     if (proto->debuglevel > 0) {
         print_mm_packet(RX, pkt);
     }
 
     /* Acknowledge the received packet */
-    send_mm_ack(proto, FLAG_ACK);
+    proto_send_ack(proto, FLAG_ACK);
+    proto_op_done(proto, status);
+}
+
+/*
+ * The terminal answered the NACK, usually by sending the frame again,
+ * which is then received in its place.
+ */
+static void proto_receive_nacked(mm_proto_t* proto, pkt_status_t status, int received) {
+    pkt_status_t rx_status = status;
+
+    status = proto_ack_status(proto, status, received);
 
-    return (status);
+    /* The terminal sent the frame again: receive it. */
+    if (received && (rx_status == PKT_SUCCESS) && (proto->ack_pkt.payload_len > 0)) {
+        memcpy(&proto->op.table->pkt, &proto->ack_pkt, sizeof(mm_packet_t));
+        proto_receive_frame(proto, PKT_SUCCESS);
+        return;
+    }
+
+    if (status != PKT_ERROR_NACK) {
+        fprintf(stderr, "%s: Expected NACK from terminal, status=0x%02x\n", __func__, status);
+    }
+
+    proto_op_done(proto, proto->op.rx_status);
 }
 
-int send_mm_table(mm_proto_t* proto, uint8_t* payload, size_t len) {
-    size_t   bytes_remaining;
-    size_t   chunk_len;
-    pkt_status_t status = PKT_SUCCESS;
-    uint8_t* p = payload;
-    uint8_t  table_id;
+static void proto_send_failed(mm_proto_t* proto, pkt_status_t status) {
+    MM_TRACE2(table_send_end, proto->op.table_id, status);
+    proto_op_done(proto, status);
+}
 
-    table_id = payload[0];
-    bytes_remaining = len;
-    printf("\tSending Table ID %d (0x%02x) %s...\n", table_id, table_id, table_to_string(table_id));
+/* Send the frame at op.offset, or send it again. */
+static void proto_send_frame(mm_proto_t* proto) {
+    mm_proto_op_t* op = &proto->op;
+    mm_packet_t    pkt;
 
-    while (bytes_remaining > 0) {
-        if (bytes_remaining > PKT_TABLE_DATA_LEN_MAX) {
-            chunk_len = PKT_TABLE_DATA_LEN_MAX;
-        }
-        else {
-            chunk_len = bytes_remaining;
+    /* Bail out if not connected. */
+    if (!proto->connected) {
+        proto_send_failed(proto, PKT_ERROR_DISCONNECT);
+        return;
+    }
+
+    if (op->retries == 0) {
+        proto->link.frames_tx++;
+    } else {
+        proto->link.retransmits++;
+        proto->link.bytes_retx += (uint32_t)op->chunk + PKT_TABLE_ID_OFFSET + 6;
+        MM_TRACE2(retry, op->retries, op->chunk);
+
+        /* Don't keep retransmitting on a link that is not getting through. */
+        if ((proto->retry_budget != 0) && (proto->link.retransmits > proto->retry_budget)) {
+            printf("%s: Error: Retransmit budget of %d for this call exhausted, hanging up.\n", __func__, proto->retry_budget);
+            proto_disconnect(proto);
+            proto_send_failed(proto, PKT_ERROR_FAILURE | PKT_ERROR_DISCONNECT);
+            return;
         }
+    }
+
+    if (proto->debuglevel > 3) {
+        printf("T<--M Sending packet: Terminal: %s, tx_seq=%d\n", proto->terminal_id, proto->tx_seq);
+    }
+
+    proto_tx_build(proto, &pkt, &op->buf[op->offset], op->chunk, proto->tx_seq & FLAG_SEQUENCE);
+    proto_tx_frame(proto, &pkt);
+    MM_TRACE3(frame_tx, pkt.hdr.flags, pkt.payload_len, op->retries);
 
-        status = send_mm_packet(proto, p, chunk_len, 0);
+    proto_wait_ack(proto, PROTO_STEP_ACK);
+}
+
+/* Send the next frame of the table, or finish it. */
+static void proto_send_chunk(mm_proto_t* proto) {
+    mm_proto_op_t* op = &proto->op;
 
-        if (status != PKT_SUCCESS) break;
+    if (op->offset == op->len) {
+        MM_TRACE2(table_send_end, op->table_id, PKT_SUCCESS);
+        proto_send_next(proto);
+        return;
+    }
 
-        p += chunk_len;
-        bytes_remaining -= chunk_len;
+    op->chunk = op->len - op->offset;
+
+    if (op->chunk > PKT_TABLE_DATA_LEN_MAX) {
+        op->chunk = PKT_TABLE_DATA_LEN_MAX;
+    }
+
+    op->retries = 0;
+    proto_send_frame(proto);
+}
+
+static void proto_send_start(mm_proto_t* proto, const uint8_t* payload, size_t len) {
+    mm_proto_op_t* op = &proto->op;
+
+    op->buf = payload;
+    op->len = len;
+    op->offset = 0;
+    op->table_id = payload[0];
+    printf("\tSending Table ID %d (0x%02x) %s...\n", op->table_id, op->table_id, table_to_string(op->table_id));
+    MM_TRACE2(table_send_start, op->table_id, len);
+
+    proto_send_chunk(proto);
+}
+
+/*
+ * Start the next frame of reply records, packing as many whole records
+ * as will fit into each frame.  A single record larger than a frame is
+ * sent the same way as a table download.
+ */
+static void proto_send_next(mm_proto_t* proto) {
+    mm_proto_op_t* op = &proto->op;
+    mm_reply_t*    reply = op->reply;
+    size_t start;
+    size_t end;
+
+    if ((reply == NULL) || (op->rec == reply->nrec)) {
+        proto_op_done(proto, PKT_SUCCESS);
+        return;
+    }
+
+    start = (op->rec == 0) ? 0 : reply->rec_end[op->rec - 1];
+    end = reply->rec_end[op->rec++];
+
+    while ((op->rec < reply->nrec) && (reply->rec_end[op->rec] - start <= PKT_TABLE_DATA_LEN_MAX)) {
+        end = reply->rec_end[op->rec++];
+    }
+
+    proto_send_start(proto, &reply->buf[start], end - start);
+}
+
+/* The terminal answered the frame sent. */
+static void proto_send_acked(mm_proto_t* proto, pkt_status_t status) {
+    mm_proto_op_t* op = &proto->op;
+
+    if (status == PKT_SUCCESS) {
+        proto->link.turnaround_ms_total += proto_clock_ms() - op->sent_ms;
+        proto->link.turnaround_samples++;
+        proto->tx_seq++;
+
+        op->offset += op->chunk;
         printf("\tTable %d (0x%02x) %s progress: (%3d%%) - %4d / %4zu\n",
-            table_id, table_id, table_to_string(table_id),
-            (uint16_t)(((p - payload) * 100) / len), (uint16_t)(p - payload), len);
+            op->table_id, op->table_id, table_to_string(op->table_id),
+            (uint16_t)((op->offset * 100) / op->len), (uint16_t)op->offset, op->len);
+
+        proto_send_chunk(proto);
+        return;
     }
 
-    return status;
+    if (status == PKT_ERROR_NACK) {
+        proto->link.nacks++;
+        MM_TRACE1(nack, op->retries);
+    }
+
+    printf("%s: Received NACK, retrying %d.\n", __func__, op->retries);
+
+    if (++op->retries == PKT_MAX_RETRIES) {
+        printf("%s: Error: Gave up after %d retries.\n", __func__, op->retries);
+        proto->tx_seq++;
+        proto_send_failed(proto, status | PKT_ERROR_FAILURE);
+        return;
+    }
+
+    proto_send_frame(proto);
 }
 
-int wait_for_table_ack(mm_proto_t* proto, uint8_t table_id) {
-    mm_packet_t  packet = { { 0 }, { 0 }, { 0 }, 0, 0 };
-    mm_packet_t* pkt = &packet;
-    int status;
-    int retries = 2;
+/* Start sending a table, payload[0] being its ID, in as many frames as needed. */
+void proto_send_table(mm_proto_t* proto, const uint8_t* payload, size_t len) {
+    proto_op_start(proto, PROTO_OP_SEND);
+    proto_send_start(proto, payload, len);
+}
+
+/* Start sending the reply, which must be left alone until the operation completes. */
+void proto_send_reply(mm_proto_t* proto, mm_reply_t* reply) {
+    proto_op_start(proto, PROTO_OP_SEND);
+    proto->op.reply = reply;
+    proto_send_next(proto);
+}
+
+/*
+ * Start waiting for DLOG_MT_TABLE_UPD_ACK for table_id.  Completes with
+ * 0 once it is received, -1 if the terminal acknowledges another table,
+ * otherwise PKT_ERROR_ flags.
+ */
+void proto_expect_table_ack(mm_proto_t* proto, uint8_t table_id) {
+    proto_op_start(proto, PROTO_OP_TABLE_ACK);
+    proto->op.table_id = table_id;
 
     if (proto->debuglevel > 1) printf("Waiting for ACK for table %d (0x%02x)\n", table_id, table_id);
+    MM_TRACE1(table_ack_wait_start, table_id);
 
-    while (retries > 0) {
-        memset(pkt, 0, sizeof(mm_packet_t));
-        status = receive_mm_packet(proto, pkt);
-
-        if ((status == PKT_SUCCESS) || (status == PKT_ERROR_RETRY)) {
-            proto->rx_seq = pkt->hdr.flags & FLAG_SEQUENCE;
-
-            if (pkt->payload_len >= PKT_TABLE_ID_OFFSET) {
-                phone_num_to_string(proto->terminal_id, sizeof(proto->terminal_id), pkt->payload, PKT_TABLE_ID_OFFSET);
-
-                if (proto->debuglevel > 1) printf("Received packet from phone# %s\n", proto->terminal_id);
-
-                if (proto->debuglevel > 2) print_mm_packet(RX, pkt);
-
-                if ((pkt->payload[PKT_TABLE_ID_OFFSET] == DLOG_MT_TABLE_UPD_ACK) &&
-                    (pkt->payload[PKT_TABLE_DATA_OFFSET] == table_id)) {
-                    if (proto->debuglevel > 0) {
-                        printf("Seq: %d: Received ACK for table %d (0x%02x)\n",
-                            proto->rx_seq,
-                            table_id,
-                            table_id);
-                    }
-                    send_mm_ack(proto, FLAG_ACK);
-                    return 0;
-                }
-                else {
-                    printf("%s: Error: Received ACK for wrong table, expected %d (0x%02x), received %d (0x%02x)\n",
-                        __func__, table_id, table_id, pkt->payload[6], pkt->payload[6]);
-                    return -1;
-                }
-            }
+    proto_wait_frame(proto, &proto->ack_pkt, PROTO_STEP_FRAME);
+}
+
+static void proto_table_ack_frame(mm_proto_t* proto, pkt_status_t status) {
+    mm_packet_t* pkt = &proto->ack_pkt;
+    uint8_t table_id = proto->op.table_id;
+
+    if ((status == PKT_SUCCESS) || (status == PKT_ERROR_RETRY)) {
+        proto->rx_seq = pkt->hdr.flags & FLAG_SEQUENCE;
+
+        /* Not the table ACK, keep waiting. */
+        if (pkt->payload_len < PKT_TABLE_ID_OFFSET) {
+            proto_wait_frame(proto, pkt, PROTO_STEP_FRAME);
+            return;
         }
-        else {
-            printf("%s: ERROR: Did not receive ACK for table ID %d (0x%02x), status=%02x\n",
-                __func__, table_id, table_id, status);
-
-            if (proto->debuglevel > 2) print_mm_packet(RX, pkt);
-
-            if (proto->connected) {
-                send_mm_ack(proto, FLAG_RETRY);  /* Retry unless the terminal disconnected. */
-                status = wait_for_mm_ack(proto);
-                if (status != PKT_ERROR_NACK) {
-                    fprintf(stderr, "%s: Expected NACK from terminal, status=0x%02x\n", __func__, status);
-                }
-                if (proto->connected) {
-                    send_mm_ack(proto, FLAG_ACK);  /* Retry unless the terminal disconnected. */
-                }
-            }
-            else {
-                /* Not connected anymore, bail out. */
-                break;
+
+        proto_set_terminal_id(proto, pkt->payload);
+
+        if (proto->debuglevel > 1) printf("Received packet from phone# %s\n", proto->terminal_id);
+
+        if (proto->debuglevel > 2) print_mm_packet(RX, pkt);
+
+        if ((pkt->payload[PKT_TABLE_ID_OFFSET] == DLOG_MT_TABLE_UPD_ACK) &&
+            (pkt->payload[PKT_TABLE_DATA_OFFSET] == table_id)) {
+            if (proto->debuglevel > 0) {
+                printf("Seq: %d: Received ACK for table %d (0x%02x)\n",
+                    proto->rx_seq,
+                    table_id,
+                    table_id);
             }
+            MM_TRACE2(table_ack_wait_end, table_id, 0);
+            proto_send_ack(proto, FLAG_ACK);
+            proto_op_done(proto, 0);
+        } else {
+            printf("%s: Error: Received ACK for wrong table, expected %d (0x%02x), received %d (0x%02x)\n",
+                __func__, table_id, table_id, pkt->payload[6], pkt->payload[6]);
+            MM_TRACE2(table_ack_wait_end, table_id, -1);
+            proto_op_done(proto, -1);
         }
+        return;
     }
-    return status;
+
+    printf("%s: ERROR: Did not receive ACK for table ID %d (0x%02x), status=%02x\n",
+        __func__, table_id, table_id, status);
+
+    if (proto->debuglevel > 2) print_mm_packet(RX, pkt);
+
+    /* Not connected anymore, or asked the terminal to retry often enough: give up. */
+    if (!proto->connected || (proto->op.retries == PROTO_TABLE_ACK_RETRIES)) {
+        MM_TRACE2(table_ack_wait_end, table_id, status);
+        proto_op_done(proto, status);
+        return;
+    }
+
+    proto->op.retries++;
+    proto_send_ack(proto, FLAG_RETRY);
+    proto_wait_ack(proto, PROTO_STEP_NACKED);
 }
 
+static void proto_table_ack_nacked(mm_proto_t* proto, pkt_status_t status, int received) {
+    status = proto_ack_status(proto, status, received);
+
+    if (status != PKT_ERROR_NACK) {
+        fprintf(stderr, "%s: Expected NACK from terminal, status=0x%02x\n", __func__, status);
+    }
+
+    if (proto->connected) {
+        proto_send_ack(proto, FLAG_ACK);
+    }
+
+    proto_wait_frame(proto, &proto->ack_pkt, PROTO_STEP_FRAME);
+}
 
 /*
- * Receive a packet from Millennium Terminal.
- *
- * Packets are formatted as follows:
- * +------+-------+--------+-----------+--------+-----+
- * |START | FLAGS | LENGTH | DATA .... | CRC-16 | END |
- * +------+-------+--------+-----------+--------+-----+
+ * The frame waited for has been received with the given status, or the
+ * wait ended without one, so take the next step of the operation.
  */
-static pkt_status_t receive_mm_packet(mm_proto_t *proto, mm_packet_t *pkt) {
-    uint8_t pkt_received = 0;
-    uint8_t databyte     = 0;
-    uint8_t l2_state     = L2_STATE_SEARCH_FOR_START;
-    pkt_status_t status  = PKT_SUCCESS;
-    uint8_t timeout      = 0;
-
-    pkt->payload_len = 0;
-    memset(pkt, 0, sizeof(mm_packet_t));
+static void proto_frame(mm_proto_t* proto, pkt_status_t status, int received) {
+    mm_proto_op_t* op = &proto->op;
 
-    if (proto->monitor_carrier) {
-        if ((serial_get_modem_status(proto->serial_context) & (MS_RING_ON | MS_RLSD_ON)) == 0) {
-            fprintf(stderr, "%s: Carrier lost, bailing.\n", __func__);
-            proto_disconnect(proto);
-            return PKT_ERROR_NO_CARRIER;
-        }
-    }
+    proto->rx_pkt = NULL;
 
-    if (!proto->connected) {
-        fprintf(stderr, "%s: Attempt to receive packet while disconnected, bailing.\n", __func__);
-        return PKT_ERROR_DISCONNECT;
+    switch (op->type) {
+        case PROTO_OP_RECEIVE:
+            if (op->step == PROTO_STEP_FRAME) {
+                proto_receive_frame(proto, status);
+            } else {
+                proto_receive_nacked(proto, status, received);
+            }
+            break;
+        case PROTO_OP_SEND:
+            proto_send_acked(proto, proto_ack_status(proto, status, received));
+            break;
+        case PROTO_OP_TABLE_ACK:
+            if (op->step == PROTO_STEP_FRAME) {
+                proto_table_ack_frame(proto, status);
+            } else {
+                proto_table_ack_nacked(proto, status, received);
+            }
+            break;
+        default:
+            break;
     }
+}
 
-    while (pkt_received == 0) {
-        int inject_error = 0;
-        ssize_t bytes_read;
-        if (inject_comm_error == 1) {
-            if (((proto->error_inject_type == ERROR_INJECT_CRC_DLOG_RX) && (proto->waiting_for_ack == 0)) ||
-                ((proto->error_inject_type == ERROR_INJECT_CRC_ACK_RX)  && (proto->waiting_for_ack == 1))) {
-                inject_error = (l2_state == L2_STATE_GET_CRC0) ? 1 : 0;
-            }
+/*
+ * Advance the operation in progress by one byte received from the
+ * terminal.  Returns 1 once the operation is complete, otherwise 0.
+ */
+int proto_rx(mm_proto_t* proto, uint8_t databyte) {
+    mm_packet_t* pkt = (proto->rx_pkt != NULL) ? proto->rx_pkt : &proto->ack_pkt;
+    pkt_status_t status;
+
+    proto->rx_deadline_ms = proto_clock_ms() + PKT_TIMEOUT_MS;
+    status = proto_rx_byte(proto, pkt, databyte);
+
+    if (status != PKT_RX_IN_PROGRESS) {
+        MM_TRACE3(frame_rx, pkt->hdr.flags, pkt->payload_len, status);
+        proto->tx_ready_ms = proto_clock_ms() + proto_gap_ms(proto);
+
+        if (proto->rx_pkt != NULL) {
+            proto_frame(proto, status, 1);
+        } else {
+            /* Nothing is waiting for it. */
+            proto_rx_reset(proto, pkt);
         }
-        if (inject_error == 1) {
-            printf("Inject error type %d: Injecting error on READ now.\n", proto->error_inject_type);
-            inject_comm_error = 0;
+
+        proto_tx_flush(proto);
+    }
+
+    return (proto->op.type == PROTO_OP_DONE);
+}
+
+/*
+ * Advance the operation in progress as time passes: write the frames
+ * held for the inter-packet gap, and stop waiting for a frame that is
+ * overdue, or will not come because the line is down.  Call it at
+ * least once a second, and at proto->tx_ready_ms while frames are
+ * queued.  Returns 1 once the operation is complete, otherwise 0.
+ */
+int proto_tick(mm_proto_t* proto) {
+    proto_tx_flush(proto);
+
+    if (proto->rx_pkt != NULL) {
+        if (!proto->connected) {
+            proto_frame(proto, PKT_ERROR_DISCONNECT, 0);
+        } else if (proto_carrier_lost(proto)) {
+            proto_frame(proto, PKT_ERROR_NO_CARRIER, 1);
+        } else if ((int32_t)(proto_clock_ms() - proto->rx_deadline_ms) >= 0) {
+            printf("%s: Timeout waiting for packet error.\n", __func__);
+            proto->link.timeouts++;
+            proto_frame(proto, PKT_ERROR_TIMEOUT, 1);
         }
-        while ((bytes_read = read_serial(proto->serial_context, &databyte, 1, inject_error)) == 0) {
-            if (!proto->connected) {
-                return PKT_ERROR_DISCONNECT;
-            }
-            putchar('.');
-            if (proto->monitor_carrier) {
-                if ((serial_get_modem_status(proto->serial_context) & (MS_RING_ON | MS_RLSD_ON)) == 0) {
-                    fprintf(stderr, "%s: Carrier lost, bailing.\n", __func__);
-                    proto_disconnect(proto);
-                    return PKT_ERROR_NO_CARRIER;
-                }
-            }
 
-            fflush(stdout);
-            timeout++;
+        proto_tx_flush(proto);
+    }
 
-            if (timeout > PKT_TIMEOUT_MAX) {
-                printf("%s: Timeout waiting for packet error.\n", __func__);
-                status = PKT_ERROR_TIMEOUT;
-                return status;
-            }
+    return (proto->op.type == PROTO_OP_DONE);
+}
+
+/*
+ * Advance the operation in progress from this process's serial port,
+ * waiting for the inter-packet gap, or for a byte from the terminal
+ * up to the serial read timeout.  Returns 1 once the operation is
+ * complete, with its result in proto->op.status, otherwise 0.
+ */
+int proto_poll(mm_proto_t* proto) {
+    uint8_t databyte = 0;
+    ssize_t bytes_read;
+    int     inject_error = 0;
+
+    if (proto->op.type == PROTO_OP_DONE) return 1;
+
+    if (proto->tx_count > 0) {
+        int32_t gap_ms = (int32_t)(proto->tx_ready_ms - proto_clock_ms());
+
+        if (gap_ms > 0) {
+#ifdef _WIN32
+            Sleep(gap_ms);
+#else  /* ifdef _WIN32 */
+            struct timespec tim;
+            tim.tv_sec = gap_ms / 1000;
+            tim.tv_nsec = (gap_ms % 1000) * 1000000L;
+            nanosleep(&tim, NULL);
+#endif /* _WIN32 */
         }
+        return proto_tick(proto);
+    }
 
-        if (bytes_read == MODEM_RSP_READ_ERROR) {
-            fprintf(stderr, "%s: Error reading from modem, bailing.\n", __func__);
-            proto_disconnect(proto);
-            return PKT_ERROR_FAILURE;
+    if (inject_comm_error == 1) {
+        if (((proto->error_inject_type == ERROR_INJECT_CRC_DLOG_RX) && (proto->waiting_for_ack == 0)) ||
+            ((proto->error_inject_type == ERROR_INJECT_CRC_ACK_RX)  && (proto->waiting_for_ack == 1))) {
+            inject_error = (proto->rx.l2_state == L2_STATE_GET_CRC0) ? 1 : 0;
         }
+    }
+    if (inject_error == 1) {
+        printf("Inject error type %d: Injecting error on READ now.\n", proto->error_inject_type);
+        inject_comm_error = 0;
+    }
+
+    bytes_read = read_serial(proto->serial_context, &databyte, 1, inject_error);
+
+    if (bytes_read == 0) {
+        putchar('.');
+        fflush(stdout);
+        return proto_tick(proto);
+    }
+
+    if (bytes_read == MODEM_RSP_READ_ERROR) {
+        fprintf(stderr, "%s: Error reading from modem, bailing.\n", __func__);
+        proto_disconnect(proto);
 
-        timeout = 0;
-
-        switch (l2_state) {
-            case L2_STATE_SEARCH_FOR_START:
-                if (databyte == START_BYTE) {
-                    l2_state         = L2_STATE_GET_FLAGS;
-                    pkt->payload_len = 0;
-                    pkt->hdr.start   = databyte;
-                }
-                break;
-            case L2_STATE_GET_FLAGS:
-                l2_state       = L2_STATE_GET_LENGTH;
-                pkt->hdr.flags = databyte;
-                break;
-            case L2_STATE_GET_LENGTH:
-                pkt->hdr.pktlen = databyte;
-
-                if (pkt->hdr.pktlen > 5) {
-                    l2_state = L2_STATE_ACCUMULATE_DATA;
-                } else {
-                    l2_state = L2_STATE_GET_CRC0;
-                }
-                break;
-            case L2_STATE_ACCUMULATE_DATA:
-                pkt->payload[pkt->payload_len] = databyte;
-                pkt->payload_len++;
-
-                if (pkt->payload_len == pkt->hdr.pktlen - 5) {
-                    l2_state = L2_STATE_GET_CRC0;
-                }
-                break;
-            case L2_STATE_GET_CRC0:
-                l2_state         = L2_STATE_GET_CRC1;
-                pkt->trailer.crc = databyte;
-                break;
-            case L2_STATE_GET_CRC1:
-                l2_state            = L2_STATE_SEARCH_FOR_STOP;
-
-                pkt->trailer.crc   |= (uint16_t)(databyte << 8);
-                pkt->trailer.crc    = LE16(pkt->trailer.crc);
-                pkt->calculated_crc = crc16(0, &pkt->hdr.start, 3);
-                pkt->calculated_crc = crc16(pkt->calculated_crc, pkt->payload, (size_t)pkt->payload_len);
-                pkt->calculated_crc = LE16(pkt->calculated_crc);
-
-                if (pkt->trailer.crc != pkt->calculated_crc) {
-                    printf("%s: CRC Error!\n", __func__);
-                    status |= PKT_ERROR_CRC;
-                }
-                break;
-            case L2_STATE_SEARCH_FOR_STOP:
-                if (databyte == STOP_BYTE) {
-                    l2_state = L2_STATE_SEARCH_FOR_START;
-                } else {
-                    printf("%s: Framing Error!\n", __func__);
-                    status |= PKT_ERROR_FRAMING;
-                }
-                pkt->trailer.end = databyte;
-                pkt_received     = 1;
-                break;
+        if (proto->rx_pkt != NULL) {
+            proto_frame(proto, PKT_ERROR_FAILURE, 1);
         }
+        return (proto->op.type == PROTO_OP_DONE);
+    }
+
+    return proto_rx(proto, databyte);
+}
+
+/* Start receiving a new frame into pkt. */
+void proto_rx_reset(mm_proto_t* proto, mm_packet_t* pkt) {
+    memset(pkt, 0, sizeof(mm_packet_t));
+    proto->rx.l2_state = L2_STATE_SEARCH_FOR_START;
+    proto->rx.status = PKT_SUCCESS;
+}
+
+/*
+ * Advance the frame receiver by one byte received from the terminal.
+ *
+ * The receiver keeps its state in proto->rx, so it can be fed from any
+ * source, a byte at a time.  Returns PKT_RX_IN_PROGRESS until a complete
+ * frame is in pkt, then its status.  Call proto_rx_reset() before
+ * receiving the next frame.
+ */
+pkt_status_t proto_rx_byte(mm_proto_t* proto, mm_packet_t* pkt, uint8_t databyte) {
+    mm_rx_frame_t* rx = &proto->rx;
+
+    switch (rx->l2_state) {
+        case L2_STATE_SEARCH_FOR_START:
+            if (databyte == START_BYTE) {
+                rx->l2_state     = L2_STATE_GET_FLAGS;
+                pkt->payload_len = 0;
+                pkt->hdr.start   = databyte;
+            }
+            return PKT_RX_IN_PROGRESS;
+        case L2_STATE_GET_FLAGS:
+            rx->l2_state   = L2_STATE_GET_LENGTH;
+            pkt->hdr.flags = databyte;
+            return PKT_RX_IN_PROGRESS;
+        case L2_STATE_GET_LENGTH:
+            pkt->hdr.pktlen = databyte;
+
+            if (pkt->hdr.pktlen > 5) {
+                rx->l2_state = L2_STATE_ACCUMULATE_DATA;
+            } else {
+                rx->l2_state = L2_STATE_GET_CRC0;
+            }
+            return PKT_RX_IN_PROGRESS;
+        case L2_STATE_ACCUMULATE_DATA:
+            pkt->payload[pkt->payload_len] = databyte;
+            pkt->payload_len++;
+
+            if (pkt->payload_len == pkt->hdr.pktlen - 5) {
+                rx->l2_state = L2_STATE_GET_CRC0;
+            }
+            return PKT_RX_IN_PROGRESS;
+        case L2_STATE_GET_CRC0:
+            rx->l2_state     = L2_STATE_GET_CRC1;
+            pkt->trailer.crc = databyte;
+            return PKT_RX_IN_PROGRESS;
+        case L2_STATE_GET_CRC1:
+            rx->l2_state        = L2_STATE_SEARCH_FOR_STOP;
+
+            pkt->trailer.crc   |= (uint16_t)(databyte << 8);
+            pkt->trailer.crc    = LE16(pkt->trailer.crc);
+            pkt->calculated_crc = crc16(0, &pkt->hdr.start, 3);
+            pkt->calculated_crc = crc16(pkt->calculated_crc, pkt->payload, (size_t)pkt->payload_len);
+            pkt->calculated_crc = LE16(pkt->calculated_crc);
+
+            if (pkt->trailer.crc != pkt->calculated_crc) {
+                printf("%s: CRC Error!\n", __func__);
+                proto->link.crc_errors++;
+                MM_TRACE2(crc_error, pkt->trailer.crc, pkt->calculated_crc);
+                rx->status |= PKT_ERROR_CRC;
+            }
+            return PKT_RX_IN_PROGRESS;
+        case L2_STATE_SEARCH_FOR_STOP:
+            if (databyte == STOP_BYTE) {
+                rx->l2_state = L2_STATE_SEARCH_FOR_START;
+            } else {
+                printf("%s: Framing Error!\n", __func__);
+                proto->link.framing_errors++;
+                rx->status |= PKT_ERROR_FRAMING;
+            }
+            pkt->trailer.end = databyte;
+            break;
     }
 
+    /* A complete frame has been received. */
+    proto->link.frames_rx++;
+    proto->link.bytes_rx += (uint32_t)pkt->hdr.pktlen + 1;
+    serial_noise_frame(proto->serial_context);
+
     /* Copy the packet trailer (CRC-16, STOP) immediately following the data */
     memcpy(&(pkt->payload[pkt->payload_len]), &pkt->trailer, sizeof(pkt->trailer));
 
@@ -347,7 +803,7 @@ static pkt_status_t receive_mm_packet(mm_proto_t *proto, mm_packet_t *pkt) {
 
     if (pkt->hdr.flags & FLAG_RETRY) {
         if (proto->debuglevel > 0) print_mm_packet(RX, pkt);
-        status |= PKT_ERROR_RETRY;
+        rx->status |= PKT_ERROR_RETRY;
     }
 
     if (pkt->hdr.flags & FLAG_DISCONNECT) {
@@ -358,7 +814,7 @@ static pkt_status_t receive_mm_packet(mm_proto_t *proto, mm_packet_t *pkt) {
 
         printf("%s: Hanging up modem.\n", __func__);
         proto_disconnect(proto);
-        status |= PKT_ERROR_DISCONNECT;
+        rx->status |= PKT_ERROR_DISCONNECT;
     }
 
     if (proto->debuglevel > 3) {
@@ -367,169 +823,123 @@ static pkt_status_t receive_mm_packet(mm_proto_t *proto, mm_packet_t *pkt) {
         dump_hex(&pkt->hdr.start, (size_t)pkt->hdr.pktlen + 1);
     }
 
-    return status;
+    return rx->status;
 }
 
-/* Send manager packet to the terminal.
- *
- * If payload is NULL, an ACK packet will be sent.
- * If payload is not NULL, and the length is 0, a NULL packet will be sent.
- * If payload is not NULL, and length is > 0, then the terminal's phone number
- * will be prepended to the payload and sent.
- *
- * Returns PKT_SUCCESS on success, otherwise PKT_ERROR_ code flags.
- */
-static pkt_status_t send_mm_packet(mm_proto_t* proto, uint8_t* payload, size_t len, uint8_t flags) {
-    mm_packet_t pkt;
-    pkt_status_t status = PKT_SUCCESS;
-    int retries;
-
-    for (retries = 0; retries < PKT_MAX_RETRIES; retries++) {
-        /* Bail out if not connected. */
-        if (!proto->connected) {
-            return PKT_ERROR_DISCONNECT;
-        }
-
-        if (proto->debuglevel > 3) {
-            if (payload != NULL) {
-                printf("T<--M Sending packet: Terminal: %s, tx_seq=%d\n", proto->terminal_id, proto->tx_seq);
-            }
-            else {
-                printf("T<--M Sending %s: rx_seq=%d\n", (flags & FLAG_ACK) ? "ACK" : "NACK", proto->rx_seq);
-            }
-        }
+/* Minimum time between frames when using a modem, which needs the inter-packet gap. */
+static uint32_t proto_gap_ms(mm_proto_t* proto) {
+    if (!proto->use_modem) return 0;
 
-        /* Insert Tx packet delay when using a modem, in 10ms increments. */
-        if (proto->use_modem) {
-#ifdef _WIN32
-            Sleep(proto->rx_packet_gap * 10);
-#else  /* ifdef _WIN32 */
-            struct timespec tim;
-            tim.tv_sec = 0;
-            tim.tv_nsec = proto->rx_packet_gap * 10000000L;
-            nanosleep(&tim, NULL);
-#endif /* _WIN32 */
-        }
-
-        memset(&pkt, 0, sizeof(pkt));
-        pkt.hdr.start = START_BYTE;
+    return ((uint32_t)proto->rx_packet_gap + proto->link_gap) * 10;
+}
 
-        if (payload != NULL) {
-            /* Flags for regular TX packet use tx_seq. */
-            pkt.hdr.flags = (proto->tx_seq & FLAG_SEQUENCE);
-            pkt.payload_len = (uint8_t)len + PKT_TABLE_ID_OFFSET; /* add room for the phone number. */
+/*
+ * Build a frame for the terminal.  If payload is not NULL, the terminal's
+ * phone number is prepended to it, otherwise the frame is an ACK or NACK
+ * carrying only the flags.
+ */
+static void proto_tx_build(mm_proto_t* proto, mm_packet_t* pkt, const uint8_t* payload, size_t len, uint8_t flags) {
+    memset(pkt, 0, sizeof(mm_packet_t));
+    pkt->hdr.start = START_BYTE;
+    pkt->hdr.flags = flags;
 
-            for (int i = 0; i < PKT_TABLE_ID_OFFSET; i++) {
-                pkt.payload[i] = (proto->terminal_id[i * 2] - '0') << 4;
-                pkt.payload[i] |= (proto->terminal_id[i * 2 + 1] - '0');
-            }
+    if (payload != NULL) {
+        pkt->payload_len = (uint8_t)len + PKT_TABLE_ID_OFFSET; /* add room for the phone number. */
 
-            if (len > 0) {
-                memcpy(&pkt.payload[PKT_TABLE_ID_OFFSET], payload, len);
-            }
-        } else {
-            pkt.payload_len = 0;
+        memcpy(pkt->payload, proto->terminal_id_bcd, PKT_TABLE_ID_OFFSET);
 
-            /* If payload is NULL, send an ACK packet instead, using rx_seq. */
-            pkt.hdr.flags = flags | (proto->rx_seq & FLAG_SEQUENCE);
+        if (len > 0) {
+            memcpy(&pkt->payload[PKT_TABLE_ID_OFFSET], payload, len);
         }
+    }
 
-        if (flags & FLAG_RETRY) {
-            pkt.hdr.flags |= FLAG_RETRY;
+    pkt->hdr.pktlen = pkt->payload_len + 5;
+    pkt->trailer.crc = crc16(0, &pkt->hdr.start, 3);
+    pkt->trailer.crc = crc16(pkt->trailer.crc, pkt->payload, (size_t)(pkt->payload_len));
+    pkt->trailer.crc = LE16(pkt->trailer.crc);
+    if (inject_comm_error == 1) {
+        if (((proto->error_inject_type == ERROR_INJECT_CRC_DLOG_TX) && (pkt->payload_len != 0)) ||
+            ((proto->error_inject_type == ERROR_INJECT_CRC_ACK_TX) && (pkt->payload_len == 0))) {
+            printf("Injecting %s (Correct CRC=0x%02x).\n",
+                error_inject_type_to_str(proto->error_inject_type),
+                pkt->trailer.crc);
+            inject_comm_error = 0;
+            pkt->trailer.crc = ~pkt->trailer.crc;
         }
+    }
+    pkt->trailer.end = STOP_BYTE;
+    pkt->calculated_crc = pkt->trailer.crc;
 
-        pkt.hdr.pktlen = pkt.payload_len + 5;
-        pkt.trailer.crc = crc16(0, &pkt.hdr.start, 3);
-        pkt.trailer.crc = crc16(pkt.trailer.crc, pkt.payload, (size_t)(pkt.payload_len));
-        pkt.trailer.crc = LE16(pkt.trailer.crc);
-        if (inject_comm_error == 1) {
-            if (((proto->error_inject_type == ERROR_INJECT_CRC_DLOG_TX) && (pkt.payload_len != 0)) ||
-                ((proto->error_inject_type == ERROR_INJECT_CRC_ACK_TX) && (pkt.payload_len == 0))) {
-                printf("Injecting %s (Correct CRC=0x%02x).\n",
-                    error_inject_type_to_str(proto->error_inject_type),
-                    pkt.trailer.crc);
-                inject_comm_error = 0;
-                pkt.trailer.crc = ~pkt.trailer.crc;
-            }
-        }
-        pkt.trailer.end = STOP_BYTE;
-        pkt.calculated_crc = pkt.trailer.crc;
+    /* Copy the CRC and STOP_BYTE to be adjacent to the filled portion of the payload */
+    memcpy(&(pkt->payload[pkt->payload_len]), &pkt->trailer.crc, 3);
+}
 
-        /* Copy the CRC and STOP_BYTE to be adjacent to the filled portion of the payload */
-        memcpy(&(pkt.payload[pkt.payload_len]), &pkt.trailer.crc, 3);
+/* Write the queued frames whose inter-packet gap has passed. */
+static void proto_tx_flush(mm_proto_t* proto) {
+    while (proto->tx_count > 0) {
+        mm_packet_t* pkt = &proto->tx_queue[proto->tx_head];
+        uint32_t now = proto_clock_ms();
 
-        mm_add_pcap_rec(proto->pcapstream, TX, &pkt, 0, 0);
+        if ((int32_t)(proto->tx_ready_ms - now) > 0) break;
+
+        mm_add_pcap_rec(proto->pcapstream, TX, pkt, 0, 0);
         if (proto->send_udp) {
-            mm_udp_send_pkt(TX, &pkt);
+            mm_udp_send_pkt(TX, pkt);
         }
 
         if (proto->debuglevel > 0) {
-            print_mm_packet(TX, &pkt);
+            print_mm_packet(TX, pkt);
         }
 
         if (proto->debuglevel > 3) {
             printf("\nRaw Packet transmitted: ");
-            dump_hex(&pkt.hdr.start, (size_t)pkt.hdr.pktlen + 1);
+            dump_hex(&pkt->hdr.start, (size_t)pkt->hdr.pktlen + 1);
         }
 
-        write_serial(proto->serial_context, &pkt, (size_t)pkt.hdr.pktlen + 1);
+        write_serial(proto->serial_context, pkt, (size_t)pkt->hdr.pktlen + 1);
         drain_serial(proto->serial_context);
+        proto->link.bytes_tx += (uint32_t)pkt->hdr.pktlen + 1;
 
-        /* Don't wait for ACK if sending an ACK. */
-        if (payload == NULL) {
-            break;
-        }
-
-        status = wait_for_mm_ack(proto);
-        if (status == PKT_SUCCESS) {
-            break;
+        now = proto_clock_ms();
+        if (pkt->payload_len != 0) {
+            proto->op.sent_ms = now;
         }
+        proto->rx_deadline_ms = now + PKT_TIMEOUT_MS;
+        proto->tx_ready_ms = now + proto_gap_ms(proto);
 
-        printf("%s: Received NACK, retrying %d.\n", __func__, retries);
+        proto->tx_head = (proto->tx_head + 1) % PROTO_TX_QUEUE;
+        proto->tx_count--;
     }
+}
 
-    if (retries == PKT_MAX_RETRIES) {
-        printf("%s: Error: Gave up after %d retries.\n", __func__, retries);
-        status |= PKT_ERROR_FAILURE;
+/* Queue a frame for the terminal, written as soon as the inter-packet gap allows. */
+static void proto_tx_frame(mm_proto_t* proto, const mm_packet_t* pkt) {
+    if (proto->tx_count == PROTO_TX_QUEUE) {
+        fprintf(stderr, "%s: Error: Transmit queue full, frame dropped.\n", __func__);
+        return;
     }
 
-    if (payload != NULL) {
-        proto->tx_seq++;
-    } else {
-        proto->rx_seq++;
-    }
-    return status;
-}
+    memcpy(&proto->tx_queue[(proto->tx_head + proto->tx_count) % PROTO_TX_QUEUE], pkt, sizeof(mm_packet_t));
+    proto->tx_count++;
 
-static pkt_status_t send_mm_ack(mm_proto_t *proto, uint8_t flags) {
-    return send_mm_packet(proto, NULL, 0, flags);
+    proto_tx_flush(proto);
 }
 
-static pkt_status_t wait_for_mm_ack(mm_proto_t *proto) {
+/* Send an ACK, NACK or retry request for the last frame received. */
+static void proto_send_ack(mm_proto_t* proto, uint8_t flags) {
     mm_packet_t pkt;
-    pkt_status_t status = PKT_SUCCESS;
 
-    if (!proto->connected) {
-        return PKT_ERROR_DISCONNECT;
-    }
+    if (!proto->connected) return;
 
-    proto->waiting_for_ack = 1;
-    status = receive_mm_packet(proto, &pkt);
-    proto->waiting_for_ack = 0;
-    if ((status == PKT_SUCCESS) || (status == PKT_ERROR_DISCONNECT)) {
-        if (proto->debuglevel > 2) print_mm_packet(RX, &pkt);
+    proto->link.frames_tx++;
 
-        if (pkt.payload_len == 0) {
-            if (pkt.hdr.flags & FLAG_ACK) {
-                return PKT_SUCCESS;
-            } else {
-                /* ACK flag is not set: NACK. */
-                return PKT_ERROR_NACK;
-            }
-        }
-        return PKT_SUCCESS;
+    if (proto->debuglevel > 3) {
+        printf("T<--M Sending %s: rx_seq=%d\n", (flags & FLAG_ACK) ? "ACK" : "NACK", proto->rx_seq);
     }
-    fprintf(stderr, "%s: Error, did not receive an ACK packet, status=0x%02x\n", __func__, status);
-    return status;
-}
 
+    proto_tx_build(proto, &pkt, NULL, 0, flags | (proto->rx_seq & FLAG_SEQUENCE));
+    proto_tx_frame(proto, &pkt);
+    MM_TRACE3(frame_tx, pkt.hdr.flags, pkt.payload_len, 0);
+
+    proto->rx_seq++;
+}
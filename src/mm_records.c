@@ -0,0 +1,81 @@
+/*
+ * Decoders and encoders for the records exchanged with the terminal.
+ *
+ * Records are laid out on the wire as the packed structures in
+ * mm_manager.h, with fields wider than a byte in little-endian order.
+ * The functions here are generated from the MM_RECORDS list: decoding
+ * copies a record out of the receive buffer into the same packed
+ * structure, leaving the buffer as it was received, and converts the
+ * fields listed for it to host byte order; encoding does the reverse.
+ * The fields keep their wire offsets, so they are not naturally
+ * aligned.  On a little-endian host the conversions compile away,
+ * leaving a length check and a copy.
+ *
+ * www.github.com/hharte/mm_manager
+ *
+ * Copyright (c) 2022-2023, Howard M. Harte
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "mm_manager.h"
+
+/* Convert one field of rec between wire and host byte order. */
+#define RECORD_SWAP_U16(field)  rec->field = LE16(rec->field);
+#define RECORD_SWAP_U32(field)  rec->field = LE32(rec->field);
+#define RECORD_SWAP_U64(field)  rec->field = LE64(rec->field);
+#define RECORD_SWAP_U16S(field) \
+    for (size_t i = 0; i < sizeof(rec->field) / sizeof(rec->field[0]); i++) rec->field[i] = LE16(rec->field[i]);
+#define RECORD_SWAP_U32S(field) \
+    for (size_t i = 0; i < sizeof(rec->field) / sizeof(rec->field[0]); i++) rec->field[i] = LE32(rec->field[i]);
+#define RECORD_SWAP(kind, field) RECORD_SWAP_##kind(field)
+
+#define RECORD_FUNCTIONS(name, type, fields) \
+    static void record_swap_##name(type *rec) { \
+        (void)rec; \
+        fields(RECORD_SWAP) \
+    } \
+    \
+    int mm_decode_##name(const uint8_t *buf, size_t len, type *rec) { \
+        if (len < sizeof(type)) { \
+            fprintf(stderr, "%s: Record truncated, %zu of %zu bytes.\n", __func__, len, sizeof(type)); \
+            return -EINVAL; \
+        } \
+        memcpy(rec, buf, sizeof(type)); \
+        record_swap_##name(rec); \
+        return (int)sizeof(type); \
+    } \
+    \
+    int mm_encode_##name(const type *rec, uint8_t *buf, size_t len) { \
+        type wire; \
+        \
+        if (len < sizeof(type)) { \
+            fprintf(stderr, "%s: Buffer too small, %zu of %zu bytes.\n", __func__, len, sizeof(type)); \
+            return -EINVAL; \
+        } \
+        memcpy(&wire, rec, sizeof(type)); \
+        record_swap_##name(&wire); \
+        memcpy(buf, &wire, sizeof(type)); \
+        return (int)sizeof(type); \
+    }
+
+MM_RECORDS(RECORD_FUNCTIONS)
+
+/* Print the records received during a call, by type. */
+void mm_records_print_call(const mm_record_counters_t* counters) {
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        if (counters->records[i] == 0) continue;
+
+        printf("Call: %u %s records received, %u bytes.\n",
+            counters->records[i], table_to_string((uint8_t)i), counters->bytes[i]);
+    }
+
+    if ((counters->truncated > 0) || (counters->unknown > 0)) {
+        printf("Call: %u truncated records, %u unhandled tables.\n", counters->truncated, counters->unknown);
+    }
+}
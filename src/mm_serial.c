@@ -14,6 +14,163 @@
 
 #include "mm_serial.h"
 
+#define SERIAL_NOISE_PPM    (1000000)
+
+/*
+ * Simulated line noise.
+ *
+ * Bit errors start at random with probability ber_ppm per bit, and
+ * each error event inverts burst_len consecutive bits.  Received bytes
+ * are dropped with probability drop_ppm, and carrier is dropped after
+ * carrier_loss_frame frames are received.  The pseudo-random sequence
+ * depends only on the seed, so runs can be repeated.
+ */
+static uint32_t serial_noise_random(mm_serial_noise_t *noise) {
+    /* xorshift32 */
+    noise->rng ^= noise->rng << 13;
+    noise->rng ^= noise->rng >> 17;
+    noise->rng ^= noise->rng << 5;
+
+    return noise->rng;
+}
+
+static uint8_t serial_noise_byte(mm_serial_noise_t *noise, uint8_t byte) {
+    for (int bit = 0; bit < 8; bit++) {
+        if ((noise->burst_remaining == 0) && (noise->ber_ppm > 0) &&
+            ((serial_noise_random(noise) % SERIAL_NOISE_PPM) < noise->ber_ppm)) {
+            noise->burst_remaining = noise->burst_len;
+        }
+
+        if (noise->burst_remaining > 0) {
+            byte ^= (uint8_t)(1 << bit);
+            noise->burst_remaining--;
+            noise->bits_flipped++;
+        }
+    }
+
+    noise->bytes++;
+
+    return byte;
+}
+
+/* Apply noise to received data, returning the number of bytes that survive. */
+static ssize_t serial_noise_rx(mm_serial_noise_t *noise, uint8_t *buf, ssize_t count) {
+    ssize_t kept = 0;
+
+    if (noise->carrier_lost) return 0;
+
+    for (ssize_t i = 0; i < count; i++) {
+        if ((noise->drop_ppm > 0) && ((serial_noise_random(noise) % SERIAL_NOISE_PPM) < noise->drop_ppm)) {
+            noise->bytes_dropped++;
+            continue;
+        }
+
+        buf[kept++] = serial_noise_byte(noise, buf[i]);
+    }
+
+    return kept;
+}
+
+/*
+ * Parse a noise specification of comma-separated key=value pairs:
+ * ber=<ppm>,burst=<bits>,drop=<ppm>,carrier=<frame>,seed=<n>
+ */
+int serial_noise_parse(mm_serial_context_t *pserial_context, const char *spec) {
+    mm_serial_noise_t *noise = &pserial_context->noise;
+    char  specbuf[128];
+    char *tok;
+
+    memset(noise, 0, sizeof(mm_serial_noise_t));
+    noise->burst_len = 1;
+    noise->seed = 1;
+
+    snprintf(specbuf, sizeof(specbuf), "%s", spec);
+
+    for (tok = strtok(specbuf, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        unsigned long value;
+        char *eq = strchr(tok, '=');
+
+        if (eq == NULL) {
+            fprintf(stderr, "%s: Expected key=value, got '%s'.\n", __func__, tok);
+            return -EINVAL;
+        }
+
+        *eq = '\0';
+        value = strtoul(eq + 1, NULL, 0);
+
+        if (strcmp(tok, "ber") == 0) {
+            noise->ber_ppm = (uint32_t)value;
+        } else if (strcmp(tok, "burst") == 0) {
+            noise->burst_len = (uint32_t)value;
+        } else if (strcmp(tok, "drop") == 0) {
+            noise->drop_ppm = (uint32_t)value;
+        } else if (strcmp(tok, "carrier") == 0) {
+            noise->carrier_loss_frame = (uint32_t)value;
+        } else if (strcmp(tok, "seed") == 0) {
+            noise->seed = (uint32_t)value;
+        } else {
+            fprintf(stderr, "%s: Unknown noise parameter '%s'.\n", __func__, tok);
+            return -EINVAL;
+        }
+    }
+
+    if ((noise->ber_ppm > SERIAL_NOISE_PPM) || (noise->drop_ppm > SERIAL_NOISE_PPM) || (noise->burst_len == 0)) {
+        fprintf(stderr, "%s: ber and drop must be at most %d, burst at least 1.\n", __func__, SERIAL_NOISE_PPM);
+        return -EINVAL;
+    }
+
+    /* xorshift32 must not be seeded with zero. */
+    noise->rng = (noise->seed != 0) ? noise->seed : 1;
+
+    printf("Line noise: BER %u ppm, burst %u bits, drop %u ppm, carrier loss at frame %u, seed %u.\n",
+        noise->ber_ppm, noise->burst_len, noise->drop_ppm, noise->carrier_loss_frame, noise->seed);
+
+    return 0;
+}
+
+/* Start applying noise at the beginning of a call. */
+void serial_noise_start(mm_serial_context_t *pserial_context) {
+    mm_serial_noise_t *noise = &pserial_context->noise;
+
+    if ((noise->ber_ppm == 0) && (noise->drop_ppm == 0) && (noise->carrier_loss_frame == 0)) return;
+
+    noise->active = 1;
+    noise->carrier_lost = 0;
+    noise->burst_remaining = 0;
+    noise->frames = 0;
+    noise->bytes = 0;
+    noise->bits_flipped = 0;
+    noise->bytes_dropped = 0;
+}
+
+/* Stop applying noise at the end of a call, and report what was injected. */
+void serial_noise_stop(mm_serial_context_t *pserial_context) {
+    mm_serial_noise_t *noise = &pserial_context->noise;
+
+    if (!noise->active) return;
+
+    printf("Line noise: %u bits flipped, %u bytes dropped in %u bytes, %u frames received%s.\n",
+        noise->bits_flipped, noise->bytes_dropped, noise->bytes, noise->frames,
+        noise->carrier_lost ? ", carrier dropped" : "");
+
+    noise->active = 0;
+    noise->carrier_lost = 0;
+}
+
+/* Count a received frame, dropping carrier when carrier_loss_frame is reached. */
+void serial_noise_frame(mm_serial_context_t *pserial_context) {
+    mm_serial_noise_t *noise = &pserial_context->noise;
+
+    if (!noise->active) return;
+
+    noise->frames++;
+
+    if ((noise->carrier_loss_frame != 0) && (noise->frames == noise->carrier_loss_frame)) {
+        printf("Line noise: Dropping carrier after %u frames.\n", noise->frames);
+        noise->carrier_lost = 1;
+    }
+}
+
 /*
  * Open serial port specified in modem_dev.
  *
@@ -102,6 +259,11 @@ ssize_t read_serial(mm_serial_context_t *pserial_context, void *buf, size_t coun
         bytes_read = count;
     }
 
+    if (pserial_context->noise.active && (bytes_read > 0)) {
+        bytes_read = serial_noise_rx(&pserial_context->noise, (uint8_t *)buf, bytes_read);
+        count = (size_t)bytes_read;
+    }
+
     if (pserial_context->logstream != NULL) {
         for (size_t i = 0; i < count; i++) {
             fprintf(pserial_context->logstream, "UART: RX: %02X\n", ((uint8_t*)buf)[i]);
@@ -112,6 +274,19 @@ ssize_t read_serial(mm_serial_context_t *pserial_context, void *buf, size_t coun
 
 ssize_t write_serial(mm_serial_context_t *pserial_context, const void *buf, size_t count) {
     ssize_t bytes_written = count;
+    uint8_t *noisy_buf = NULL;
+
+    /* Corrupt a copy of the transmitted data; carrier loss stops transmission. */
+    if (pserial_context->noise.active) {
+        if (pserial_context->noise.carrier_lost) return count;
+
+        if ((noisy_buf = (uint8_t *)malloc(count)) != NULL) {
+            for (size_t i = 0; i < count; i++) {
+                noisy_buf[i] = serial_noise_byte(&pserial_context->noise, ((const uint8_t *)buf)[i]);
+            }
+            buf = noisy_buf;
+        }
+    }
 
     if (pserial_context->logstream != NULL) {
         for (size_t i = 0; i < count; i++) {
@@ -124,6 +299,8 @@ ssize_t write_serial(mm_serial_context_t *pserial_context, const void *buf, size
         bytes_written = platform_write_serial(pserial_context->fd, buf, count);
     }
 
+    free(noisy_buf);
+
     return bytes_written;
 }
 
@@ -153,6 +330,10 @@ int serial_set_dtr(mm_serial_context_t *pserial_context, int set) {
 
 int serial_get_modem_status(mm_serial_context_t* pserial_context) {
     int status = -1;
+
+    if (pserial_context->noise.carrier_lost) {
+        return 0;
+    }
     if (pserial_context->bytestream == NULL) {
         status = platform_serial_get_modem_status(pserial_context->fd);
     }
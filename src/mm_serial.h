@@ -9,6 +9,9 @@
 #ifndef MM_SERIAL_H_
 #define MM_SERIAL_H_
 
+#include <stdint.h>
+#include <stdio.h>
+
 #if defined(_MSC_VER)
 # include <BaseTsd.h>
 typedef SSIZE_T ssize_t;
@@ -18,10 +21,33 @@ typedef SSIZE_T ssize_t;
 #define MS_RLSD_ON      0x0080
 #endif /* if defined(_MSC_VER) */
 
+/*
+ * Simulated line noise, applied to the data while a call is in progress.
+ * Configured with serial_noise_parse(), see mm_serial.c.
+ */
+typedef struct mm_serial_noise {
+    uint32_t ber_ppm;               /* Bit error events per million bits */
+    uint32_t burst_len;             /* Consecutive bits corrupted by each error event */
+    uint32_t drop_ppm;              /* Received bytes dropped per million */
+    uint32_t carrier_loss_frame;    /* Drop carrier after this many frames received, 0 for never */
+    uint32_t seed;
+    /* State */
+    uint8_t  active;
+    uint8_t  carrier_lost;
+    uint32_t rng;
+    uint32_t burst_remaining;
+    uint32_t frames;
+    /* Statistics */
+    uint32_t bytes;
+    uint32_t bits_flipped;
+    uint32_t bytes_dropped;
+} mm_serial_noise_t;
+
 typedef struct mm_serial_context {
     int fd;
     FILE *logstream;
     FILE *bytestream;
+    mm_serial_noise_t noise;
 } mm_serial_context_t;
 
 mm_serial_context_t* open_serial(const char *modem_dev, FILE *logstream, FILE *bytestream);
@@ -33,6 +59,10 @@ int        drain_serial(mm_serial_context_t *pserial_context);
 int        flush_serial(mm_serial_context_t *pserial_context);
 int        serial_set_dtr(mm_serial_context_t* pserial_context, int set);
 int        serial_get_modem_status(mm_serial_context_t* pserial_context);
+int        serial_noise_parse(mm_serial_context_t* pserial_context, const char* spec);
+void       serial_noise_start(mm_serial_context_t* pserial_context);
+void       serial_noise_stop(mm_serial_context_t* pserial_context);
+void       serial_noise_frame(mm_serial_context_t* pserial_context);
 
 extern int platform_open_serial(const char *modem_dev);
 extern int platform_init_serial(int fd, int baudrate);
@@ -1,5 +1,5 @@
 /*
- * SQLite3 Interface for mm_manager.
+ * SQLite3 storage backend for mm_manager, see mm_db.c.
  *
  * www.github.com/hharte/mm_manager
  *
@@ -12,221 +12,392 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <errno.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+# include <windows.h>
+#endif /* _WIN32 */
 
 #include "mm_manager.h"
 
-#define AUTO_INCREMENT "AUTOINCREMENT"
-
-int mm_sql_exec(void *db, const char *sql) {
-    int rc;
+/*
+ * Total time to wait for another connection's lock.  A record is only
+ * ACKed once it is stored, so this must stay well under the time the
+ * terminal waits for an ACK.
+ */
+#define SQL_BUSY_WAIT_MAX_MS    (250)
+#define SQL_BUSY_BACKOFF_MS     (2)     /* First retry delay, doubled on each retry */
 
-//    printf("SQL:\n%s\n", sql);
-    rc = sqlite3_exec((sqlite3 *)db, sql, NULL, 0, NULL);
+static int mm_sqlite_exec(void *conn, const char *sql) {
+    int rc = sqlite3_exec((sqlite3 *)conn, sql, NULL, 0, NULL);
 
     if (rc != SQLITE_OK && rc != SQLITE_CONSTRAINT) {
-        fprintf(stderr, "%s: Failed to execute: \nSQL: '%s'\nError: %s", __func__, sql, sqlite3_errmsg((sqlite3 *)db));
+        fprintf(stderr, "%s: Failed to execute: \nSQL: '%s'\nError: %s", __func__, sql, sqlite3_errmsg((sqlite3 *)conn));
         return -1;
     }
 
     return 0;
 }
 
-uint8_t mm_sql_read_uint8(void* db, const char* sql) {
-    sqlite3_stmt* res = NULL;
-    uint8_t val = 0;
-    int rc = sqlite3_prepare_v2((sqlite3*)db, sql, -1, &res, 0);
+/* Back off exponentially while the database is locked by another connection. */
+static int mm_sql_busy_handler(void *arg, int count) {
+    int waited = SQL_BUSY_BACKOFF_MS * ((1 << count) - 1);
+    int delay = SQL_BUSY_BACKOFF_MS << count;
 
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "%s: Failed to prepare: \nSQL: '%s'\nError: %s", __func__, sql, sqlite3_errmsg((sqlite3*)(db)));
-        return 0xFF;
-    }
+    (void)arg;
 
-    sqlite3_step(res);
+    if (waited >= SQL_BUSY_WAIT_MAX_MS) {
+        fprintf(stderr, "%s: Database busy, giving up after %d retries.\n", __func__, count);
+        return 0;
+    }
 
-    val = (uint8_t)sqlite3_column_int(res, 0);
+    if (delay > SQL_BUSY_WAIT_MAX_MS - waited) {
+        delay = SQL_BUSY_WAIT_MAX_MS - waited;
+    }
 
-    sqlite3_finalize(res);
+    sqlite3_sleep(delay);
 
-    return (val);
+    return 1;
 }
 
-uint64_t mm_sql_read_uint64(void* db, const char* sql) {
-    sqlite3_stmt* res = NULL;
-    uint64_t val = 0L;
-    int rc = sqlite3_prepare_v2((sqlite3*)db, sql, -1, &res, 0);
+/*
+ * Open a connection for use by a single thread, so SQLite's
+ * per-connection mutex is not needed.
+ */
+static sqlite3 *mm_sqlite_connect(const char *database_filename, int flags) {
+    sqlite3 *db = NULL;
+
+    int rc = sqlite3_open_v2(database_filename, &db, flags | SQLITE_OPEN_NOMUTEX, NULL);
 
     if (rc != SQLITE_OK) {
-        fprintf(stderr, "%s: Failed to prepare: \nSQL: '%s'\nError: %s", __func__, sql, sqlite3_errmsg((sqlite3 *)(db)));
-        sqlite3_finalize(res);
-        return 0xFFFFFFFFFFFFFFFFLL;
+        fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return NULL;
     }
 
-    sqlite3_step(res);
+    sqlite3_busy_handler(db, mm_sql_busy_handler, NULL);
 
-    val = (uint64_t)sqlite3_column_int64(res, 0);
+    return db;
+}
 
-    sqlite3_finalize(res);
+/*
+ * Open a connection.  The writer switches the database to write-ahead
+ * logging, so read-only connections are not blocked by writes.  Each
+ * commit is synced, as records are ACKed to the terminal once stored.
+ */
+static void *mm_sqlite_open(const char *database_filename, int read_only) {
+    sqlite3 *db;
 
-    return (val);
-}
+    if (read_only) {
+        return (void *)mm_sqlite_connect(database_filename, SQLITE_OPEN_READONLY);
+    }
 
-int mm_sql_write_blob(void* db, const char* sql, uint8_t *buffer, size_t buflen) {
-    sqlite3_stmt* res = NULL;
-    int rc;
+    db = mm_sqlite_connect(database_filename, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
 
-    printf("SQL:\n%s\n", sql);
-    rc = sqlite3_prepare_v2((sqlite3 *)db, sql, -1, &res, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "prepare failed: %s\n", sqlite3_errmsg((sqlite3 *)db));
+    if (db == NULL) {
+        return NULL;
     }
-    else {
-        rc = sqlite3_bind_blob(res, 1, buffer, (int)buflen, SQLITE_STATIC);
-        if (rc != SQLITE_OK) {
-            fprintf(stderr, "bind failed: %s\n", sqlite3_errmsg((sqlite3*)db));
-        }
-        else {
-            rc = sqlite3_step(res);
-            if (rc != SQLITE_DONE) {
-                fprintf(stderr, "execution failed: %s\n", sqlite3_errmsg((sqlite3*)db));
-            }
-        }
+
+    if ((mm_sqlite_exec(db, "PRAGMA journal_mode=WAL;") != 0) ||
+        (mm_sqlite_exec(db, "PRAGMA synchronous=FULL;") != 0)) {
+        sqlite3_close(db);
+        return NULL;
     }
 
-    sqlite3_finalize(res);
+    return (void *)db;
+}
+
+static int mm_sqlite_close(void *conn) {
+    return sqlite3_close((sqlite3 *)conn);
+}
 
-    return (rc == SQLITE_DONE) ? 0 : rc;
+/* Each statement is written immediately; WAL mode makes this cheap. */
+static int mm_sqlite_flush(void *conn) {
+    (void)conn;
+    return 0;
 }
 
-int mm_sql_read_blob(void* db, const char* sql, uint8_t* buffer, size_t buflen) {
-    sqlite3_stmt* res = NULL;
-    int rc;
-    printf("SQL:\n%s\n", sql);
-    rc = sqlite3_prepare_v2((sqlite3*)db, sql, -1, &res, NULL);
+static int64_t mm_sqlite_last_insert_id(void *conn) {
+    return (int64_t)sqlite3_last_insert_rowid((sqlite3 *)conn);
+}
 
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "%s: Failed to prepare: \nSQL: '%s'\nError: %s", __func__, sql, sqlite3_errmsg((sqlite3*)(db)));
-        return rc;
-    }
+static int64_t mm_sqlite_total_changes(void *conn) {
+    return (int64_t)sqlite3_total_changes64((sqlite3 *)conn);
+}
+
+static const char *mm_sqlite_errmsg(void *conn) {
+    return sqlite3_errmsg((sqlite3 *)conn);
+}
 
-    sqlite3_step(res);
+static void *mm_sqlite_prepare(void *conn, const char *sql) {
+    sqlite3_stmt *res = NULL;
 
-    size_t blob_len = sqlite3_column_bytes(res, 0);
-    if (blob_len > buflen) {
-        fprintf(stderr, "%s: buffer length %zu is not large enough for table of %zu bytes.\n", __func__, buflen, blob_len);
+    if (sqlite3_prepare_v2((sqlite3 *)conn, sql, -1, &res, NULL) != SQLITE_OK) {
         sqlite3_finalize(res);
-        return -EINVAL;
+        return NULL;
     }
 
-    memcpy(buffer, sqlite3_column_blob(res, 0), blob_len);
+    return (void *)res;
+}
 
-    sqlite3_finalize(res);
+static int mm_sqlite_bind_blob(void *stmt, int index, const uint8_t *data, size_t len) {
+    return (sqlite3_bind_blob((sqlite3_stmt *)stmt, index, data, (int)len, SQLITE_STATIC) == SQLITE_OK) ? 0 : -EIO;
+}
 
-    return (int)blob_len;
+static int mm_sqlite_step(void *stmt) {
+    switch (sqlite3_step((sqlite3_stmt *)stmt)) {
+    case SQLITE_ROW:
+        return 1;
+    case SQLITE_DONE:
+        return 0;
+    default:
+        return -EIO;
+    }
 }
 
-int mm_sql_load_TCASHST(void* db, const char* terminal_id, cashbox_status_univ_t* cashbox_status) {
-    int rc;
-    const unsigned char* db_date_str;
-    const unsigned char* db_time_str;
-    char sql[512] = { 0 };
-    uint16_t cashbox_year = 0;
-    sqlite3_stmt* res;
+static int mm_sqlite_column_count(void *stmt) {
+    return sqlite3_column_count((sqlite3_stmt *)stmt);
+}
 
-    snprintf(sql, sizeof(sql), "SELECT START_DATE, printf(\"%%06d\", START_TIME) AS START_TIME, CASH_BOX_STATUS, PERCENT_FULL, CURRENCY_VALUE,"
-        "NUMBER_OF_CDN_NICKELS, NUMBER_OF_CDN_DIMES, NUMBER_OF_CDN_QUARTERS, NUMBER_OF_CDN_DOLLARS,"
-        "NUMBER_OF_US_NICKELS,  NUMBER_OF_US_DIMES,  NUMBER_OF_US_QUARTERS,  NUMBER_OF_US_DOLLARS "
-        "from TCASHST where (TERMINAL_ID = \"%s\" )",
-        terminal_id);
+static int64_t mm_sqlite_column_int64(void *stmt, int col) {
+    return (int64_t)sqlite3_column_int64((sqlite3_stmt *)stmt, col);
+}
 
-    rc = sqlite3_prepare_v2((sqlite3 *)db, sql, -1, &res, 0);
+static double mm_sqlite_column_double(void *stmt, int col) {
+    return sqlite3_column_double((sqlite3_stmt *)stmt, col);
+}
 
-    if (rc != SQLITE_OK && rc != SQLITE_CONSTRAINT) {
-        fprintf(stderr, "%s: Failed to prepare: \nSQL: '%s'\nError: %s", __func__, sql, sqlite3_errmsg((sqlite3 *)db));
-        sqlite3_finalize(res);
-        return 1;
-    }
+static const char *mm_sqlite_column_text(void *stmt, int col) {
+    return (const char *)sqlite3_column_text((sqlite3_stmt *)stmt, col);
+}
 
-    sqlite3_step(res);
+static const uint8_t *mm_sqlite_column_blob(void *stmt, int col, size_t *len) {
+    const uint8_t *blob = (const uint8_t *)sqlite3_column_blob((sqlite3_stmt *)stmt, col);
 
-    memset(cashbox_status, 0, sizeof(cashbox_status_univ_t));
-    cashbox_status->id = DLOG_MT_CASH_BOX_STATUS;
+    *len = (size_t)sqlite3_column_bytes((sqlite3_stmt *)stmt, col);
 
-    db_date_str = sqlite3_column_text(res, 0);
-    db_time_str = sqlite3_column_text(res, 1);
+    return blob;
+}
 
-    if (db_date_str != NULL && db_time_str != NULL) {
-        if (3 != sscanf((const char*)db_date_str, "%4hu%2hhu%2hhu",
-            &cashbox_year,
-            &cashbox_status->timestamp[1],
-            &cashbox_status->timestamp[2])) {
+static void mm_sqlite_finalize(void *stmt) {
+    sqlite3_finalize((sqlite3_stmt *)stmt);
+}
 
-            fprintf(stderr, "%s: Error parsing date string from database.\n", __func__);
-        }
-        cashbox_status->timestamp[0] = cashbox_year - 1900;
+const mm_db_ops_t mm_sqlite_ops = {
+    "SQLite",
+    mm_sqlite_open,
+    mm_sqlite_close,
+    mm_sqlite_exec,
+    mm_sqlite_exec,
+    mm_sqlite_flush,
+    mm_sqlite_last_insert_id,
+    mm_sqlite_total_changes,
+    mm_sqlite_errmsg,
+    mm_sqlite_prepare,
+    mm_sqlite_bind_blob,
+    mm_sqlite_step,
+    mm_sqlite_column_count,
+    mm_sqlite_column_int64,
+    mm_sqlite_column_double,
+    mm_sqlite_column_text,
+    mm_sqlite_column_blob,
+    mm_sqlite_finalize
+};
 
-        if (3 != sscanf((const char*)db_time_str, "%2hhu%2hhu%2hhu",
-            &cashbox_status->timestamp[3],
-            &cashbox_status->timestamp[4],
-            &cashbox_status->timestamp[5])) {
+/*
+ * The reporting snapshot is a copy of the database for reporting jobs,
+ * so that long queries never contend with the manager.  It is built with
+ * the online backup API into <filename>.tmp, a few pages at a time while
+ * the manager is idle, and renamed over <filename> once complete, so
+ * readers always see a consistent copy.  A write by another process
+ * restarts the copy; after SNAPSHOT_RESTARTS_MAX restarts, the rest is
+ * copied in one step, holding a read transaction until it is done.
+ *
+ * Processes sharing a snapshot take turns through a lock on
+ * <filename>.lock: the one holding it builds the copy, and the others
+ * see the fresh copy when they next check it.
+ */
+int mm_snapshot_init(mm_snapshot_t* snapshot, const char* filename, int freshness_secs) {
+    char lock_filename[sizeof(snapshot->filename) + 5];
+    struct stat st;
 
-            fprintf(stderr, "%s: Error parsing time string from database.\n", __func__);
-        }
+    memset(snapshot, 0, sizeof(mm_snapshot_t));
+    snprintf(snapshot->filename, sizeof(snapshot->filename), "%s", filename);
+    snapshot->freshness_secs = freshness_secs;
+
+    /* An existing snapshot is as fresh as when it was written. */
+    if (stat(filename, &st) == 0) {
+        snapshot->last_complete = st.st_mtime;
+    }
+
+    if (freshness_secs <= 0) return 0;
 
-        cashbox_status->status = sqlite3_column_int(res, 2);
-        cashbox_status->percent_full = sqlite3_column_int(res, 3);
-        cashbox_status->currency_value = (uint16_t)sqlite3_column_double(res, 4) * 100;
-        cashbox_status->coin_count[COIN_COUNT_CA_NICKELS] = sqlite3_column_int(res, 5);
-        cashbox_status->coin_count[COIN_COUNT_CA_DIMES] = sqlite3_column_int(res, 6);
-        cashbox_status->coin_count[COIN_COUNT_CA_QUARTERS] = sqlite3_column_int(res, 7);
-        cashbox_status->coin_count[COIN_COUNT_CA_DOLLARS] = sqlite3_column_int(res, 8);
-        cashbox_status->coin_count[COIN_COUNT_US_NICKELS] = sqlite3_column_int(res, 9);
-        cashbox_status->coin_count[COIN_COUNT_US_DIMES] = sqlite3_column_int(res, 10);
-        cashbox_status->coin_count[COIN_COUNT_US_QUARTERS] = sqlite3_column_int(res, 11);
-        cashbox_status->coin_count[COIN_COUNT_US_DOLLARS] = sqlite3_column_int(res, 12);
-    } else {
-        printf("Cannot retrieve cash box status, assuming empty.\n");
-        cashbox_status->timestamp[0] = 90;
-        cashbox_status->timestamp[1] = 1;
-        cashbox_status->timestamp[2] = 1;
-    }
-
-    sqlite3_finalize(res);
+    snprintf(lock_filename, sizeof(lock_filename), "%s.lock", snapshot->filename);
+    if (mm_lockfile_open(&snapshot->lock, lock_filename) != 0) {
+        fprintf(stderr, "%s: Reporting snapshot disabled.\n", __func__);
+        snapshot->freshness_secs = 0;
+        return -EIO;
+    }
+    snapshot->lock_open = 1;
 
     return 0;
 }
 
-void *mm_open_database(const char *database_filename) {
-    sqlite3 *db = { 0 };
+void mm_snapshot_close(mm_snapshot_t* snapshot) {
+    mm_snapshot_abort(snapshot);
 
-    int rc = sqlite3_open(database_filename, &db);
+    if (snapshot->lock_open) {
+        mm_lockfile_close(&snapshot->lock);
+        snapshot->lock_open = 0;
+    }
+}
 
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
-        sqlite3_close(db);
-        return NULL;
+void mm_snapshot_abort(mm_snapshot_t* snapshot) {
+    char tmp_filename[sizeof(snapshot->filename) + 4];
+
+    if (snapshot->backup != NULL) {
+        sqlite3_backup_finish((sqlite3_backup*)snapshot->backup);
+        snapshot->backup = NULL;
     }
 
-    if (mm_acct_create_tables(db) != 0) {
-        fprintf(stderr, "Failure creating accounting tables: %s\n", sqlite3_errmsg(db));
-        sqlite3_close(db);
-        return NULL;
+    if (snapshot->dest != NULL) {
+        sqlite3_close((sqlite3*)snapshot->dest);
+        snapshot->dest = NULL;
+        snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", snapshot->filename);
+        remove(tmp_filename);
+        mm_lockfile_unlock(&snapshot->lock, 0);
     }
+}
 
-    if (mm_table_create_tables(db) != 0) {
-        fprintf(stderr, "Failure creating data tables: %s\n", sqlite3_errmsg(db));
-        sqlite3_close(db);
-        return NULL;
+static int mm_snapshot_begin(void* db, mm_snapshot_t* snapshot) {
+    char tmp_filename[sizeof(snapshot->filename) + 4];
+    sqlite3* dest = NULL;
+
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", snapshot->filename);
+    remove(tmp_filename);
+
+    if (sqlite3_open_v2(tmp_filename, &dest, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s: Cannot open %s: %s\n", __func__, tmp_filename, sqlite3_errmsg(dest));
+        sqlite3_close(dest);
+        mm_lockfile_unlock(&snapshot->lock, 0);
+        return -EIO;
     }
 
-    if (mm_config_create_tables(db) != 0) {
-        fprintf(stderr, "Failure creating configuration tables: %s\n", sqlite3_errmsg(db));
-        sqlite3_close(db);
-        return NULL;
+    snapshot->dest = dest;
+    snapshot->remaining = -1;
+    snapshot->restarts = 0;
+    snapshot->backup = sqlite3_backup_init(dest, "main", (sqlite3*)((mm_db_t*)db)->conn, "main");
+
+    if (snapshot->backup == NULL) {
+        fprintf(stderr, "%s: Cannot start backup: %s\n", __func__, sqlite3_errmsg(dest));
+        mm_snapshot_abort(snapshot);
+        return -EIO;
     }
 
-    return (void *)db;
+    return 0;
 }
 
-int mm_close_database(void *db) {
-    return ((db != NULL) ? sqlite3_close((sqlite3 *)db) : 0);
+static int mm_snapshot_finish(mm_snapshot_t* snapshot) {
+    char tmp_filename[sizeof(snapshot->filename) + 4];
+    int rc;
+
+    rc = sqlite3_backup_finish((sqlite3_backup*)snapshot->backup);
+    snapshot->backup = NULL;
+
+    /* The pages copied include the WAL journal mode, which readers of a copy do not need. */
+    if ((rc != SQLITE_OK) || (mm_sqlite_exec(snapshot->dest, "PRAGMA journal_mode=DELETE;") != 0)) {
+        fprintf(stderr, "%s: Backup failed: %s\n", __func__, sqlite3_errmsg((sqlite3*)snapshot->dest));
+        mm_snapshot_abort(snapshot);
+        return -EIO;
+    }
+
+    sqlite3_close((sqlite3*)snapshot->dest);
+    snapshot->dest = NULL;
+
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", snapshot->filename);
+#ifdef _WIN32
+    rc = MoveFileExA(tmp_filename, snapshot->filename, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+#else
+    rc = rename(tmp_filename, snapshot->filename);
+#endif /* _WIN32 */
+    mm_lockfile_unlock(&snapshot->lock, 0);
+
+    if (rc != 0) {
+        fprintf(stderr, "%s: Cannot rename %s to %s.\n", __func__, tmp_filename, snapshot->filename);
+        remove(tmp_filename);
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/*
+ * Copy the next SNAPSHOT_STEP_PAGES pages of the database into the
+ * snapshot, starting a new copy if the snapshot is older than its
+ * freshness target.  Returns 1 when a new snapshot has been swapped in,
+ * 0 if the copy is in progress or nothing needs to be done, or a
+ * negative errno on failure.
+ */
+int mm_snapshot_step(void* db, mm_snapshot_t* snapshot, time_t now) {
+    int pages = SNAPSHOT_STEP_PAGES;
+    int remaining;
+    int rc;
+
+    if (snapshot->freshness_secs <= 0) return 0;
+
+    /* The online backup API copies between SQLite databases only. */
+    if (((mm_db_t*)db)->ops != &mm_sqlite_ops) {
+        fprintf(stderr, "%s: Reporting snapshots require an SQLite database.\n", __func__);
+        snapshot->freshness_secs = 0;
+        return -ENOTSUP;
+    }
+
+    if (snapshot->backup == NULL) {
+        struct stat st;
+
+        if ((now - snapshot->last_complete) < snapshot->freshness_secs) return 0;
+
+        /* Another process may have refreshed it. */
+        if ((stat(snapshot->filename, &st) == 0) && (st.st_mtime > snapshot->last_complete)) {
+            snapshot->last_complete = st.st_mtime;
+            if ((now - snapshot->last_complete) < snapshot->freshness_secs) return 0;
+        }
+
+        /* Another process is refreshing it. */
+        if (mm_lockfile_lock(&snapshot->lock, 0, 0) != 0) return 0;
+
+        if ((rc = mm_snapshot_begin(db, snapshot)) != 0) {
+            /* Don't retry until the next refresh is due. */
+            snapshot->last_complete = now;
+            return rc;
+        }
+    }
+
+    if (snapshot->restarts >= SNAPSHOT_RESTARTS_MAX) {
+        pages = -1;
+    }
+
+    rc = sqlite3_backup_step((sqlite3_backup*)snapshot->backup, pages);
+
+    switch (rc) {
+    case SQLITE_OK:
+        /* No progress means the source changed and the copy started over. */
+        remaining = sqlite3_backup_remaining((sqlite3_backup*)snapshot->backup);
+        if ((snapshot->remaining >= 0) && (remaining >= snapshot->remaining)) {
+            snapshot->restarts++;
+        }
+        snapshot->remaining = remaining;
+        return 0;
+    case SQLITE_BUSY:
+    case SQLITE_LOCKED:
+        return 0;   /* More pages to copy, or try again on the next step. */
+    case SQLITE_DONE:
+        snapshot->last_complete = now;
+        if ((rc = mm_snapshot_finish(snapshot)) != 0) return rc;
+        return 1;
+    default:
+        fprintf(stderr, "%s: Backup step failed: %s\n", __func__, sqlite3_errstr(rc));
+        snapshot->last_complete = now;
+        mm_snapshot_abort(snapshot);
+        return -EIO;
+    }
 }
@@ -0,0 +1,361 @@
+/*
+ * Live status board for mm_manager.
+ *
+ * Each mm_manager process publishes the state of its line (idle,
+ * ringing, connected, downloading tables or uploading CDRs), the
+ * terminal it is talking to and the progress of the call to a slot in
+ * a small memory-mapped file, mm_manager_status.bin, shared by all the
+ * processes started in the same directory.  mm_top displays it.
+ *
+ * A slot is updated in place under a sequence lock: the writer makes
+ * the sequence number odd, copies in the new contents, and makes it
+ * even again.  A reader copies the slot out and retries if the sequence
+ * number was odd or changed meanwhile.  Updating the board is a copy
+ * into memory, and readers never hold up the manager.
+ *
+ * Each manager holds a lock on its slot in <board>.lock for as long as
+ * it runs, and claims a slot under a lock on the whole board, so two
+ * processes cannot claim the same slot, and a slot left by one that
+ * exited without closing the board is free again.  A board of another
+ * version is only reinitialized once no process holds a slot on it.
+ *
+ * www.github.com/hharte/mm_manager
+ *
+ * Copyright (c) 2022-2023, Howard M. Harte
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif /* _WIN32 */
+
+#include "mm_manager.h"
+
+#ifdef _WIN32
+# define STATUS_BARRIER()   MemoryBarrier()
+#else
+# define STATUS_BARRIER()   __sync_synchronize()
+#endif /* _WIN32 */
+
+#define STATUS_READ_TRIES   (100)
+
+static mm_status_t* status_map(const char* filename, int writable) {
+    mm_status_t* status;
+    mm_status_board_t* board;
+
+    if ((status = (mm_status_t*)calloc(1, sizeof(mm_status_t))) == NULL) {
+        fprintf(stderr, "%s: Error: failed to allocate %zu bytes.\n", __func__, sizeof(mm_status_t));
+        return NULL;
+    }
+
+#ifdef _WIN32
+    HANDLE file, mapping;
+
+    file = CreateFileA(filename, writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+                       FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, writable ? OPEN_ALWAYS : OPEN_EXISTING,
+                       FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "%s: Cannot open %s.\n", __func__, filename);
+        free(status);
+        return NULL;
+    }
+
+    /* Extends the file to the board length. */
+    mapping = CreateFileMappingA(file, NULL, writable ? PAGE_READWRITE : PAGE_READONLY, 0, (DWORD)sizeof(mm_status_board_t), NULL);
+    if (mapping == NULL) {
+        fprintf(stderr, "%s: Cannot map %s.\n", __func__, filename);
+        CloseHandle(file);
+        free(status);
+        return NULL;
+    }
+
+    board = (mm_status_board_t*)MapViewOfFile(mapping, writable ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ, 0, 0, sizeof(mm_status_board_t));
+    if (board == NULL) {
+        fprintf(stderr, "%s: Cannot map %s.\n", __func__, filename);
+        CloseHandle(mapping);
+        CloseHandle(file);
+        free(status);
+        return NULL;
+    }
+
+    status->file = file;
+    status->mapping = mapping;
+#else
+    struct stat st;
+    int fd;
+
+    if ((fd = open(filename, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644)) < 0) {
+        fprintf(stderr, "%s: Cannot open %s: %s\n", __func__, filename, strerror(errno));
+        free(status);
+        return NULL;
+    }
+
+    if ((fstat(fd, &st) != 0) ||
+        ((st.st_size < (off_t)sizeof(mm_status_board_t)) &&
+         (!writable || (ftruncate(fd, sizeof(mm_status_board_t)) != 0)))) {
+        fprintf(stderr, "%s: %s is not a status board.\n", __func__, filename);
+        close(fd);
+        free(status);
+        return NULL;
+    }
+
+    board = (mm_status_board_t*)mmap(NULL, sizeof(mm_status_board_t), writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                                     MAP_SHARED, fd, 0);
+    if (board == MAP_FAILED) {
+        fprintf(stderr, "%s: Cannot map %s: %s\n", __func__, filename, strerror(errno));
+        close(fd);
+        free(status);
+        return NULL;
+    }
+
+    status->fd = fd;
+#endif /* _WIN32 */
+
+    status->board = board;
+
+    return status;
+}
+
+static void status_unmap(mm_status_t* status) {
+#ifdef _WIN32
+    UnmapViewOfFile(status->board);
+    CloseHandle((HANDLE)status->mapping);
+    CloseHandle((HANDLE)status->file);
+#else
+    munmap(status->board, sizeof(mm_status_board_t));
+    close(status->fd);
+#endif /* _WIN32 */
+
+    free(status);
+}
+
+/* Copy the line's current state into its slot on the board. */
+static void status_publish(mm_status_t* status) {
+    mm_status_line_t* slot = status->slot;
+    uint32_t seq = slot->seq;
+
+    status->line.updated = (int64_t)time(NULL);
+
+    slot->seq = seq + 1;
+    STATUS_BARRIER();
+    memcpy((uint8_t*)slot + sizeof(slot->seq), (const uint8_t*)&status->line + sizeof(slot->seq),
+           sizeof(mm_status_line_t) - sizeof(slot->seq));
+    STATUS_BARRIER();
+    slot->seq = seq + 2;
+}
+
+/* Initialize the board if it is of another version, unless a process still holds a slot on it. */
+static int status_board_init(mm_status_t* status, const char* filename) {
+    mm_status_board_t* board = status->board;
+    int i;
+
+    if ((memcmp(board->magic, STATUS_MAGIC, sizeof(board->magic)) == 0) &&
+        (LE32(board->version) == STATUS_VERSION) && (LE32(board->lines) == STATUS_LINES)) {
+        return 0;
+    }
+
+    for (i = 0; i < STATUS_LINES; i++) {
+        if (mm_lockfile_lock(&status->lock, STATUS_LOCK_SLOT + i, 0) != 0) {
+            fprintf(stderr, "%s: %s is in use by another version of mm_manager.\n", __func__, filename);
+            return -EBUSY;
+        }
+        mm_lockfile_unlock(&status->lock, STATUS_LOCK_SLOT + i);
+    }
+
+    memset(board, 0, sizeof(mm_status_board_t));
+    memcpy(board->magic, STATUS_MAGIC, sizeof(board->magic));
+    board->version = LE32(STATUS_VERSION);
+    board->lines = LE32(STATUS_LINES);
+
+    return 0;
+}
+
+/* Lock a slot no running process holds: the slot last used by line_id, or else the first free.  Returns its index, or -1. */
+static int status_claim(mm_status_t* status, const char* line_id) {
+    mm_status_board_t* board = status->board;
+    int i;
+
+    for (i = 0; i < STATUS_LINES; i++) {
+        if ((strncmp(board->line[i].line_id, line_id, sizeof(board->line[i].line_id)) == 0) &&
+            (mm_lockfile_lock(&status->lock, STATUS_LOCK_SLOT + i, 0) == 0)) {
+            return i;
+        }
+    }
+
+    for (i = 0; i < STATUS_LINES; i++) {
+        if (mm_lockfile_lock(&status->lock, STATUS_LOCK_SLOT + i, 0) == 0) return i;
+    }
+
+    return -1;
+}
+
+/*
+ * Open the status board in filename, creating it if needed, and claim
+ * the slot for line_id: the slot last used by the line, or else the
+ * first slot no running process holds.
+ */
+mm_status_t* mm_status_open(const char* filename, const char* line_id) {
+    char fname[300];
+    mm_status_t* status;
+    int slot = -1;
+    int rc;
+
+    if ((status = status_map(filename, 1)) == NULL) {
+        return NULL;
+    }
+
+    snprintf(fname, sizeof(fname), "%s.lock", filename);
+
+    if (mm_lockfile_open(&status->lock, fname) != 0) {
+        status_unmap(status);
+        return NULL;
+    }
+
+    if ((rc = mm_lockfile_lock(&status->lock, STATUS_LOCK_BOARD, 1)) == 0) {
+        if ((rc = status_board_init(status, filename)) == 0) {
+            slot = status_claim(status, line_id);
+        }
+        mm_lockfile_unlock(&status->lock, STATUS_LOCK_BOARD);
+    }
+
+    if (slot < 0) {
+        if (rc == 0) fprintf(stderr, "%s: No free line on status board %s.\n", __func__, filename);
+        mm_lockfile_close(&status->lock);
+        status_unmap(status);
+        return NULL;
+    }
+
+    status->slot = &status->board->line[slot];
+
+    /* Carry on counting the line's calls, but not another line's left in the slot. */
+    if (strncmp(status->slot->line_id, line_id, sizeof(status->slot->line_id)) == 0) {
+        status->line.calls = status->slot->calls;
+    }
+    snprintf(status->line.line_id, sizeof(status->line.line_id), "%s", line_id);
+#ifdef _WIN32
+    status->line.pid = (uint32_t)GetCurrentProcessId();
+#else
+    status->line.pid = (uint32_t)getpid();
+#endif /* _WIN32 */
+
+    mm_status_state(status, LINE_STATE_IDLE);
+
+    return status;
+}
+
+/* Open the status board in filename to read, see mm_status_read(). */
+mm_status_t* mm_status_attach(const char* filename) {
+    mm_status_t* status;
+
+    if ((status = status_map(filename, 0)) == NULL) {
+        return NULL;
+    }
+
+    if (memcmp(status->board->magic, STATUS_MAGIC, sizeof(status->board->magic)) != 0) {
+        fprintf(stderr, "%s: %s is not a status board.\n", __func__, filename);
+        status_unmap(status);
+        return NULL;
+    }
+
+    return status;
+}
+
+/* Close the board, marking the line stopped if it was opened by mm_status_open(). */
+void mm_status_close(mm_status_t* status) {
+    if (status == NULL) return;
+
+    if (status->slot != NULL) {
+        status->line.pid = 0;
+        mm_status_state(status, LINE_STATE_STOPPED);
+        mm_lockfile_close(&status->lock);
+    }
+
+    status_unmap(status);
+}
+
+/* Copy line number index from the board.  Returns 0, or -EAGAIN if it was being updated throughout. */
+int mm_status_read(const mm_status_t* status, int index, mm_status_line_t* line) {
+    const mm_status_line_t* slot = &status->board->line[index];
+    int tries;
+
+    for (tries = 0; tries < STATUS_READ_TRIES; tries++) {
+        uint32_t seq = slot->seq;
+
+        STATUS_BARRIER();
+        if (seq & 1) continue;
+
+        memcpy(line, (const void*)slot, sizeof(mm_status_line_t));
+        STATUS_BARRIER();
+
+        if (slot->seq == seq) return 0;
+    }
+
+    return -EAGAIN;
+}
+
+/* Set the line state.  Entering LINE_STATE_CONNECTED starts a new call. */
+void mm_status_state(mm_status_t* status, uint8_t state) {
+    if (status == NULL) return;
+
+    if (state != status->line.state) {
+        status->line.state = state;
+        status->line.state_since = (int64_t)time(NULL);
+
+        if (state == LINE_STATE_CONNECTED) {
+            status->line.terminal_id[0] = '\0';
+            status->line.call_start = status->line.state_since;
+            status->line.table_id = 0;
+            status->line.tables_sent = 0;
+            status->line.tables_total = 0;
+            status->line.cdrs = 0;
+            status->line.bytes_tx = 0;
+            status->line.bytes_rx = 0;
+            status->line.retransmits = 0;
+            status->line.calls++;
+        }
+    }
+
+    status_publish(status);
+}
+
+/* Update the terminal and link counters of the call in progress. */
+void mm_status_progress(mm_status_t* status, const char* terminal_id, const mm_link_counters_t* link) {
+    if (status == NULL) return;
+
+    snprintf(status->line.terminal_id, sizeof(status->line.terminal_id), "%s", terminal_id);
+    status->line.bytes_tx = link->bytes_tx;
+    status->line.bytes_rx = link->bytes_rx;
+    status->line.retransmits = link->retransmits;
+
+    status_publish(status);
+}
+
+/* Record that table_id, the sent'th of total, is being downloaded. */
+void mm_status_download(mm_status_t* status, uint8_t table_id, uint16_t sent, uint16_t total) {
+    if (status == NULL) return;
+
+    status->line.table_id = table_id;
+    status->line.tables_sent = sent;
+    status->line.tables_total = total;
+
+    mm_status_state(status, LINE_STATE_DOWNLOADING);
+}
+
+/* Count a CDR received. */
+void mm_status_cdr(mm_status_t* status) {
+    if (status == NULL) return;
+
+    status->line.cdrs++;
+
+    mm_status_state(status, LINE_STATE_UPLOADING);
+}
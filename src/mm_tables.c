@@ -17,14 +17,6 @@
 
 #define TELCO_ID_REGION_CODE "\"%c%c\",\"%c%c%c\""
 
-#ifdef MYSQL_DB
-#define AUTO_INCREMENT  "AUTO_INCREMENT"
-#define SQL_IGNORE      "IGNORE "
-#else
-#define AUTO_INCREMENT "AUTOINCREMENT"
-#define SQL_IGNORE      ""
-#endif /* MYSQL */
-
 
 size_t mm_table_load(mm_context_t *context, uint8_t table_id, uint64_t version_timestamp, uint8_t *buffer, size_t buflen) {
     char sql[512] = { 0 };
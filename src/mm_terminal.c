@@ -0,0 +1,409 @@
+/*
+ * Terminal registry and state cache for mm_manager.
+ *
+ * Keeps the last-known state of each terminal (status word,
+ * cash box status, software version and terminal type) in
+ * memory, so that the accounting functions do not need to
+ * read the database before every write.  Entries are loaded
+ * lazily from the database and updated write-through.
+ *
+ * The database is shared by the mm_manager processes of all lines,
+ * and a terminal may call any of them.  Each save of the TTERMINAL
+ * entry, which happens at least at the end of every call, writes a
+ * new STATE_STAMP, and the entry keeps the stamp it last read or
+ * wrote.  The first lookup in a later call reads only the stamp: if
+ * another process has served the terminal since, the stamp differs
+ * and the entry is reloaded from the database, otherwise it is used
+ * as is, without reading TSTATUS, TCASHST or TTERMINAL again.
+ *
+ * The TTERMINAL registry persists the terminal type, firmware,
+ * last contact time and the hash of each downloaded table, so
+ * the table list for a terminal is known as soon as it calls,
+ * before it reports its software version.
+ *
+ * www.github.com/hharte/mm_manager
+ *
+ * Copyright (c) 2022-2023, Howard M. Harte
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <unistd.h>
+#endif /* _WIN32 */
+
+#include "mm_manager.h"
+
+#define TELCO_ID_REGION_CODE "\"%c%c\",\"%c%c%c\""
+
+/* Hash of the terminal ID, reduced to a bucket index. */
+static uint32_t mm_terminal_hash(const char* terminal_id) {
+    return mm_hash32(MM_HASH32_INIT, (const uint8_t*)terminal_id, strlen(terminal_id)) & (TERMINAL_CACHE_BUCKETS - 1);
+}
+
+/*
+ * A stamp no other process writes: the time, the low bits of the
+ * process ID and a count of saves by this process.
+ */
+static uint64_t mm_terminal_new_stamp(void) {
+    static uint8_t saves;
+#ifdef _WIN32
+    uint64_t pid = (uint64_t)GetCurrentProcessId();
+#else
+    uint64_t pid = (uint64_t)getpid();
+#endif /* _WIN32 */
+
+    saves++;
+
+    return ((uint64_t)time(NULL) << 24) | ((pid & 0xFFFF) << 8) | saves;
+}
+
+/* db is read to check that entries cached in earlier calls are current. */
+mm_terminal_cache_t* mm_terminal_cache_create(void* db) {
+    mm_terminal_cache_t* cache;
+
+    cache = (mm_terminal_cache_t*)calloc(1, sizeof(mm_terminal_cache_t));
+
+    if (cache == NULL) {
+        fprintf(stderr, "%s: Error: failed to allocate %zu bytes.\n", __func__, sizeof(mm_terminal_cache_t));
+        return NULL;
+    }
+
+    cache->db = db;
+
+    return cache;
+}
+
+void mm_terminal_cache_destroy(mm_terminal_cache_t* cache) {
+    if (cache == NULL) return;
+
+    for (int i = 0; i < TERMINAL_CACHE_BUCKETS; i++) {
+        mm_terminal_state_t* term_state = cache->bucket[i];
+
+        while (term_state != NULL) {
+            mm_terminal_state_t* next = term_state->next;
+            free(term_state);
+            term_state = next;
+        }
+    }
+
+    free(cache);
+}
+
+/* Free the entries not used in the last TERMINAL_CACHE_MAX / 2 calls. */
+static void mm_terminal_cache_trim(mm_terminal_cache_t* cache) {
+    for (int i = 0; i < TERMINAL_CACHE_BUCKETS; i++) {
+        mm_terminal_state_t** link = &cache->bucket[i];
+
+        while (*link != NULL) {
+            mm_terminal_state_t* term_state = *link;
+
+            if (cache->call - term_state->call < TERMINAL_CACHE_MAX / 2) {
+                link = &term_state->next;
+                continue;
+            }
+
+            *link = term_state->next;
+            free(term_state);
+            cache->count--;
+        }
+    }
+}
+
+/*
+ * Start a new call: entries used in earlier calls are checked against
+ * the database before they are used again.
+ */
+void mm_terminal_cache_begin_call(mm_terminal_cache_t* cache) {
+    if (cache == NULL) return;
+
+    cache->call++;
+}
+
+/*
+ * Check an entry used in an earlier call against the STATE_STAMP of its
+ * TTERMINAL entry, and clear it if another process has saved it since.
+ */
+static void mm_terminal_cache_check(mm_terminal_cache_t* cache, mm_terminal_state_t* term_state) {
+    char sql[128] = { 0 };
+    char terminal_id[sizeof(term_state->terminal_id)];
+    mm_terminal_state_t* next;
+
+    term_state->call = cache->call;
+
+    if (term_state->stamp != 0) {
+        snprintf(sql, sizeof(sql), "SELECT STATE_STAMP from TTERMINAL where (TERMINAL_ID = \"%s\")",
+            term_state->terminal_id);
+
+        if (mm_sql_read_uint64(cache->db, sql) == term_state->stamp) return;
+    }
+
+    /* Saved by another process, reload everything from the database. */
+    memcpy(terminal_id, term_state->terminal_id, sizeof(terminal_id));
+    next = term_state->next;
+    memset(term_state, 0, sizeof(mm_terminal_state_t));
+    memcpy(term_state->terminal_id, terminal_id, sizeof(terminal_id));
+    term_state->next = next;
+    term_state->call = cache->call;
+}
+
+/*
+ * Look up the cached state for terminal_id, creating an empty
+ * entry if the terminal has not been seen yet.
+ *
+ * Returns NULL if the cache is not available, in which case the
+ * accounting functions fall back to reading the database.
+ */
+mm_terminal_state_t* mm_terminal_cache_get(mm_terminal_cache_t* cache, const char* terminal_id) {
+    mm_terminal_state_t* term_state;
+    uint32_t bucket;
+
+    if ((cache == NULL) || (terminal_id == NULL) || (terminal_id[0] == '\0')) {
+        return NULL;
+    }
+
+    bucket = mm_terminal_hash(terminal_id);
+
+    for (term_state = cache->bucket[bucket]; term_state != NULL; term_state = term_state->next) {
+        if (strncmp(term_state->terminal_id, terminal_id, sizeof(term_state->terminal_id)) == 0) {
+            if (term_state->call != cache->call) {
+                mm_terminal_cache_check(cache, term_state);
+            }
+            return term_state;
+        }
+    }
+
+    if (cache->count >= TERMINAL_CACHE_MAX) {
+        mm_terminal_cache_trim(cache);
+    }
+
+    term_state = (mm_terminal_state_t*)calloc(1, sizeof(mm_terminal_state_t));
+
+    if (term_state == NULL) {
+        fprintf(stderr, "%s: Error: failed to allocate %zu bytes.\n", __func__, sizeof(mm_terminal_state_t));
+        return NULL;
+    }
+
+    snprintf(term_state->terminal_id, sizeof(term_state->terminal_id), "%s", terminal_id);
+    term_state->call = cache->call;
+    term_state->next = cache->bucket[bucket];
+    cache->bucket[bucket] = term_state;
+    cache->count++;
+
+    return term_state;
+}
+
+/*
+ * Load the TTERMINAL registry entry and link statistics for a
+ * terminal into its cached state, if not loaded already.
+ */
+int mm_terminal_load(void* db, mm_terminal_state_t* term_state) {
+    int rc;
+
+    if (term_state == NULL) return -EINVAL;
+
+    if (!(term_state->valid & TERM_STATE_LINK_VALID) &&
+        (mm_link_load(db, LINK_TYPE_TERMINAL, term_state->terminal_id, &term_state->link) == 0)) {
+        term_state->valid |= TERM_STATE_LINK_VALID;
+    }
+
+    if (term_state->valid & TERM_STATE_REGISTRY_VALID) return 0;
+
+    rc = mm_sql_load_TTERMINAL(db, term_state);
+
+    if (rc == 0) {
+        term_state->valid |= TERM_STATE_REGISTRY_VALID;
+    }
+
+    return rc;
+}
+
+/*
+ * Format the download progress bitmap as an SQL blob literal, or NULL
+ * if no download is in progress.
+ */
+static char* download_progress_to_sql(mm_terminal_state_t* term_state, char* string_buf, size_t string_buf_len) {
+    size_t i;
+
+    if (!term_state->download_in_progress) {
+        snprintf(string_buf, string_buf_len, "NULL");
+        return string_buf;
+    }
+
+    snprintf(string_buf, string_buf_len, "X'");
+    for (i = 0; i < sizeof(term_state->download_confirmed); i++) {
+        snprintf(&string_buf[2 + i * 2], string_buf_len - 2 - i * 2, "%02X", term_state->download_confirmed[i]);
+    }
+    snprintf(&string_buf[2 + i * 2], string_buf_len - 2 - i * 2, "'");
+
+    return string_buf;
+}
+
+/*
+ * Update the TTERMINAL registry entry from the cached state, with a new
+ * STATE_STAMP to tell the other processes their entries are out of date.
+ * Unless the entry was loaded, only the last contact time is updated, so
+ * an empty cache entry never overwrites what is stored.
+ */
+int mm_terminal_save(void* db, mm_telco_t* telco, mm_terminal_state_t* term_state) {
+    char sql[1024] = { 0 };
+    char received_time_str[16] = { 0 };
+    char download_progress_str[2 * sizeof(term_state->download_confirmed) + 4];
+    uint64_t stamp = mm_terminal_new_stamp();
+    int  rc;
+
+    if (term_state == NULL) return -EINVAL;
+
+    if (!(term_state->valid & TERM_STATE_REGISTRY_VALID)) {
+        received_time_to_db_string(received_time_str, sizeof(received_time_str));
+        snprintf(sql, sizeof(sql), "UPDATE TTERMINAL SET LAST_CONTACT_DATE = %.8s, LAST_CONTACT_TIME = %s, "
+            "STATE_STAMP = %" PRIu64 " WHERE ( TERMINAL_ID = \"%s\" );",
+            received_time_str, &received_time_str[9], stamp, term_state->terminal_id);
+
+        rc = mm_sql_exec(db, sql);
+
+        term_state->stamp = (rc == 0) ? stamp : 0;
+
+        return rc;
+    }
+
+    /* Update the row in place, keeping its ID and ARCHIVE_IND. */
+    snprintf(sql, sizeof(sql), "INSERT INTO TTERMINAL ( "
+        "TERMINAL_ID,TERMINAL_TYPE,MTR,MODEL,"
+        "CONTROL_ROM_EDITION,CONTROL_VERSION_NO,"
+        "LAST_CONTACT_DATE,LAST_CONTACT_TIME,"
+        "DOWNLOAD_PROGRESS,STATE_STAMP,"
+        "TELCO_ID, REGION_CODE"
+        " ) VALUES ( "
+        "\"%s\",%d,%d,%d,\"%s\",\"%s\",%s,%s,%" PRIu64 "," TELCO_ID_REGION_CODE ") "
+        "ON CONFLICT(TERMINAL_ID) DO UPDATE SET "
+        "TERMINAL_TYPE=excluded.TERMINAL_TYPE,MTR=excluded.MTR,MODEL=excluded.MODEL,"
+        "CONTROL_ROM_EDITION=excluded.CONTROL_ROM_EDITION,CONTROL_VERSION_NO=excluded.CONTROL_VERSION_NO,"
+        "LAST_CONTACT_DATE=excluded.LAST_CONTACT_DATE,LAST_CONTACT_TIME=excluded.LAST_CONTACT_TIME,"
+        "DOWNLOAD_PROGRESS=excluded.DOWNLOAD_PROGRESS,STATE_STAMP=excluded.STATE_STAMP,"
+        "TELCO_ID=excluded.TELCO_ID,REGION_CODE=excluded.REGION_CODE;",
+        term_state->terminal_id,
+        term_state->terminal_type,
+        term_type_to_mtr(term_state->terminal_type),
+        term_type_to_model(term_state->terminal_type),
+        term_state->control_rom_edition,
+        term_state->control_version,
+        received_time_to_db_string(received_time_str, sizeof(received_time_str)),
+        download_progress_to_sql(term_state, download_progress_str, sizeof(download_progress_str)),
+        stamp,
+        telco->id[0], telco->id[1],
+        telco->region_code[0], telco->region_code[1], telco->region_code[2]);
+
+    rc = mm_sql_exec(db, sql);
+
+    term_state->stamp = (rc == 0) ? stamp : 0;
+
+    return rc;
+}
+
+/* Record the start of a full table download, clearing any earlier progress. */
+int mm_terminal_download_start(void* db, mm_telco_t* telco, mm_terminal_state_t* term_state) {
+    if (term_state == NULL) return -EINVAL;
+
+    memset(term_state->download_confirmed, 0, sizeof(term_state->download_confirmed));
+    term_state->download_in_progress = 1;
+
+    return mm_terminal_save(db, telco, term_state);
+}
+
+int mm_terminal_download_complete(void* db, mm_telco_t* telco, mm_terminal_state_t* term_state) {
+    if (term_state == NULL) return -EINVAL;
+
+    memset(term_state->download_confirmed, 0, sizeof(term_state->download_confirmed));
+    term_state->download_in_progress = 0;
+
+    return mm_terminal_save(db, telco, term_state);
+}
+
+/*
+ * Record the hash of a table confirmed by the terminal, and the
+ * progress of the full download it is part of, if any.
+ */
+int mm_terminal_save_table_hash(void* db, mm_terminal_state_t* term_state, uint8_t table_id, uint32_t table_hash) {
+    char sql[384] = { 0 };
+    char received_time_str[16] = { 0 };
+    char download_progress_str[2 * sizeof(term_state->download_confirmed) + 4];
+    int  rc;
+
+    if (term_state == NULL) return -EINVAL;
+
+    term_state->table_hash[table_id] = table_hash;
+    TABLE_BITMAP_CLEAR(term_state->pending_tables, table_id);
+
+    if (term_state->download_in_progress) {
+        TABLE_BITMAP_SET(term_state->download_confirmed, table_id);
+
+        snprintf(sql, sizeof(sql), "UPDATE TTERMINAL SET DOWNLOAD_PROGRESS = %s WHERE (TERMINAL_ID = \"%s\");",
+            download_progress_to_sql(term_state, download_progress_str, sizeof(download_progress_str)),
+            term_state->terminal_id);
+
+        if ((rc = mm_sql_exec(db, sql)) != 0) {
+            return rc;
+        }
+    }
+
+    snprintf(sql, sizeof(sql), "INSERT INTO TTERMTBL ( "
+        "TERMINAL_ID,TABLE_ID,TABLE_HASH,DOWNLOAD_DATE,DOWNLOAD_TIME"
+        " ) VALUES ( "
+        "\"%s\",%d,%u,%s) "
+        "ON CONFLICT(TERMINAL_ID,TABLE_ID) DO UPDATE SET "
+        "TABLE_HASH=excluded.TABLE_HASH,DOWNLOAD_DATE=excluded.DOWNLOAD_DATE,DOWNLOAD_TIME=excluded.DOWNLOAD_TIME;",
+        term_state->terminal_id,
+        table_id,
+        table_hash,
+        received_time_to_db_string(received_time_str, sizeof(received_time_str)));
+
+    return mm_sql_exec(db, sql);
+}
+
+int mm_terminal_create_tables(void* db) {
+    int rc;
+
+    rc = mm_sql_exec(db, "CREATE TABLE IF NOT EXISTS TTERMINAL ( "
+        "ID INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,"
+        "TERMINAL_ID VARCHAR(10) UNIQUE NOT NULL,"
+        "TERMINAL_TYPE TINYINT UNSIGNED DEFAULT 0,"
+        "MTR SMALLINT UNSIGNED DEFAULT 0,"
+        "MODEL TINYINT UNSIGNED DEFAULT 0,"
+        "CONTROL_ROM_EDITION VARCHAR(7),"
+        "CONTROL_VERSION_NO VARCHAR(4),"
+        "LAST_CONTACT_DATE VARCHAR(8) NOT NULL,"
+        "LAST_CONTACT_TIME VARCHAR(6) NOT NULL,"
+        "DOWNLOAD_PROGRESS BLOB,"
+        "STATE_STAMP BIGINT DEFAULT 0,"
+        "TELCO_ID VARCHAR(2) DEFAULT 0, REGION_CODE VARCHAR(3) DEFAULT \"USA\", ARCHIVE_IND BOOLEAN DEFAULT 0"
+        ");");
+
+    if (rc != 0) {
+        fprintf(stderr, "%s: Failed to create table TTERMINAL.\n", __func__);
+        return -1;
+    }
+
+    rc = mm_sql_exec(db, "CREATE TABLE IF NOT EXISTS TTERMTBL ( "
+        "ID INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,"
+        "TERMINAL_ID VARCHAR(10) NOT NULL,"
+        "TABLE_ID TINYINT UNSIGNED NOT NULL,"
+        "TABLE_HASH INTEGER UNSIGNED NOT NULL,"
+        "DOWNLOAD_DATE VARCHAR(8) NOT NULL,"
+        "DOWNLOAD_TIME VARCHAR(6) NOT NULL,"
+        "UNIQUE(TERMINAL_ID,TABLE_ID) "
+        ");");
+
+    if (rc != 0) {
+        fprintf(stderr, "%s: Failed to create table TTERMTBL.\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,198 @@
+/*
+ * Build-time generator for the control ROM edition lookup table.
+ *
+ * Reads config/control_rom_versions.csv and writes a C source file
+ * containing a perfect hash table of control ROM edition to terminal
+ * type, which is linked into mm_manager.  See
+ * mm_config_get_term_type_from_control_rom_edition() for the lookup.
+ *
+ * www.github.com/hharte/mm_manager
+ *
+ * Copyright (c) 2022-2023, Howard M. Harte
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "mm_manager.h"
+
+#define TERMTYP_DISP_MAX    (0x100000)
+
+typedef struct termtyp_key {
+    char    control_rom_edition[8];
+    uint8_t terminal_type;
+    uint32_t bucket;
+} termtyp_key_t;
+
+static termtyp_key_t keys[TERMTYP_TABLE_SLOTS];
+static int           nkeys;
+
+static uint32_t termtyp_hash(uint32_t seed, const char* control_rom_edition) {
+    return mm_hash32(seed, (const uint8_t*)control_rom_edition, strlen(control_rom_edition));
+}
+
+static int termtyp_load_csv(const char* csv_fname) {
+    FILE* csvstream;
+    char  csvline[255];
+    int   line = 0;
+
+    if ((csvstream = fopen(csv_fname, "r")) == NULL) {
+        fprintf(stderr, "Error opening %s\n", csv_fname);
+        return -ENOENT;
+    }
+
+    while (fgets(csvline, sizeof(csvline), csvstream) != NULL) {
+        char* control_rom_edition;
+        char* tok;
+        int   i;
+
+        line++;
+        if (line == 1) continue; /* Skip over CSV header */
+
+        control_rom_edition = strtok(csvline, ",\r\n");
+        tok = strtok(NULL, ",\r\n");
+        if ((control_rom_edition == NULL) || (tok == NULL)) continue;
+
+        if (strlen(control_rom_edition) >= sizeof(keys[0].control_rom_edition)) {
+            fprintf(stderr, "%s:%d: control ROM edition '%s' too long.\n", csv_fname, line, control_rom_edition);
+            fclose(csvstream);
+            return -EINVAL;
+        }
+
+        /* First entry wins, as with the UNIQUE constraint on TERMTYP. */
+        for (i = 0; i < nkeys; i++) {
+            if (strcmp(keys[i].control_rom_edition, control_rom_edition) == 0) break;
+        }
+        if (i < nkeys) continue;
+
+        if (nkeys == TERMTYP_TABLE_SLOTS / 2) {
+            fprintf(stderr, "%s:%d: too many entries, increase TERMTYP_TABLE_SLOTS.\n", csv_fname, line);
+            fclose(csvstream);
+            return -E2BIG;
+        }
+
+        snprintf(keys[nkeys].control_rom_edition, sizeof(keys[nkeys].control_rom_edition), "%s", control_rom_edition);
+        keys[nkeys].terminal_type = (uint8_t)atoi(tok);
+        keys[nkeys].bucket = termtyp_hash(MM_HASH32_INIT, control_rom_edition) & (TERMTYP_TABLE_BUCKETS - 1);
+        nkeys++;
+    }
+
+    fclose(csvstream);
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    static termtyp_table_entry_t table[TERMTYP_TABLE_SLOTS];
+    static uint8_t               slot_used[TERMTYP_TABLE_SLOTS];
+    uint32_t disp[TERMTYP_TABLE_BUCKETS] = { 0 };
+    int      bucket_size[TERMTYP_TABLE_BUCKETS] = { 0 };
+    int      order[TERMTYP_TABLE_BUCKETS];
+    FILE*    ostream;
+    int      status;
+    int      i, j;
+
+    if (argc != 3) {
+        printf("Usage:\n" \
+               "\tmm_termtyp_gen control_rom_versions.csv mm_termtyp_table.c\n");
+        return -1;
+    }
+
+    if ((status = termtyp_load_csv(argv[1])) != 0) {
+        return status;
+    }
+
+    for (i = 0; i < nkeys; i++) {
+        bucket_size[keys[i].bucket]++;
+    }
+
+    /* Place the largest buckets first, while the table is still empty. */
+    for (i = 0; i < TERMTYP_TABLE_BUCKETS; i++) {
+        order[i] = i;
+    }
+
+    for (i = 1; i < TERMTYP_TABLE_BUCKETS; i++) {
+        int b = order[i];
+
+        for (j = i; (j > 0) && (bucket_size[order[j - 1]] < bucket_size[b]); j--) {
+            order[j] = order[j - 1];
+        }
+        order[j] = b;
+    }
+
+    for (i = 0; (i < TERMTYP_TABLE_BUCKETS) && (bucket_size[order[i]] > 0); i++) {
+        int      bucket = order[i];
+        uint32_t d;
+
+        for (d = 1; d < TERMTYP_DISP_MAX; d++) {
+            uint32_t slots[TERMTYP_TABLE_SLOTS];
+            int      nslots = 0;
+            int      k;
+
+            for (j = 0; j < nkeys; j++) {
+                uint32_t slot;
+
+                if (keys[j].bucket != (uint32_t)bucket) continue;
+
+                slot = termtyp_hash(d, keys[j].control_rom_edition) & (TERMTYP_TABLE_SLOTS - 1);
+                if (slot_used[slot]) break;
+
+                for (k = 0; k < nslots; k++) {
+                    if (slots[k] == slot) break;
+                }
+                if (k < nslots) break;
+
+                slots[nslots++] = slot;
+            }
+
+            if (j == nkeys) break;
+        }
+
+        if (d == TERMTYP_DISP_MAX) {
+            fprintf(stderr, "Error: no displacement found for bucket %d.\n", bucket);
+            return -EINVAL;
+        }
+
+        disp[bucket] = d;
+
+        for (j = 0; j < nkeys; j++) {
+            uint32_t slot;
+
+            if (keys[j].bucket != (uint32_t)bucket) continue;
+
+            slot = termtyp_hash(d, keys[j].control_rom_edition) & (TERMTYP_TABLE_SLOTS - 1);
+            slot_used[slot] = 1;
+            memcpy(table[slot].control_rom_edition, keys[j].control_rom_edition, sizeof(table[slot].control_rom_edition));
+            table[slot].terminal_type = keys[j].terminal_type;
+        }
+    }
+
+    if ((ostream = fopen(argv[2], "w")) == NULL) {
+        fprintf(stderr, "Error opening %s\n", argv[2]);
+        return -ENOENT;
+    }
+
+    fprintf(ostream, "/* Generated by mm_termtyp_gen from %s, do not edit. */\n\n", argv[1]);
+    fprintf(ostream, "#include \"src/mm_manager.h\"\n\n");
+
+    fprintf(ostream, "const uint32_t termtyp_table_disp[TERMTYP_TABLE_BUCKETS] = {\n");
+    for (i = 0; i < TERMTYP_TABLE_BUCKETS; i++) {
+        fprintf(ostream, "%s%u,%s", (i % 8 == 0) ? "    " : " ", disp[i], (i % 8 == 7) ? "\n" : "");
+    }
+    fprintf(ostream, "};\n\n");
+
+    fprintf(ostream, "const termtyp_table_entry_t termtyp_table[TERMTYP_TABLE_SLOTS] = {\n");
+    for (i = 0; i < TERMTYP_TABLE_SLOTS; i++) {
+        fprintf(ostream, "    { \"%s\", %d },\n", table[i].control_rom_edition, table[i].terminal_type);
+    }
+    fprintf(ostream, "};\n");
+
+    fclose(ostream);
+
+    printf("mm_termtyp_gen: %d control ROM editions in %d slots.\n", nkeys, TERMTYP_TABLE_SLOTS);
+
+    return 0;
+}
@@ -0,0 +1,150 @@
+/*
+ * Live view of the mm_manager status board.
+ *
+ * Displays the state of each line published by the mm_manager
+ * processes started in a directory, refreshed every second, or once
+ * with -1.  Lines that have not updated the board for STALE_SECS are
+ * flagged, as the process is stuck or has died.
+ *
+ * www.github.com/hharte/mm_manager
+ *
+ * Copyright (c) 2022-2023, Howard M. Harte
+ *
+ * Example:
+ *
+ * mm_top
+ * mm_top -1 /var/lib/mm_manager/mm_manager_status.bin
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <unistd.h>
+#endif /* _WIN32 */
+
+#include "mm_manager.h"
+
+#define STALE_SECS  (10)
+
+static const char* line_state_str[] = {
+    "Idle",
+    "Ringing",
+    "Connected",
+    "Downloading",
+    "Uploading CDRs",
+    "Busy out",
+    "Stopped",
+};
+
+static void format_secs(int64_t secs, char* buf, size_t len) {
+    if (secs < 0) secs = 0;
+
+    if (secs >= 3600) {
+        snprintf(buf, len, "%" PRId64 ":%02d:%02d", secs / 3600, (int)((secs / 60) % 60), (int)(secs % 60));
+    } else {
+        snprintf(buf, len, "%d:%02d", (int)(secs / 60), (int)(secs % 60));
+    }
+}
+
+static void print_board(const mm_status_t* status) {
+    int64_t now = (int64_t)time(NULL);
+    int i;
+
+    printf("%-20s %-8s %-22s %-10s %7s %8s %8s %5s %6s\n",
+           "Line", "PID", "State", "Terminal", "In", "Bytes TX", "Bytes RX", "Retx", "Calls");
+
+    for (i = 0; i < STATUS_LINES; i++) {
+        mm_status_line_t line;
+        char state[32];
+        char elapsed[32];
+        char call_time[32] = "";
+
+        if (mm_status_read(status, i, &line) != 0) {
+            printf("%-20s (busy)\n", "?");
+            continue;
+        }
+
+        if (line.line_id[0] == '\0') continue;
+
+        line.line_id[sizeof(line.line_id) - 1] = '\0';
+        line.terminal_id[sizeof(line.terminal_id) - 1] = '\0';
+
+        if (line.state == LINE_STATE_DOWNLOADING) {
+            snprintf(state, sizeof(state), "Table %d (%u of %u)", line.table_id, line.tables_sent, line.tables_total);
+        } else if (line.state == LINE_STATE_UPLOADING) {
+            snprintf(state, sizeof(state), "Uploading %u CDRs", line.cdrs);
+        } else {
+            snprintf(state, sizeof(state), "%s", line.state <= LINE_STATE_STOPPED ? line_state_str[line.state] : "Unknown");
+        }
+
+        format_secs(now - line.state_since, elapsed, sizeof(elapsed));
+
+        if ((line.state >= LINE_STATE_CONNECTED) && (line.state <= LINE_STATE_UPLOADING)) {
+            format_secs(now - line.call_start, call_time, sizeof(call_time));
+        }
+
+        printf("%-20.20s %-8u %-22s %-10s %7s %8u %8u %5u %6u",
+               line.line_id, line.pid, state, line.terminal_id, elapsed,
+               line.bytes_tx, line.bytes_rx, line.retransmits, line.calls);
+
+        if (call_time[0] != '\0') {
+            printf("  call %s", call_time);
+        }
+
+        if ((line.state != LINE_STATE_STOPPED) && (line.state != LINE_STATE_BUSY_OUT) && (now - line.updated >= STALE_SECS)) {
+            printf("  STALE");
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char* filename = "mm_manager_status.bin";
+    mm_status_t* status;
+    int once = 0;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-1") == 0) {
+            once = 1;
+        } else if (argv[i][0] == '-') {
+            printf("Usage:\n" \
+                   "\tmm_top [-1] [status_board]\n");
+            return -EINVAL;
+        } else {
+            filename = argv[i];
+        }
+    }
+
+    if ((status = mm_status_attach(filename)) == NULL) {
+        return -ENOENT;
+    }
+
+    for (;;) {
+        if (!once) {
+            /* Clear the screen. */
+            printf("\033[H\033[2J");
+        }
+
+        print_board(status);
+        fflush(stdout);
+
+        if (once) break;
+
+#ifdef _WIN32
+        Sleep(1000);
+#else
+        sleep(1);
+#endif /* _WIN32 */
+    }
+
+    mm_status_close(status);
+    return 0;
+}
@@ -0,0 +1,33 @@
+/*
+ * Static tracepoints for mm_manager.
+ *
+ * When built with sys/sdt.h (systemtap-sdt-dev), the MM_TRACE macros
+ * place USDT probes in the "mm_manager" provider, which cost a no-op
+ * instruction unless a tracer such as bpftrace attaches to them.
+ * Otherwise they compile to nothing.  See bpftrace/ for scripts that
+ * use them.
+ *
+ * www.github.com/hharte/mm_manager
+ *
+ * Copyright (c) 2022-2023, Howard M. Harte
+ */
+
+#ifndef MM_TRACE_H_
+#define MM_TRACE_H_
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define MM_TRACE0(name)                 DTRACE_PROBE(mm_manager, name)
+#define MM_TRACE1(name, a)              DTRACE_PROBE1(mm_manager, name, a)
+#define MM_TRACE2(name, a, b)           DTRACE_PROBE2(mm_manager, name, a, b)
+#define MM_TRACE3(name, a, b, c)        DTRACE_PROBE3(mm_manager, name, a, b, c)
+#else
+/* Arguments are not evaluated, but still count as used. */
+#define MM_TRACE0(name)                 do { } while (0)
+#define MM_TRACE1(name, a)              do { (void)sizeof(a); } while (0)
+#define MM_TRACE2(name, a, b)           do { (void)sizeof(a); (void)sizeof(b); } while (0)
+#define MM_TRACE3(name, a, b, c)        do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); } while (0)
+#endif /* HAVE_SYS_SDT_H */
+
+#endif /* MM_TRACE_H_ */
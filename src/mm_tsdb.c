@@ -0,0 +1,557 @@
+/*
+ * Compressed time-series store for terminal statistics.
+ *
+ * Each terminal's performance statistics and summary call statistics
+ * are kept as a series of samples, one per record received, in the file
+ * <dir>/<terminal_id>_<record type>.ts, and in memory once read.  A
+ * sample holds the time at the end of the summary period and a vector
+ * of counters.
+ *
+ * Samples are compressed against the one before: the time as a
+ * delta-of-delta, and each counter as the difference from its previous
+ * value, all as zigzag varints.  Regularly reported statistics thus
+ * take a byte per counter or less.  Every TSDB_CHECKPOINT_INTERVAL
+ * samples, a checkpoint sample is stored uncompressed, and its time and
+ * offset are indexed, so a range scan starts decoding at the last
+ * checkpoint before the start of the range.
+ *
+ * The processes serving different lines may keep series in the same
+ * directory, and a terminal may call any line.  Appends and scans hold
+ * the lock in <dir>/tsdb.lock, and first read any samples other
+ * processes have appended, so each sample is compressed against the one
+ * actually before it in the file.
+ *
+ * www.github.com/hharte/mm_manager
+ *
+ * Copyright (c) 2022-2023, Howard M. Harte
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+# include <io.h>
+#else
+# include <unistd.h>
+#endif /* _WIN32 */
+
+#include "mm_manager.h"
+
+#define TSDB_MAGIC          "MMTS"
+#define TSDB_VERSION        (1)
+#define TSDB_HEADER_LEN     (8)     /* Magic, version, record type, metrics, reserved */
+#define TSDB_VARINT_MAX     (10)    /* Bytes in the longest 64-bit varint */
+
+/* Decoder state: the last sample decoded. */
+typedef struct tsdb_cursor {
+    size_t pos;
+    uint32_t index;
+    int64_t time;
+    int64_t delta;
+    uint32_t value[TSDB_METRICS_MAX];
+} tsdb_cursor_t;
+
+static uint64_t zigzag_encode(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t zigzag_decode(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static size_t varint_encode(uint8_t* buf, uint64_t v) {
+    size_t len = 0;
+
+    while (v >= 0x80) {
+        buf[len++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    buf[len++] = (uint8_t)v;
+
+    return len;
+}
+
+/* Returns 0, or -1 if the varint runs past len. */
+static int varint_decode(const uint8_t* buf, size_t len, size_t* pos, uint64_t* v) {
+    int shift = 0;
+
+    *v = 0;
+
+    while (*pos < len) {
+        uint8_t b = buf[(*pos)++];
+
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return 0;
+
+        shift += 7;
+        if (shift > 63) return -1;
+    }
+
+    return -1;
+}
+
+static int tsdb_is_checkpoint(uint32_t index) {
+    return (index % TSDB_CHECKPOINT_INTERVAL) == 0;
+}
+
+/* Decode the sample at cursor->pos into cursor.  Returns 0, or -1 if the sample is incomplete. */
+static int tsdb_decode(const mm_tsdb_series_t* series, tsdb_cursor_t* cursor) {
+    tsdb_cursor_t next = *cursor;
+    uint64_t v;
+    int i;
+
+    if (varint_decode(series->buf, series->len, &next.pos, &v) != 0) return -1;
+
+    if (tsdb_is_checkpoint(next.index)) {
+        next.time = zigzag_decode(v);
+        next.delta = 0;
+    } else {
+        next.delta += zigzag_decode(v);
+        next.time += next.delta;
+    }
+
+    for (i = 0; i < series->metrics; i++) {
+        if (varint_decode(series->buf, series->len, &next.pos, &v) != 0) return -1;
+
+        if (tsdb_is_checkpoint(next.index)) {
+            next.value[i] = (uint32_t)v;
+        } else {
+            next.value[i] += (uint32_t)zigzag_decode(v);
+        }
+    }
+
+    next.index++;
+    *cursor = next;
+
+    return 0;
+}
+
+static int tsdb_add_checkpoint(mm_tsdb_series_t* series, int64_t time, size_t offset) {
+    if (series->ncheckpoints == series->checkpoint_size) {
+        uint32_t size = series->checkpoint_size ? series->checkpoint_size * 2 : 16;
+        mm_tsdb_checkpoint_t* checkpoint = (mm_tsdb_checkpoint_t*)realloc(series->checkpoint, size * sizeof(mm_tsdb_checkpoint_t));
+
+        if (checkpoint == NULL) return -ENOMEM;
+
+        series->checkpoint = checkpoint;
+        series->checkpoint_size = size;
+    }
+
+    series->checkpoint[series->ncheckpoints].time = time;
+    series->checkpoint[series->ncheckpoints].offset = offset;
+    series->ncheckpoints++;
+
+    return 0;
+}
+
+static void tsdb_series_filename(const mm_tsdb_t* tsdb, const mm_tsdb_series_t* series, char* fname, size_t len) {
+    snprintf(fname, len, "%s/%s_%02x.ts", tsdb->dir, series->terminal_id, series->record_type);
+}
+
+/*
+ * Read the samples appended to the series file since it was last read,
+ * by this process or another, and index their checkpoints.  The whole
+ * file is read the first time, or if it has been truncated.
+ */
+static int tsdb_series_load(mm_tsdb_t* tsdb, mm_tsdb_series_t* series) {
+    char fname[300];
+    uint8_t header[TSDB_HEADER_LEN];
+    FILE* instream;
+    long file_len;
+    size_t start;
+    size_t end;
+    tsdb_cursor_t cursor = { 0 };
+
+    tsdb_series_filename(tsdb, series, fname, sizeof(fname));
+
+    if ((instream = fopen(fname, "rb")) == NULL) {
+        return 0;
+    }
+
+    fseek(instream, 0, SEEK_END);
+    file_len = ftell(instream);
+
+    if ((file_len >= 0) && ((size_t)file_len < series->file_len)) {
+        fprintf(stderr, "%s: %s was truncated, reading it again.\n", __func__, fname);
+        series->len = 0;
+        series->file_len = 0;
+        series->count = 0;
+        series->ncheckpoints = 0;
+    }
+
+    if (series->file_len == 0) {
+        fseek(instream, 0, SEEK_SET);
+
+        if ((file_len < TSDB_HEADER_LEN) ||
+            (fread(header, sizeof(header), 1, instream) != 1) ||
+            (memcmp(header, TSDB_MAGIC, 4) != 0) ||
+            (header[4] != TSDB_VERSION) ||
+            (header[5] != series->record_type) ||
+            (header[6] == 0) || (header[6] > TSDB_METRICS_MAX) ||
+            (series->metrics && (header[6] != series->metrics))) {
+            fprintf(stderr, "%s: %s is not a valid series file.\n", __func__, fname);
+            fclose(instream);
+            return -EINVAL;
+        }
+
+        series->metrics = header[6];
+        series->file_len = TSDB_HEADER_LEN;
+    } else {
+        /* Continue decoding from the last sample read. */
+        cursor.pos = series->len;
+        cursor.index = series->count;
+        cursor.time = series->last_time;
+        cursor.delta = series->last_delta;
+        memcpy(cursor.value, series->last_value, sizeof(cursor.value));
+    }
+
+    start = series->file_len;
+    if ((size_t)file_len <= start) {
+        fclose(instream);
+        return 0;
+    }
+
+    end = series->len + ((size_t)file_len - start);
+    if (end > series->size) {
+        uint8_t* buf;
+
+        if ((buf = (uint8_t*)realloc(series->buf, end)) == NULL) {
+            fclose(instream);
+            return -ENOMEM;
+        }
+        series->buf = buf;
+        series->size = end;
+    }
+
+    if ((fseek(instream, (long)start, SEEK_SET) != 0) ||
+        (fread(&series->buf[series->len], end - series->len, 1, instream) != 1)) {
+        fclose(instream);
+        return -EIO;
+    }
+
+    fclose(instream);
+    series->len = end;
+
+    while (cursor.pos < series->len) {
+        size_t offset = cursor.pos;
+
+        if (tsdb_decode(series, &cursor) != 0) {
+            /* A sample cut short by a crash is dropped, and truncated before the next is written. */
+            fprintf(stderr, "%s: Ignoring incomplete sample at the end of %s.\n", __func__, fname);
+            series->len = offset;
+            series->truncate = 1;
+            break;
+        }
+
+        if (tsdb_is_checkpoint(cursor.index - 1) && (tsdb_add_checkpoint(series, cursor.time, offset) != 0)) {
+            return -ENOMEM;
+        }
+    }
+
+    series->file_len = TSDB_HEADER_LEN + series->len;
+    series->count = cursor.index;
+    series->last_time = cursor.time;
+    series->last_delta = cursor.delta;
+    memcpy(series->last_value, cursor.value, sizeof(series->last_value));
+
+    return 0;
+}
+
+mm_tsdb_t* mm_tsdb_open(const char* dir) {
+    char fname[300];
+    mm_tsdb_t* tsdb;
+
+    if ((tsdb = (mm_tsdb_t*)calloc(1, sizeof(mm_tsdb_t))) == NULL) {
+        fprintf(stderr, "%s: Error: failed to allocate %zu bytes.\n", __func__, sizeof(mm_tsdb_t));
+        return NULL;
+    }
+
+    snprintf(tsdb->dir, sizeof(tsdb->dir), "%s", dir);
+    snprintf(fname, sizeof(fname), "%s/tsdb.lock", dir);
+
+    if (mm_lockfile_open(&tsdb->lock, fname) != 0) {
+        free(tsdb);
+        return NULL;
+    }
+
+    return tsdb;
+}
+
+void mm_tsdb_close(mm_tsdb_t* tsdb) {
+    if (tsdb == NULL) return;
+
+    for (int i = 0; i < TERMINAL_CACHE_BUCKETS; i++) {
+        mm_tsdb_series_t* series = tsdb->bucket[i];
+
+        while (series != NULL) {
+            mm_tsdb_series_t* next = series->next;
+
+            free(series->buf);
+            free(series->checkpoint);
+            free(series);
+            series = next;
+        }
+    }
+
+    mm_lockfile_close(&tsdb->lock);
+    free(tsdb);
+}
+
+/*
+ * Look up a series, reading it from its file the first time, and any
+ * samples appended since after that.  metrics is 0 to look up an
+ * existing series only.  Called with the lock held.
+ */
+static mm_tsdb_series_t* tsdb_series_get(mm_tsdb_t* tsdb, const char* terminal_id, uint8_t record_type, uint8_t metrics) {
+    mm_tsdb_series_t* series;
+    uint32_t bucket;
+
+    bucket = (mm_hash32(MM_HASH32_INIT, (const uint8_t*)terminal_id, strlen(terminal_id)) + record_type) & (TERMINAL_CACHE_BUCKETS - 1);
+
+    for (series = tsdb->bucket[bucket]; series != NULL; series = series->next) {
+        if ((series->record_type == record_type) &&
+            (strncmp(series->terminal_id, terminal_id, sizeof(series->terminal_id)) == 0)) {
+            return (tsdb_series_load(tsdb, series) == 0) ? series : NULL;
+        }
+    }
+
+    if (metrics > TSDB_METRICS_MAX) return NULL;
+
+    if ((series = (mm_tsdb_series_t*)calloc(1, sizeof(mm_tsdb_series_t))) == NULL) {
+        fprintf(stderr, "%s: Error: failed to allocate %zu bytes.\n", __func__, sizeof(mm_tsdb_series_t));
+        return NULL;
+    }
+
+    snprintf(series->terminal_id, sizeof(series->terminal_id), "%s", terminal_id);
+    series->record_type = record_type;
+    series->metrics = metrics;
+
+    /* A series is only created by an append, which gives its metrics. */
+    if ((tsdb_series_load(tsdb, series) != 0) || (series->metrics == 0)) {
+        free(series->buf);
+        free(series->checkpoint);
+        free(series);
+        return NULL;
+    }
+
+    series->next = tsdb->bucket[bucket];
+    tsdb->bucket[bucket] = series;
+
+    return series;
+}
+
+static int tsdb_append(mm_tsdb_t* tsdb, const char* terminal_id, uint8_t record_type, const uint8_t* timestamp,
+                       const uint32_t* value, uint8_t metrics) {
+    mm_tsdb_series_t* series;
+    uint8_t sample[TSDB_VARINT_MAX * (TSDB_METRICS_MAX + 1)];
+    char fname[300];
+    FILE* outstream;
+    int64_t time = mm_tsdb_time(timestamp);
+    size_t len = 0;
+    int checkpoint;
+    int i;
+
+    if ((series = tsdb_series_get(tsdb, terminal_id, record_type, metrics)) == NULL) {
+        return -EIO;
+    }
+
+    if (series->metrics != metrics) return -EINVAL;
+
+    if ((series->count > 0) && (time <= series->last_time)) return 0;
+
+    checkpoint = tsdb_is_checkpoint(series->count);
+
+    if (checkpoint) {
+        len += varint_encode(&sample[len], zigzag_encode(time));
+        for (i = 0; i < metrics; i++) {
+            len += varint_encode(&sample[len], value[i]);
+        }
+    } else {
+        int64_t delta = time - series->last_time;
+
+        len += varint_encode(&sample[len], zigzag_encode(delta - series->last_delta));
+        for (i = 0; i < metrics; i++) {
+            len += varint_encode(&sample[len], zigzag_encode((int64_t)(int32_t)(value[i] - series->last_value[i])));
+        }
+    }
+
+    if (series->len + len > series->size) {
+        size_t size = series->size ? series->size * 2 : 1024;
+        uint8_t* buf;
+
+        while (size < series->len + len) size *= 2;
+
+        if ((buf = (uint8_t*)realloc(series->buf, size)) == NULL) return -ENOMEM;
+
+        series->buf = buf;
+        series->size = size;
+    }
+
+    tsdb_series_filename(tsdb, series, fname, sizeof(fname));
+
+    /* Written in place, after any incomplete sample at the end is truncated. */
+    if ((outstream = fopen(fname, (series->file_len == 0) ? "wb" : "r+b")) == NULL) {
+        fprintf(stderr, "%s: Cannot write %s.\n", __func__, fname);
+        return -EIO;
+    }
+
+    if (series->file_len == 0) {
+        uint8_t header[TSDB_HEADER_LEN] = { 'M', 'M', 'T', 'S', TSDB_VERSION, 0, 0, 0 };
+
+        header[5] = record_type;
+        header[6] = metrics;
+        if (fwrite(header, sizeof(header), 1, outstream) != 1) {
+            fclose(outstream);
+            return -EIO;
+        }
+        series->file_len = TSDB_HEADER_LEN;
+    } else if (series->truncate) {
+#ifdef _WIN32
+        if (_chsize_s(_fileno(outstream), (__int64)series->file_len) != 0) {
+#else
+        if (ftruncate(fileno(outstream), (off_t)series->file_len) != 0) {
+#endif /* _WIN32 */
+            fprintf(stderr, "%s: Cannot truncate %s.\n", __func__, fname);
+            fclose(outstream);
+            return -EIO;
+        }
+        series->truncate = 0;
+    }
+
+    if ((fseek(outstream, (long)series->file_len, SEEK_SET) != 0) ||
+        (fwrite(sample, len, 1, outstream) != 1) ||
+        (fclose(outstream) != 0)) {
+        fprintf(stderr, "%s: Cannot write %s.\n", __func__, fname);
+        return -EIO;
+    }
+
+    if (checkpoint && (tsdb_add_checkpoint(series, time, series->len) != 0)) {
+        return -ENOMEM;
+    }
+
+    memcpy(&series->buf[series->len], sample, len);
+    series->len += len;
+    series->file_len += len;
+    series->last_delta = checkpoint ? 0 : time - series->last_time;
+    series->last_time = time;
+    memcpy(series->last_value, value, metrics * sizeof(uint32_t));
+    series->count++;
+
+    return 0;
+}
+
+/*
+ * Append a sample of metrics counters, taken at the end of the summary
+ * period given by timestamp, to the terminal's series for record_type.
+ * Samples not later than the last are ignored.
+ */
+int mm_tsdb_append(mm_tsdb_t* tsdb, const char* terminal_id, uint8_t record_type, const uint8_t* timestamp,
+                   const uint32_t* value, uint8_t metrics) {
+    int status;
+
+    if ((status = mm_lockfile_lock(&tsdb->lock, 0, 1)) != 0) return status;
+
+    status = tsdb_append(tsdb, terminal_id, record_type, timestamp, value, metrics);
+    mm_lockfile_unlock(&tsdb->lock, 0);
+
+    return status;
+}
+
+static int tsdb_scan(mm_tsdb_t* tsdb, const char* terminal_id, uint8_t record_type, uint8_t metric,
+                     int64_t from, int64_t to, mm_tsdb_callback_t callback, void* arg) {
+    mm_tsdb_series_t* series;
+    tsdb_cursor_t cursor = { 0 };
+    uint32_t lo = 0, hi;
+    int samples = 0;
+
+    if ((series = tsdb_series_get(tsdb, terminal_id, record_type, 0)) == NULL) {
+        return 0;
+    }
+
+    if (metric >= series->metrics) return -EINVAL;
+    if (series->ncheckpoints == 0) return 0;
+
+    /* Find the last checkpoint at or before from. */
+    hi = series->ncheckpoints;
+    while (hi - lo > 1) {
+        uint32_t mid = (lo + hi) / 2;
+
+        if (series->checkpoint[mid].time <= from) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    cursor.pos = series->checkpoint[lo].offset;
+    cursor.index = lo * TSDB_CHECKPOINT_INTERVAL;
+
+    while ((cursor.index < series->count) && (tsdb_decode(series, &cursor) == 0)) {
+        if (cursor.time > to) break;
+
+        if (cursor.time >= from) {
+            callback(cursor.time, cursor.value[metric], arg);
+            samples++;
+        }
+    }
+
+    return samples;
+}
+
+/*
+ * Call callback for each sample of metric in the terminal's series for
+ * record_type taken from time from to time to, inclusive.  Returns the
+ * number of samples, or a negative errno.
+ */
+int mm_tsdb_scan(mm_tsdb_t* tsdb, const char* terminal_id, uint8_t record_type, uint8_t metric,
+                 int64_t from, int64_t to, mm_tsdb_callback_t callback, void* arg) {
+    int status;
+
+    if ((status = mm_lockfile_lock(&tsdb->lock, 0, 1)) != 0) return status;
+
+    status = tsdb_scan(tsdb, terminal_id, record_type, metric, from, to, callback, arg);
+    mm_lockfile_unlock(&tsdb->lock, 0);
+
+    return status;
+}
+
+/* Days since 1900-01-01 of a proleptic Gregorian date. */
+static int64_t tsdb_days(int64_t year, int64_t month, int64_t day) {
+    int64_t era, yoe, doy, doe;
+
+    year -= (month <= 2);
+    era = (year >= 0 ? year : year - 399) / 400;
+    yoe = year - era * 400;
+    doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+    return era * 146097 + doe - 693901;    /* 693901 days from 0000-03-01 to 1900-01-01 */
+}
+
+/* Seconds since 1900-01-01 of a terminal timestamp, in the terminal's local time. */
+int64_t mm_tsdb_time(const uint8_t* timestamp) {
+    return tsdb_days(timestamp[0] + 1900, timestamp[1], timestamp[2]) * 86400 +
+           timestamp[3] * 3600 + timestamp[4] * 60 + timestamp[5];
+}
+
+/* Inverse of mm_tsdb_time(). */
+void mm_tsdb_timestamp(int64_t time, uint8_t* timestamp) {
+    int64_t days = time / 86400;
+    int64_t secs = time % 86400;
+    int64_t z = days + 693901;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    int64_t doe = z - era * 146097;
+    int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int64_t mp = (5 * doy + 2) / 153;
+    int64_t month = mp < 10 ? mp + 3 : mp - 9;
+    int64_t year = yoe + era * 400 + (month <= 2);
+
+    timestamp[0] = (uint8_t)(year - 1900);
+    timestamp[1] = (uint8_t)month;
+    timestamp[2] = (uint8_t)(doy - (153 * mp + 2) / 5 + 1);
+    timestamp[3] = (uint8_t)(secs / 3600);
+    timestamp[4] = (uint8_t)((secs / 60) % 60);
+    timestamp[5] = (uint8_t)(secs % 60);
+}
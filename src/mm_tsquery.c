@@ -0,0 +1,124 @@
+/*
+ * Utility to query the terminal statistics time series.
+ *
+ * Prints the samples of one counter of a terminal's performance
+ * statistics (perf) or summary call statistics (call), kept by
+ * mm_manager -T, from the given time to the given time, and the change
+ * from each sample to the next.  Counter numbers are the column order
+ * of TPERFST_DELTA and TCALLST_DELTA, starting from 0.
+ *
+ * www.github.com/hharte/mm_manager
+ *
+ * Copyright (c) 2022-2023, Howard M. Harte
+ *
+ * Example:
+ *
+ * mm_tsquery ts 5105551212 perf 0
+ * mm_tsquery ts 5105551212 call 16 20230101 20230201120000
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include "mm_manager.h"
+
+typedef struct tsquery_state {
+    int samples;
+    uint32_t prev;
+} tsquery_state_t;
+
+static void print_sample(int64_t time, uint32_t value, void* arg) {
+    tsquery_state_t* state = (tsquery_state_t*)arg;
+    uint8_t timestamp[6];
+
+    mm_tsdb_timestamp(time, timestamp);
+
+    printf("%04d-%02d-%02d %02d:%02d:%02d %10u",
+           timestamp[0] + 1900, timestamp[1], timestamp[2], timestamp[3], timestamp[4], timestamp[5], value);
+
+    if (state->samples > 0) {
+        printf(" %+11" PRId64, (int64_t)value - state->prev);
+    }
+    printf("\n");
+
+    state->prev = value;
+    state->samples++;
+}
+
+/* Parse YYYYMMDD[hhmmss] into seconds, as returned by mm_tsdb_time(). */
+static int parse_time(const char* str, int64_t* time) {
+    unsigned int year, month, day, hour = 0, minute = 0, second = 0;
+    uint8_t timestamp[6];
+    size_t len = strlen(str);
+
+    if (((len != 8) && (len != 14)) ||
+        (sscanf(str, "%4u%2u%2u%2u%2u%2u", &year, &month, &day, &hour, &minute, &second) < 3) ||
+        (year < 1900) || (year > 2155) || (month < 1) || (month > 12) || (day < 1) || (day > 31) ||
+        (hour > 23) || (minute > 59) || (second > 59)) {
+        fprintf(stderr, "Invalid time '%s', expected YYYYMMDD[hhmmss].\n", str);
+        return -EINVAL;
+    }
+
+    timestamp[0] = (uint8_t)(year - 1900);
+    timestamp[1] = (uint8_t)month;
+    timestamp[2] = (uint8_t)day;
+    timestamp[3] = (uint8_t)hour;
+    timestamp[4] = (uint8_t)minute;
+    timestamp[5] = (uint8_t)second;
+
+    *time = mm_tsdb_time(timestamp);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    mm_tsdb_t* tsdb;
+    tsquery_state_t state = { 0 };
+    uint8_t record_type;
+    int64_t from = INT64_MIN;
+    int64_t to = INT64_MAX;
+    int metric;
+    int status;
+
+    if ((argc < 5) || (argc > 7)) {
+        printf("Usage:\n" \
+               "\tmm_tsquery <ts_dir> <terminal_id> <perf|call> <counter> [from [to]]\n");
+        return -EINVAL;
+    }
+
+    if (strcmp(argv[3], "perf") == 0) {
+        record_type = DLOG_MT_PERF_STATS_MSG;
+    } else if (strcmp(argv[3], "call") == 0) {
+        record_type = DLOG_MT_SUMMARY_CALL_STATS;
+    } else {
+        fprintf(stderr, "Unknown series '%s', expected perf or call.\n", argv[3]);
+        return -EINVAL;
+    }
+
+    metric = atoi(argv[4]);
+    if ((metric < 0) || (metric >= TSDB_METRICS_MAX)) {
+        fprintf(stderr, "Invalid counter %s.\n", argv[4]);
+        return -EINVAL;
+    }
+
+    if ((argc > 5) && (parse_time(argv[5], &from) != 0)) return -EINVAL;
+    if ((argc > 6) && (parse_time(argv[6], &to) != 0)) return -EINVAL;
+
+    if ((tsdb = mm_tsdb_open(argv[1])) == NULL) {
+        return -ENOMEM;
+    }
+
+    status = mm_tsdb_scan(tsdb, argv[2], record_type, (uint8_t)metric, from, to, print_sample, &state);
+    mm_tsdb_close(tsdb);
+
+    if (status < 0) {
+        fprintf(stderr, "Counter %d is not in the %s series of terminal %s.\n", metric, argv[3], argv[2]);
+        return status;
+    }
+
+    printf("%d samples.\n", status);
+    return 0;
+}
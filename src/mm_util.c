@@ -36,6 +36,15 @@ uint16_t crc16(uint16_t crc, uint8_t *buf, size_t len) {
     return crc;
 }
 
+/* Calculate 32-bit FNV-1a hash, start with hash = MM_HASH32_INIT. */
+uint32_t mm_hash32(uint32_t hash, const uint8_t *buf, size_t len) {
+    while (len--) {
+        hash ^= *buf++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
 void dump_hex(const uint8_t *data, size_t len) {
     uint8_t  ascii[32] = { 0 };
     uint8_t *pascii    = ascii;
@@ -72,32 +81,91 @@ void dump_hex(const uint8_t *data, size_t len) {
     printf("\n");
 }
 
-/* Convert encoded phone number into string. */
-extern char* phone_num_to_string(char *string_buf, size_t string_buf_len, uint8_t *num_buf, size_t num_buf_len) {
-    char  *pstr = string_buf;
-    size_t i, j;
+/*
+ * Packed BCD digits, two per byte, high nibble first.  A nibble of 0xe
+ * ends the number.  bcd_lut gives the characters for each byte, and how
+ * many of them are digits before the end of the number.
+ */
+typedef struct bcd_pair {
+    char    digits[2];
+    uint8_t len;
+} bcd_pair_t;
+
+#define BCD_PAIR(h, l)  { { (char)('0' + (h)), (char)('0' + (l)) }, (h) == 0xe ? 0 : (l) == 0xe ? 1 : 2 }
+#define BCD_ROW(h)      BCD_PAIR(h, 0x0), BCD_PAIR(h, 0x1), BCD_PAIR(h, 0x2), BCD_PAIR(h, 0x3), \
+                        BCD_PAIR(h, 0x4), BCD_PAIR(h, 0x5), BCD_PAIR(h, 0x6), BCD_PAIR(h, 0x7), \
+                        BCD_PAIR(h, 0x8), BCD_PAIR(h, 0x9), BCD_PAIR(h, 0xa), BCD_PAIR(h, 0xb), \
+                        BCD_PAIR(h, 0xc), BCD_PAIR(h, 0xd), BCD_PAIR(h, 0xe), BCD_PAIR(h, 0xf)
+
+static const bcd_pair_t bcd_lut[256] = {
+    BCD_ROW(0x0), BCD_ROW(0x1), BCD_ROW(0x2), BCD_ROW(0x3),
+    BCD_ROW(0x4), BCD_ROW(0x5), BCD_ROW(0x6), BCD_ROW(0x7),
+    BCD_ROW(0x8), BCD_ROW(0x9), BCD_ROW(0xa), BCD_ROW(0xb),
+    BCD_ROW(0xc), BCD_ROW(0xd), BCD_ROW(0xe), BCD_ROW(0xf)
+};
 
-    j = 0;
+/*
+ * Unpack up to bcd_len bytes of packed BCD digits into a NUL-terminated
+ * string of at most string_buf_len - 1 digits, stopping at a nibble of
+ * 0xe.  Returns the number of digits.
+ */
+size_t mm_bcd_unpack(char *string_buf, size_t string_buf_len, const uint8_t *bcd, size_t bcd_len) {
+    size_t len = 0;
+    size_t i;
 
-    for (i = 0; i < num_buf_len; i++) {
-        int pn_digit = num_buf[i] >> 4;
+    if (string_buf_len == 0) return 0;
 
-        if (pn_digit == 0xe) break;
-        *pstr++ = (pn_digit) + '0';
-        j++;
+    for (i = 0; i < bcd_len; i++) {
+        const bcd_pair_t* pair = &bcd_lut[bcd[i]];
 
-        if (j >= (string_buf_len - 1)) break;
+        /* Room for one more digit at most. */
+        if (len + 2 >= string_buf_len) {
+            if ((len + 1 < string_buf_len) && (pair->len > 0)) {
+                string_buf[len++] = pair->digits[0];
+            }
+            break;
+        }
 
-        pn_digit = num_buf[i] & 0x0f;
+        memcpy(&string_buf[len], pair->digits, 2);
+        len += pair->len;
 
-        if (pn_digit == 0xe) break;
-        *pstr++ = (pn_digit) + '0';
-        j++;
+        if (pair->len != 2) break;
+    }
 
-        if (j >= (string_buf_len - 1)) break;
+    string_buf[len] = '\0';
+    return len;
+}
+
+/*
+ * Pack the first digits characters of string as BCD into bcd_len bytes,
+ * high nibble first, filling the nibbles after them with fill: 0xe to
+ * end the number, as in access codes.  Returns the number of bytes used
+ * by the digits.
+ */
+size_t mm_bcd_pack(uint8_t *bcd, size_t bcd_len, const char *string, size_t digits, uint8_t fill) {
+    size_t i;
+
+    if (digits > bcd_len * 2) digits = bcd_len * 2;
+
+    for (i = 0; i + 1 < digits; i += 2) {
+        bcd[i >> 1] = (uint8_t)(((string[i] - '0') << 4) | (string[i + 1] - '0'));
     }
 
-    *pstr = '\0';
+    if (i < digits) {
+        bcd[i >> 1] = (uint8_t)(((string[i] - '0') << 4) | (fill & 0x0f));
+        i += 2;
+    }
+
+    if ((i >> 1) < bcd_len) {
+        memset(&bcd[i >> 1], ((fill & 0x0f) << 4) | (fill & 0x0f), bcd_len - (i >> 1));
+    }
+
+    return (digits + 1) / 2;
+}
+
+/* Convert encoded phone number into string. */
+extern char* phone_num_to_string(char *string_buf, size_t string_buf_len, uint8_t *num_buf, size_t num_buf_len) {
+    mm_bcd_unpack(string_buf, string_buf_len, num_buf, num_buf_len);
     return string_buf;
 }
 
@@ -261,7 +329,51 @@ char* call_type_to_string(uint8_t call_type, char *string_buf, size_t string_buf
     return string_buf;
 }
 
-char* timestamp_to_string(uint8_t *timestamp, char *string_buf, size_t string_buf_len) {
+static const char digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Write v, 0 to 99, as two digits. */
+static char* put_2digits(char *p, unsigned int v) {
+    memcpy(p, &digit_pairs[v * 2], 2);
+    return p + 2;
+}
+
+/*
+ * Write the date and time as YYYY<sep>MM<sep>DD<mid>hh<sep>mm<sep>ss,
+ * leaving out separators that are '\0'.  year must be 0 to 9999, and the
+ * other fields 0 to 99.
+ */
+static char* put_date_time(char *p, unsigned int year, const uint8_t *f, char date_sep, char mid, char time_sep) {
+    p = put_2digits(p, year / 100);
+    p = put_2digits(p, year % 100);
+    if (date_sep) *p++ = date_sep;
+    p = put_2digits(p, f[0]);
+    if (date_sep) *p++ = date_sep;
+    p = put_2digits(p, f[1]);
+    *p++ = mid;
+    p = put_2digits(p, f[2]);
+    if (time_sep) *p++ = time_sep;
+    p = put_2digits(p, f[3]);
+    if (time_sep) *p++ = time_sep;
+    p = put_2digits(p, f[4]);
+    *p = '\0';
+    return p;
+}
+
+/* Terminal timestamps whose fields all fit in two digits. */
+static int timestamp_is_2digit(const uint8_t *timestamp) {
+    return (timestamp[1] < 100) && (timestamp[2] < 100) && (timestamp[3] < 100) &&
+           (timestamp[4] < 100) && (timestamp[5] < 100);
+}
+
+char* timestamp_to_string(const uint8_t *timestamp, char *string_buf, size_t string_buf_len) {
+    if ((string_buf_len >= sizeof("YYYY-MM-DD hh:mm:ss")) && timestamp_is_2digit(timestamp)) {
+        put_date_time(string_buf, timestamp[0] + 1900, &timestamp[1], '-', ' ', ':');
+        return string_buf;
+    }
+
     snprintf(string_buf, string_buf_len, "%04d-%02d-%02d %02d:%02d:%02d",
              timestamp[0] + 1900,
              timestamp[1],
@@ -273,7 +385,12 @@ char* timestamp_to_string(uint8_t *timestamp, char *string_buf, size_t string_bu
     return string_buf;
 }
 
-char* timestamp_to_db_string(uint8_t *timestamp, char *string_buf, size_t string_buf_len) {
+char* timestamp_to_db_string(const uint8_t *timestamp, char *string_buf, size_t string_buf_len) {
+    if ((string_buf_len >= sizeof("YYYYMMDD,hhmmss")) && timestamp_is_2digit(timestamp)) {
+        put_date_time(string_buf, timestamp[0] + 1900, &timestamp[1], '\0', ',', '\0');
+        return string_buf;
+    }
+
     snprintf(string_buf, string_buf_len, "%04d%02d%02d,%02d%02d%02d",
              timestamp[0] + 1900,
              timestamp[1],
@@ -285,13 +402,62 @@ char* timestamp_to_db_string(uint8_t *timestamp, char *string_buf, size_t string
     return string_buf;
 }
 
+/*
+ * The last second converted to local time, and formatted for the
+ * database.  Records received in a batch mostly fall in the same
+ * second, so most conversions are a copy.
+ */
+static struct {
+    int       valid;
+    time_t    time;
+    struct tm tm;
+    char      db_string[sizeof("YYYYMMDD,hhmmss")];
+} mm_clock;
+
+static void mm_clock_update(time_t rawtime) {
+    uint8_t fields[5];
+
+    if (mm_clock.valid && (mm_clock.time == rawtime)) return;
+
+    memset(&mm_clock.tm, 0, sizeof(mm_clock.tm));
+    localtime_r(&rawtime, &mm_clock.tm);
+
+    fields[0] = (uint8_t)(mm_clock.tm.tm_mon + 1);
+    fields[1] = (uint8_t)mm_clock.tm.tm_mday;
+    fields[2] = (uint8_t)mm_clock.tm.tm_hour;
+    fields[3] = (uint8_t)mm_clock.tm.tm_min;
+    fields[4] = (uint8_t)mm_clock.tm.tm_sec;
+
+    if ((mm_clock.tm.tm_year >= -1900) && (mm_clock.tm.tm_year < 10000 - 1900)) {
+        put_date_time(mm_clock.db_string, (unsigned int)(mm_clock.tm.tm_year + 1900), fields, '\0', ',', '\0');
+    } else {
+        strftime(mm_clock.db_string, sizeof(mm_clock.db_string), "%Y%m%d,%H%M%S", &mm_clock.tm);
+    }
+
+    mm_clock.time = rawtime;
+    mm_clock.valid = 1;
+}
+
+/* localtime_r(), but converting the same second again is a copy. */
+struct tm* mm_localtime(time_t rawtime, struct tm *result) {
+    mm_clock_update(rawtime);
+    *result = mm_clock.tm;
+    return result;
+}
+
 char* received_time_to_db_string(char *string_buf, size_t string_buf_len) {
-    time_t rawtime;
-    struct tm ptm = { 0 };
+    return time_to_db_string(time(NULL), string_buf, string_buf_len);
+}
 
-    time(&rawtime);
-    localtime_r(&rawtime, &ptm);
-    strftime(string_buf, string_buf_len, "%Y%m%d,%H%M%S", &ptm);
+char* time_to_db_string(time_t rawtime, char *string_buf, size_t string_buf_len) {
+    mm_clock_update(rawtime);
+
+    if (string_buf_len >= sizeof(mm_clock.db_string)) {
+        memcpy(string_buf, mm_clock.db_string, sizeof(mm_clock.db_string));
+    } else if (string_buf_len > 0) {
+        memcpy(string_buf, mm_clock.db_string, string_buf_len - 1);
+        string_buf[string_buf_len - 1] = '\0';
+    }
     return string_buf;
 }
 